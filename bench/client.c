@@ -0,0 +1,274 @@
+/*
+ * Scripted X client workloads for the composition benchmark, see
+ * run-bench.sh. Each workload draws for the given number of seconds at a
+ * fixed rate, so every run produces the same damage pattern:
+ *
+ *  scroll  terminal scrolling, 60 lines/s: the window's contents copied
+ *          up by a line and the new line drawn
+ *  caret   a blinking 2x16 caret, toggled every 530 ms
+ *  video   a 1280x720 PutImage, at most the screen size, at 30 frames/s
+ *  drag    a 400x300 window moved across the screen at 60 steps/s
+ *  cursor  the pointer swept across the screen at 120 steps/s
+ *  idle    nothing, mapped windows only
+ *  bars    eight solid colour bars over the whole screen and no cursor,
+ *          then nothing, for the mock HAL frame checksum (bench-check)
+ *
+ * usage: hwc-bench-client <workload> <seconds>
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+
+#define LINE_HEIGHT 16
+#define CONNECT_TIMEOUT_S 15
+
+typedef struct {
+    Display *dpy;
+    int screen;
+    Window root;
+    Window win;
+    GC gc;
+    int width;
+    int height;
+} bench_client;
+
+static uint64_t bench_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Sleep until step of a workload taking a step every period us is due */
+static void bench_pace(uint64_t start, unsigned long step, uint64_t period)
+{
+    uint64_t due = start + step * period;
+    uint64_t now = bench_now_us();
+
+    if (due > now)
+        usleep(due - now);
+}
+
+/* The server is started right before us, retry until it accepts clients */
+static Display *bench_connect(void)
+{
+    Display *dpy;
+    int i;
+
+    for (i = 0; i < CONNECT_TIMEOUT_S * 10; i++) {
+        dpy = XOpenDisplay(NULL);
+        if (dpy)
+            return dpy;
+        usleep(100000);
+    }
+    return NULL;
+}
+
+static void bench_scroll(bench_client *c, unsigned seconds)
+{
+    uint64_t start = bench_now_us();
+    unsigned long step, steps = seconds * 60UL;
+    char line[128];
+
+    for (step = 0; step < steps; step++) {
+        XCopyArea(c->dpy, c->win, c->win, c->gc, 0, LINE_HEIGHT,
+                  c->width, c->height - LINE_HEIGHT, 0, 0);
+        XClearArea(c->dpy, c->win, 0, c->height - LINE_HEIGHT, c->width, LINE_HEIGHT, False);
+        snprintf(line, sizeof(line), "%08lu  the quick brown fox jumps over the lazy dog", step);
+        XDrawString(c->dpy, c->win, c->gc, 4, c->height - 4, line, strlen(line));
+        XFlush(c->dpy);
+        bench_pace(start, step + 1, 1000000 / 60);
+    }
+}
+
+static void bench_caret(bench_client *c, unsigned seconds)
+{
+    uint64_t start = bench_now_us();
+    unsigned long step, steps = seconds * 1000UL / 530;
+
+    for (step = 0; step < steps; step++) {
+        if (step & 1)
+            XClearArea(c->dpy, c->win, 100, 100, 2, LINE_HEIGHT, False);
+        else
+            XFillRectangle(c->dpy, c->win, c->gc, 100, 100, 2, LINE_HEIGHT);
+        XFlush(c->dpy);
+        bench_pace(start, step + 1, 530000);
+    }
+}
+
+static void bench_video(bench_client *c, unsigned seconds)
+{
+    int width = c->width < 1280 ? c->width : 1280;
+    int height = c->height < 720 ? c->height : 720;
+    Visual *visual = DefaultVisual(c->dpy, c->screen);
+    int depth = DefaultDepth(c->dpy, c->screen);
+    uint64_t start = bench_now_us();
+    unsigned long step, steps = seconds * 30UL;
+    XImage *image;
+    int x, y;
+
+    image = XCreateImage(c->dpy, visual, depth, ZPixmap, 0, NULL, width, height, 32, 0);
+    if (!image)
+        return;
+    image->data = malloc((size_t) image->bytes_per_line * height);
+    if (!image->data) {
+        XDestroyImage(image);
+        return;
+    }
+
+    for (step = 0; step < steps; step++) {
+        /* a moving gradient, so every frame differs */
+        for (y = 0; y < height; y++) {
+            for (x = 0; x < width; x++)
+                XPutPixel(image, x, y, (x + step * 4) * 0x010203 + y * 0x000100);
+        }
+        XPutImage(c->dpy, c->win, c->gc, image, 0, 0, 0, 0, width, height);
+        XFlush(c->dpy);
+        bench_pace(start, step + 1, 1000000 / 30);
+    }
+
+    XDestroyImage(image);
+}
+
+static void bench_drag(bench_client *c, unsigned seconds)
+{
+    int screenWidth = DisplayWidth(c->dpy, c->screen);
+    int screenHeight = DisplayHeight(c->dpy, c->screen);
+    uint64_t start = bench_now_us();
+    unsigned long step, steps = seconds * 60UL;
+    int rangeX = screenWidth > c->width ? screenWidth - c->width : 1;
+    int rangeY = screenHeight > c->height ? screenHeight - c->height : 1;
+
+    for (step = 0; step < steps; step++) {
+        XMoveWindow(c->dpy, c->win, (step * 7) % rangeX, (step * 5) % rangeY);
+        XFlush(c->dpy);
+        bench_pace(start, step + 1, 1000000 / 60);
+    }
+}
+
+static void bench_cursor(bench_client *c, unsigned seconds)
+{
+    int screenWidth = DisplayWidth(c->dpy, c->screen);
+    int screenHeight = DisplayHeight(c->dpy, c->screen);
+    uint64_t start = bench_now_us();
+    unsigned long step, steps = seconds * 120UL;
+
+    for (step = 0; step < steps; step++) {
+        XWarpPointer(c->dpy, None, c->root, 0, 0, 0, 0,
+                     (step * 11) % screenWidth, (step * 7) % screenHeight);
+        XFlush(c->dpy);
+        bench_pace(start, step + 1, 1000000 / 120);
+    }
+}
+
+static void bench_idle(bench_client *c, unsigned seconds)
+{
+    XSync(c->dpy, False);
+    sleep(seconds);
+}
+
+static void bench_bars(bench_client *c, unsigned seconds)
+{
+    /* as 0xRRGGBB pixels, the check runs at depth 24 */
+    static const unsigned long colors[] = {
+        0xffffff, 0xffff00, 0x00ffff, 0x00ff00, 0xff00ff, 0xff0000, 0x0000ff, 0x000000
+    };
+    static const char blank[] = { 0 };
+    int n = sizeof(colors) / sizeof(colors[0]);
+    int bar = c->width / n;
+    XColor black = { 0 };
+    Pixmap pixmap;
+    Cursor cursor;
+    int i;
+
+    pixmap = XCreateBitmapFromData(c->dpy, c->win, blank, 1, 1);
+    cursor = XCreatePixmapCursor(c->dpy, pixmap, pixmap, &black, &black, 0, 0);
+    XDefineCursor(c->dpy, c->win, cursor);
+
+    for (i = 0; i < n; i++) {
+        XSetForeground(c->dpy, c->gc, colors[i]);
+        XFillRectangle(c->dpy, c->win, c->gc, i * bar, 0,
+                       i == n - 1 ? c->width - i * bar : bar, c->height);
+    }
+    XSync(c->dpy, False);
+    sleep(seconds);
+}
+
+static const struct {
+    const char *name;
+    void (*run)(bench_client *c, unsigned seconds);
+    /* window size, 0 for the whole screen */
+    int width;
+    int height;
+} bench_workloads[] = {
+    { "scroll", bench_scroll, 0, 0 },
+    { "caret",  bench_caret,  0, 0 },
+    { "video",  bench_video,  0, 0 },
+    { "drag",   bench_drag,   400, 300 },
+    { "cursor", bench_cursor, 0, 0 },
+    { "idle",   bench_idle,   0, 0 },
+    { "bars",   bench_bars,   0, 0 },
+};
+
+int main(int argc, char **argv)
+{
+    XSetWindowAttributes attr;
+    bench_client c;
+    unsigned seconds;
+    XEvent ev;
+    size_t i;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <workload> <seconds>\n", argv[0]);
+        return 2;
+    }
+    for (i = 0; i < sizeof(bench_workloads) / sizeof(bench_workloads[0]); i++) {
+        if (!strcmp(argv[1], bench_workloads[i].name))
+            break;
+    }
+    if (i == sizeof(bench_workloads) / sizeof(bench_workloads[0])) {
+        fprintf(stderr, "unknown workload %s\n", argv[1]);
+        return 2;
+    }
+    seconds = atoi(argv[2]);
+
+    c.dpy = bench_connect();
+    if (!c.dpy) {
+        fprintf(stderr, "can't open display %s\n", XDisplayName(NULL));
+        return 1;
+    }
+    c.screen = DefaultScreen(c.dpy);
+    c.root = RootWindow(c.dpy, c.screen);
+    c.width = bench_workloads[i].width ? bench_workloads[i].width
+                                       : DisplayWidth(c.dpy, c.screen);
+    c.height = bench_workloads[i].height ? bench_workloads[i].height
+                                         : DisplayHeight(c.dpy, c.screen);
+
+    /* no window manager, place the window ourselves */
+    attr.override_redirect = True;
+    attr.background_pixel = WhitePixel(c.dpy, c.screen);
+    attr.event_mask = ExposureMask;
+    c.win = XCreateWindow(c.dpy, c.root, 0, 0, c.width, c.height, 0, CopyFromParent,
+                          InputOutput, CopyFromParent,
+                          CWOverrideRedirect | CWBackPixel | CWEventMask, &attr);
+    /* scrolling copies would queue a GraphicsExpose each */
+    c.gc = XCreateGC(c.dpy, c.win, 0, NULL);
+    XSetGraphicsExposures(c.dpy, c.gc, False);
+    XSetForeground(c.dpy, c.gc, BlackPixel(c.dpy, c.screen));
+    XMapWindow(c.dpy, c.win);
+    XWindowEvent(c.dpy, c.win, ExposureMask, &ev);
+
+    bench_workloads[i].run(&c, seconds);
+
+    XSync(c.dpy, False);
+    XCloseDisplay(c.dpy);
+    return 0;
+}
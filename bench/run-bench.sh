@@ -0,0 +1,255 @@
+#!/bin/sh
+#
+# Composition benchmark: starts Xorg with the hwcomposer driver for each
+# run, drives it with a scripted workload, and collects the driver's
+# StatsFile output in one JSON array. Needs root to start Xorg.
+#
+# usage: run-bench.sh [options] suite...
+#
+#  --driver DIR   directory holding hwcomposer_drv.so (default src/.libs)
+#  --client PATH  hwc-bench-client (default bench/hwc-bench-client)
+#  --out DIR      results directory (default bench/results)
+#  --seconds N    length of each run (default 10)
+#  --display :N   X display to use (default :9)
+#  --device       use the device's HAL, not Option "MockHAL"
+#
+# suites:
+#
+#  workloads  scroll, caret, video, drag, cursor and idle through the
+#             bench client, one run each
+#  shadow     x11perf blend and scroll tests with ShadowFB off and on
+#  fbthreads  x11perf large fills, copies and composites with FbThreads
+#             1, 2, 4 and 8
+#  check      colour bars on the mock HAL, with the frame checksum and
+#             HWC call counts compared against the expected values;
+#             exits with 1 if they don't match
+#
+# Every run adds one object to <out>/results.json:
+#
+#  {"suite":"shadow","run":"ShadowFB=true","stats":{...},"x11perf":{...}}
+#
+# where stats is the StatsFile object of the run and x11perf, for the
+# x11perf suites, maps each test to its operations per second.
+
+# The check's 720x1280 frame of eight colour bars, hashed as
+# hwc_mock_hal_present does: FNV-1a over the pixels as 0xBBGGRR words
+check_mode=720x1280@60
+check_checksum=29355ca1f0345b25
+
+top=$(cd "$(dirname "$0")/.." && pwd)
+driver=$top/src/.libs
+client=$top/bench/hwc-bench-client
+out=$top/bench/results
+seconds=10
+display=:9
+mock=yes
+failed=no
+
+while [ $# -gt 0 ]; do
+    case $1 in
+    --driver) driver=$2; shift 2 ;;
+    --client) client=$2; shift 2 ;;
+    --out) out=$2; shift 2 ;;
+    --seconds) seconds=$2; shift 2 ;;
+    --display) display=$2; shift 2 ;;
+    --device) mock=no; shift ;;
+    -*) echo "unknown option $1" >&2; exit 2 ;;
+    *) break ;;
+    esac
+done
+[ $# -gt 0 ] || set -- workloads
+
+if [ ! -e "$driver/hwcomposer_drv.so" ]; then
+    echo "no hwcomposer_drv.so in $driver, build the driver first" >&2
+    exit 1
+fi
+# only a driver configured with --enable-mock-hal has the mock HAL's
+# messages in it
+if [ $mock = yes ] &&
+   ! grep -q -a -F 'mock HAL: %dx%d' "$driver/hwcomposer_drv.so"; then
+    echo "$driver/hwcomposer_drv.so was built without the mock HAL:" \
+         "reconfigure with --enable-mock-hal, or run on the device's HAL" \
+         "with --device" >&2
+    exit 1
+fi
+if [ ! -x "$client" ]; then
+    echo "no bench client at $client" >&2
+    exit 1
+fi
+
+modules=$(pkg-config --variable=moduledir xorg-server 2>/dev/null)
+[ -n "$modules" ] || modules=/usr/lib/xorg/modules
+
+mkdir -p "$out"
+results=$out/results.json
+echo "[" > "$results"
+first=yes
+server=
+
+cleanup() {
+    [ -n "$server" ] && kill "$server" 2>/dev/null
+}
+trap cleanup EXIT INT TERM
+
+# start_server name option-lines
+start_server() {
+    conf=$out/$1.conf
+    stats=$out/$1.stats.json
+    rm -f "$stats"
+
+    {
+        echo 'Section "ServerFlags"'
+        echo '    Option "AutoAddDevices" "false"'
+        # no screen saver timers, they would wake the server too
+        echo '    Option "BlankTime" "0"'
+        echo '    Option "StandbyTime" "0"'
+        echo '    Option "SuspendTime" "0"'
+        echo '    Option "OffTime" "0"'
+        echo 'EndSection'
+        echo 'Section "Device"'
+        echo '    Identifier "hwc"'
+        echo '    Driver "hwcomposer"'
+        [ $mock = yes ] && echo '    Option "MockHAL" "true"'
+        echo "    Option \"StatsFile\" \"$stats\""
+        echo '    Option "MeasureLatency" "true"'
+        [ -n "$2" ] && echo "$2" | sed 's/^/    /'
+        echo 'EndSection'
+        echo 'Section "Screen"'
+        echo '    Identifier "screen"'
+        echo '    Device "hwc"'
+        echo '    DefaultDepth 24'
+        echo 'EndSection'
+    } > "$conf"
+
+    Xorg "$display" -config "$conf" -modulepath "$driver,$modules" -noreset \
+         -nolisten tcp -logfile "$out/$1.log" >/dev/null 2>&1 &
+    server=$!
+
+    # the client retries until the server accepts connections
+    if ! DISPLAY=$display "$client" idle 0; then
+        echo "Xorg didn't start, see $out/$1.log" >&2
+        exit 1
+    fi
+}
+
+# The stats are written when the screen closes
+stop_server() {
+    kill -TERM "$server"
+    wait "$server" 2>/dev/null
+    server=
+}
+
+# Compare the mock HAL entry of the check run with the expected values
+check_stats() {
+    entry=$(tail -n 1 "$stats" 2>/dev/null | sed -n 's/.*"mock_hal":{\([^}]*\)}.*/\1/p')
+    if [ -z "$entry" ]; then
+        echo "check: no mock_hal entry in $stats" >&2
+        failed=yes
+        return
+    fi
+
+    checksum=$(echo "$entry" | sed -n 's/.*"checksum":"\([0-9a-f]*\)".*/\1/p')
+    frames=$(echo "$entry" | sed -n 's/.*"frames":\([0-9]*\).*/\1/p')
+    ordered=$(echo "$entry" | sed -n 's/.*"prepare_before_set":\([a-z]*\).*/\1/p')
+    vsync=$(echo "$entry" | sed -n 's/.*"vsync_age_ms":\(-\{0,1\}[0-9]*\).*/\1/p')
+
+    if [ "$checksum" != "$check_checksum" ]; then
+        echo "check: frame checksum $checksum, expected $check_checksum" >&2
+        failed=yes
+    fi
+    if [ "${frames:-0}" -lt 1 ]; then
+        echo "check: no frames set" >&2
+        failed=yes
+    fi
+    if [ "$ordered" != true ]; then
+        echo "check: set() without a prepare() before it" >&2
+        failed=yes
+    fi
+    if [ "${vsync:--1}" -lt 0 ] || [ "$vsync" -gt 1000 ]; then
+        echo "check: last vsync ${vsync} ms ago, the vsync thread isn't running" >&2
+        failed=yes
+    fi
+    [ $failed = yes ] || echo "check: passed, $frames frames"
+}
+
+# x11perf output as a JSON object of test name to operations per second
+x11perf_json() {
+    sed -n 's/.* reps @ .*( *\([0-9.]*\)\/sec): \(.*\)$/"\2":\1/p' |
+        sed 's/\\/\\\\/g' | paste -sd, - | sed 's/^/{/; s/$/}/'
+}
+
+# add_result suite run [x11perf-json]
+add_result() {
+    [ $first = yes ] || echo "," >> "$results"
+    first=no
+    printf '{"suite":"%s","run":"%s","stats":' "$1" "$2" >> "$results"
+    if [ -s "$stats" ]; then
+        tail -n 1 "$stats" | tr -d '\n' >> "$results"
+    else
+        printf 'null' >> "$results"
+    fi
+    [ -n "$3" ] && printf ',"x11perf":%s' "$3" >> "$results"
+    printf '}' >> "$results"
+    echo "$1: $2 done"
+}
+
+# x11perf_run suite run option-line tests...
+x11perf_run() {
+    suite=$1 run=$2 option=$3
+    shift 3
+    start_server "$suite-$(echo "$run" | tr '=' '-')" "$option"
+    perf=$(DISPLAY=$display x11perf -repeat 1 -time "$seconds" "$@" | x11perf_json)
+    stop_server
+    add_result "$suite" "$run" "$perf"
+}
+
+for suite; do
+    case $suite in
+    workloads)
+        for workload in scroll caret video drag cursor idle; do
+            start_server "workloads-$workload" ""
+            DISPLAY=$display "$client" "$workload" "$seconds"
+            stop_server
+            add_result workloads "$workload"
+        done
+        ;;
+    shadow)
+        command -v x11perf >/dev/null || { echo "x11perf is needed" >&2; exit 1; }
+        for shadow in false true; do
+            x11perf_run shadow "ShadowFB=$shadow" "Option \"ShadowFB\" \"$shadow\"" \
+                -copywinwin500 -scroll500 -compwinwin500 -aa10text
+        done
+        ;;
+    fbthreads)
+        command -v x11perf >/dev/null || { echo "x11perf is needed" >&2; exit 1; }
+        for threads in 1 2 4 8; do
+            x11perf_run fbthreads "FbThreads=$threads" "Option \"FbThreads\" \"$threads\"" \
+                -rect500 -copypixwin500 -copywinwin500 -compwinwin500
+        done
+        ;;
+    check)
+        if [ $mock = no ]; then
+            echo "the check needs the mock HAL" >&2
+            exit 1
+        fi
+        start_server check "Option \"MockHALMode\" \"$check_mode\"
+Option \"MockHALReadback\" \"true\""
+        # the server stops while the bars are up, so theirs is the last frame
+        DISPLAY=$display "$client" bars 10 &
+        bars=$!
+        sleep 3
+        stop_server
+        wait $bars 2>/dev/null
+        add_result check bars
+        check_stats
+        ;;
+    *)
+        echo "unknown suite $suite" >&2
+        exit 2
+        ;;
+    esac
+done
+
+echo "]" >> "$results"
+echo "results in $results"
+[ $failed = no ]
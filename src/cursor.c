@@ -0,0 +1,249 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <xf86.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+
+#include "driver.h"
+
+static void hwc_cursor_wakeup_flag(HWCPtr hwc, Bool *dirty);
+
+/*
+ * Cursor state is written from the input thread (set_cursor_position,
+ * show_cursor and hide_cursor are called with the input lock held, so
+ * there is only ever one writer) and read from the main thread while
+ * composing. It is published through a seqlock: the writer makes the
+ * sequence odd while it updates the fields, the reader retries until it
+ * sees the same even sequence before and after copying them.
+ *
+ * Each CRTC has its own state, hwc->cursorState for the panel and
+ * hwc->external.cursorState for the external display.
+ */
+void hwc_cursor_publish(HWCPtr hwc, hwc_cursor_state *state, int x, int y, Bool shown)
+{
+    uint32_t seq = __atomic_load_n(&state->seq, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&state->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    __atomic_store_n(&state->x, x, __ATOMIC_RELAXED);
+    __atomic_store_n(&state->y, y, __ATOMIC_RELAXED);
+    __atomic_store_n(&state->shown, shown, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&state->seq, seq + 2, __ATOMIC_RELEASE);
+
+    if (state == &hwc->external.cursorState)
+        hwc_cursor_wakeup_flag(hwc, &hwc->external.dirty);
+    else
+        hwc_cursor_wakeup(hwc);
+}
+
+void hwc_cursor_snapshot(hwc_cursor_state *state, hwc_cursor_state *out)
+{
+    uint32_t seq;
+
+    for (;;) {
+        seq = __atomic_load_n(&state->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+
+        out->x = __atomic_load_n(&state->x, __ATOMIC_RELAXED);
+        out->y = __atomic_load_n(&state->y, __ATOMIC_RELAXED);
+        out->shown = __atomic_load_n(&state->shown, __ATOMIC_RELAXED);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&state->seq, __ATOMIC_RELAXED) == seq)
+            break;
+    }
+    out->seq = seq;
+}
+
+/*
+ * Mark a display dirty and, if it was clean, poke the main loop through
+ * the eventfd so the new cursor position gets composed right away instead
+ * of on the next timer tick.
+ */
+static void hwc_cursor_wakeup_flag(HWCPtr hwc, Bool *dirty)
+{
+    uint64_t one = 1;
+
+    hwc_stats_damage(hwc);
+
+    if (__atomic_exchange_n(dirty, TRUE, __ATOMIC_ACQ_REL))
+        return;
+
+    if (hwc->cursorWakeFd >= 0) {
+        if (write(hwc->cursorWakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            ErrorF("hwcomposer: failed to signal cursor wakeup: %d\n", errno);
+    }
+}
+
+void hwc_cursor_wakeup(HWCPtr hwc)
+{
+    hwc_cursor_wakeup_flag(hwc, &hwc->dirty);
+}
+
+static void hwc_cursor_notify(int fd, int ready, void *data)
+{
+    ScreenPtr pScreen = (ScreenPtr) data;
+    uint64_t count;
+
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        return;
+
+    hwc_stats_wakeup(HWCPTR(xf86ScreenToScrn(pScreen)));
+    hwc_update(pScreen);
+}
+
+Bool hwc_cursor_wakeup_init(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    HWCPtr hwc = HWCPTR(pScrn);
+
+    hwc->cursorWakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (hwc->cursorWakeFd < 0) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                   "failed to create cursor eventfd, cursor updates will wait for the timer\n");
+        return FALSE;
+    }
+
+    if (!SetNotifyFd(hwc->cursorWakeFd, hwc_cursor_notify, X_NOTIFY_READ, pScreen)) {
+        close(hwc->cursorWakeFd);
+        hwc->cursorWakeFd = -1;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+void hwc_cursor_wakeup_close(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    HWCPtr hwc = HWCPTR(pScrn);
+
+    if (hwc->cursorWakeFd >= 0) {
+        RemoveNotifyFd(hwc->cursorWakeFd);
+        close(hwc->cursorWakeFd);
+        hwc->cursorWakeFd = -1;
+    }
+}
+
+/*
+ * Cursor images are cached in a small LRU of preallocated textures keyed
+ * by a hash of the ARGB image, so switching between a handful of cursors
+ * or playing an animated one only rebinds a texture. Misses overwrite the
+ * least recently used entry with glTexSubImage2D instead of reallocating.
+ */
+static uint64_t hwc_cursor_hash(const CARD32 *image, int count)
+{
+    const uint64_t *p = (const uint64_t *) image;
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ (uint64_t) count;
+    int i;
+
+    for (i = 0; i < count / 2; i++) {
+        h ^= p[i] * 0xff51afd7ed558ccdULL;
+        h = (h << 31) | (h >> 33);
+        h *= 0xc4ceb9fe1a85ec53ULL;
+    }
+    if (count & 1)
+        h ^= image[count - 1];
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+void hwc_cursor_cache_init(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+    int i;
+
+    /* kept across server generations, cached images stay valid */
+    if (renderer->cursorCache[0].texture)
+        return;
+
+    for (i = 0; i < HWC_CURSOR_CACHE_SIZE; i++) {
+        hwc_cursor_cache_entry *entry = &renderer->cursorCache[i];
+
+        glGenTextures(1, &entry->texture);
+        glBindTexture(GL_TEXTURE_2D, entry->texture);
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, hwc->cursorWidth, hwc->cursorHeight,
+                     0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        entry->hash = 0;
+        entry->lastUse = 0;
+        entry->valid = FALSE;
+    }
+
+    renderer->cursorTexture = renderer->cursorCache[0].texture;
+    renderer->cursorCacheClock = 0;
+    renderer->cursorCacheHits = 0;
+    renderer->cursorCacheMisses = 0;
+}
+
+void hwc_cursor_cache_close(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+    unsigned long total = renderer->cursorCacheHits + renderer->cursorCacheMisses;
+    int i;
+
+    if (total) {
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                   "cursor cache: %lu hits, %lu misses (%.1f%% hit rate)\n",
+                   renderer->cursorCacheHits, renderer->cursorCacheMisses,
+                   100.0 * renderer->cursorCacheHits / total);
+    }
+
+    for (i = 0; i < HWC_CURSOR_CACHE_SIZE; i++) {
+        if (renderer->cursorCache[i].texture) {
+            glDeleteTextures(1, &renderer->cursorCache[i].texture);
+            renderer->cursorCache[i].texture = 0;
+        }
+        renderer->cursorCache[i].valid = FALSE;
+    }
+    renderer->cursorTexture = 0;
+}
+
+void hwc_cursor_cache_load(HWCPtr hwc, CARD32 *image)
+{
+    hwc_renderer_ptr renderer = &hwc->renderer;
+    uint64_t hash = hwc_cursor_hash(image, hwc->cursorWidth * hwc->cursorHeight);
+    hwc_cursor_cache_entry *victim = &renderer->cursorCache[0];
+    int i;
+
+    renderer->cursorCacheClock++;
+
+    for (i = 0; i < HWC_CURSOR_CACHE_SIZE; i++) {
+        hwc_cursor_cache_entry *entry = &renderer->cursorCache[i];
+
+        if (entry->valid && entry->hash == hash) {
+            entry->lastUse = renderer->cursorCacheClock;
+            renderer->cursorTexture = entry->texture;
+            renderer->cursorCacheHits++;
+            return;
+        }
+
+        if (!entry->valid)
+            victim = entry;
+        else if (victim->valid && entry->lastUse < victim->lastUse)
+            victim = entry;
+    }
+
+    glBindTexture(GL_TEXTURE_2D, victim->texture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, hwc->cursorWidth, hwc->cursorHeight,
+                    GL_RGBA, GL_UNSIGNED_BYTE, image);
+
+    victim->hash = hash;
+    victim->lastUse = renderer->cursorCacheClock;
+    victim->valid = TRUE;
+    renderer->cursorTexture = victim->texture;
+    renderer->cursorCacheMisses++;
+}
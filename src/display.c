@@ -5,6 +5,10 @@
 #include <xf86.h>
 #include "xf86Crtc.h"
 
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+
 #include "driver.h"
 
 Bool hwc_lights_init(ScrnInfoPtr pScrn)
@@ -17,6 +21,13 @@ Bool hwc_lights_init(ScrnInfoPtr pScrn)
 	/* Use 255 as default */
 	hwc->screenBrightness = 255;
 
+#ifdef ENABLE_MOCK_HAL
+	if (hwc->mockHal) {
+		hwc->lightsDevice = hwc_mock_hal_lights(pScrn);
+		return hwc->lightsDevice != NULL;
+	}
+#endif
+
 	if (hw_get_module(LIGHTS_HARDWARE_MODULE_ID, (const hw_module_t **)&lightsModule) != 0) {
 		xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "Failed to get lights module\n");
 		return FALSE;
@@ -31,16 +42,25 @@ Bool hwc_lights_init(ScrnInfoPtr pScrn)
 	return TRUE;
 }
 
+static void hwc_external_set_view(ScrnInfoPtr pScrn, int x, int y, int width, int height);
+
 static Bool
 hwc_xf86crtc_resize(ScrnInfoPtr pScrn, int width, int height)
 {
-    ScreenPtr pScreen = pScrn->pScreen;
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_external_display *ext = &hwc->external;
 
     if (pScrn->virtualX == width && pScrn->virtualY == height)
         return TRUE;
 
-    /* We don't support real resizing yet */
-    return FALSE;
+    if (!hwc_root_resize(pScrn, width, height))
+        return FALSE;
+
+    /* keep the viewports inside the new root until RandR sets the modes */
+    hwc_set_view(pScrn, hwc->viewX, hwc->viewY, hwc->viewWidth, hwc->viewHeight);
+    if (ext->output)
+        hwc_external_set_view(pScrn, ext->viewX, ext->viewY, ext->viewWidth, ext->viewHeight);
+    return TRUE;
 }
 
 static const xf86CrtcConfigFuncsRec hwc_xf86crtc_config_funcs = {
@@ -51,6 +71,97 @@ static void hwcomposer_crtc_dpms(xf86CrtcPtr crtc, int mode)
 {
 }
 
+/* External display composed from its own swap chain */
+Bool hwc_external_extended(HWCPtr hwc)
+{
+    return hwc->external.connected && hwc->external.enabled && !hwc->external.clone;
+}
+
+/* External display shown with the panel's buffer */
+Bool hwc_external_cloned(HWCPtr hwc)
+{
+    return hwc->external.connected && hwc->external.enabled && hwc->external.clone;
+}
+
+/*
+ * An external CRTC showing exactly the panel's viewport mirrors it: the
+ * panel's composed buffer is presented on both displays, scaled by
+ * HWComposer, instead of composing the same pixels twice.
+ */
+static void hwc_external_update_clone(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_external_display *ext = &hwc->external;
+    Bool clone = ext->viewX == hwc->viewX && ext->viewY == hwc->viewY &&
+                 ext->viewWidth == hwc->viewWidth && ext->viewHeight == hwc->viewHeight;
+
+    if (clone == ext->clone)
+        return;
+
+    ext->clone = clone;
+    if (ext->enabled)
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO, "external display %s the panel\n",
+                   clone ? "mirrors" : "extends");
+
+    /* the swap chain is only needed when extending */
+    if (clone)
+        hwc_egl_renderer_destroy_external(pScrn);
+
+    __atomic_store_n(&hwc->dirty, TRUE, __ATOMIC_RELEASE);
+    __atomic_store_n(&ext->dirty, TRUE, __ATOMIC_RELEASE);
+}
+
+/*
+ * Flag the displays showing part of damage for a new frame. Without an
+ * external display of its own everything goes to the panel, including
+ * damage outside the viewport, which uploads keep for later.
+ */
+void hwc_display_damage(ScrnInfoPtr pScrn, RegionPtr damage)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_external_display *ext = &hwc->external;
+    BoxRec view = { hwc->viewX, hwc->viewY,
+                    hwc->viewX + hwc->viewWidth, hwc->viewY + hwc->viewHeight };
+    BoxRec extView = { ext->viewX, ext->viewY,
+                       ext->viewX + ext->viewWidth, ext->viewY + ext->viewHeight };
+
+    if (!hwc_external_extended(hwc)) {
+        __atomic_store_n(&hwc->dirty, TRUE, __ATOMIC_RELEASE);
+        return;
+    }
+
+    if (RegionContainsRect(damage, &view) != rgnOUT)
+        __atomic_store_n(&hwc->dirty, TRUE, __ATOMIC_RELEASE);
+    if (RegionContainsRect(damage, &extView) != rgnOUT)
+        __atomic_store_n(&ext->dirty, TRUE, __ATOMIC_RELEASE);
+}
+
+/*
+ * Show the width x height part of the root at x, y. When the root is
+ * bigger than the mode only this viewport is composed, and uploads of the
+ * rest are deferred until it is panned into view.
+ */
+void hwc_set_view(ScrnInfoPtr pScrn, int x, int y, int width, int height)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+
+    width = min(max(width, 1), pScrn->virtualX);
+    height = min(max(height, 1), pScrn->virtualY);
+    x = min(max(x, 0), pScrn->virtualX - width);
+    y = min(max(y, 0), pScrn->virtualY - height);
+
+    if (x == hwc->viewX && y == hwc->viewY &&
+        width == hwc->viewWidth && height == hwc->viewHeight)
+        return;
+
+    hwc->viewX = x;
+    hwc->viewY = y;
+    hwc->viewWidth = width;
+    hwc->viewHeight = height;
+    __atomic_store_n(&hwc->dirty, TRUE, __ATOMIC_RELEASE);
+    hwc_external_update_clone(pScrn);
+}
+
 static Bool hwcomposer_set_mode_major(xf86CrtcPtr crtc, DisplayModePtr mode, Rotation rotation, int x, int y)
 {
     crtc->mode = *mode;
@@ -58,28 +169,48 @@ static Bool hwcomposer_set_mode_major(xf86CrtcPtr crtc, DisplayModePtr mode, Rot
     crtc->y = y;
     crtc->rotation = rotation;
 
+    hwc_refresh_set_mode(crtc->scrn, mode);
+    hwc_set_view(crtc->scrn, x, y, mode->HDisplay, mode->VDisplay);
     return TRUE;
 }
 
+/* Panning, from RandR or AdjustFrame */
+static void hwcomposer_set_origin(xf86CrtcPtr crtc, int x, int y)
+{
+    crtc->x = x;
+    crtc->y = y;
+
+    hwc_set_view(crtc->scrn, x, y, crtc->mode.HDisplay, crtc->mode.VDisplay);
+}
+
 static void
 hwc_set_cursor_colors(xf86CrtcPtr crtc, int bg, int fg)
 {
 
 }
 
+/* Each CRTC has its own cursor position, the external one is driver_private */
+static hwc_cursor_state *
+hwc_crtc_cursor_state(xf86CrtcPtr crtc)
+{
+    hwc_external_display *ext = crtc->driver_private;
+
+    return ext ? &ext->cursorState : &HWCPTR(crtc->scrn)->cursorState;
+}
+
 static void
 hwc_set_cursor_position(xf86CrtcPtr crtc, int x, int y)
 {
     HWCPtr hwc = HWCPTR(crtc->scrn);
-    hwc->cursorX = x;
-    hwc->cursorY = y;
-    hwc->dirty = TRUE;
+    hwc_cursor_state *state = hwc_crtc_cursor_state(crtc);
+    hwc_cursor_publish(hwc, state, x, y, state->shown);
 }
 
 /*
  * The load_cursor_argb_check driver hook.
  *
- * Sets the hardware cursor by uploading it to texture.
+ * Sets the hardware cursor by uploading it to texture, or by picking
+ * an already uploaded copy from the cursor cache.
  * On failure, returns FALSE indicating that the X server should fall
  * back to software cursors.
  */
@@ -88,13 +219,10 @@ hwc_load_cursor_argb_check(xf86CrtcPtr crtc, CARD32 *image)
 {
     HWCPtr hwc = HWCPTR(crtc->scrn);
 
-    glBindTexture(GL_TEXTURE_2D, hwc->renderer.cursorTexture);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, hwc->cursorWidth, hwc->cursorHeight,
-                    0, GL_RGBA, GL_UNSIGNED_BYTE, image);
+    hwc_cursor_cache_load(hwc, image);
 
-    hwc->dirty = TRUE;
+    hwc_cursor_wakeup(hwc);
+    __atomic_store_n(&hwc->external.dirty, TRUE, __ATOMIC_RELEASE);
     return TRUE;
 }
 
@@ -102,21 +230,31 @@ static void
 hwc_hide_cursor(xf86CrtcPtr crtc)
 {
     HWCPtr hwc = HWCPTR(crtc->scrn);
-    hwc->cursorShown = FALSE;
-    hwc->dirty = TRUE;
+    hwc_cursor_state *state = hwc_crtc_cursor_state(crtc);
+    hwc_cursor_publish(hwc, state, state->x, state->y, FALSE);
 }
 
 static void
 hwc_show_cursor(xf86CrtcPtr crtc)
 {
     HWCPtr hwc = HWCPTR(crtc->scrn);
-    hwc->cursorShown = TRUE;
-    hwc->dirty = TRUE;
+    hwc_cursor_state *state = hwc_crtc_cursor_state(crtc);
+    hwc_cursor_publish(hwc, state, state->x, state->y, TRUE);
+}
+
+/* The panel's ramp is applied by the composition shader as a LUT */
+static void
+hwcomposer_crtc_gamma_set(xf86CrtcPtr crtc, CARD16 *red, CARD16 *green, CARD16 *blue,
+                          int size)
+{
+    hwc_egl_renderer_set_gamma(crtc->scrn, red, green, blue, size);
 }
 
 static const xf86CrtcFuncsRec hwcomposer_crtc_funcs = {
     .dpms = hwcomposer_crtc_dpms,
+    .gamma_set = hwcomposer_crtc_gamma_set,
     .set_mode_major = hwcomposer_set_mode_major,
+    .set_origin = hwcomposer_set_origin,
     .set_cursor_colors = hwc_set_cursor_colors,
     .set_cursor_position = hwc_set_cursor_position,
     .show_cursor = hwc_show_cursor,
@@ -130,15 +268,27 @@ hwc_output_dpms(xf86OutputPtr output, int mode)
     ScrnInfoPtr pScrn;
     pScrn = output->scrn;
     HWCPtr hwc = HWCPTR(pScrn);
+    Bool resumed;
 
     hwc->dpmsMode = mode;
-    hwc_toggle_screen_brightness(pScrn);
 
-    hwc_set_power_mode(pScrn, HWC_DISPLAY_PRIMARY, (mode == DPMSModeOn) ? 1 : 0);
+    if (mode != DPMSModeOn) {
+        hwc_toggle_screen_brightness(pScrn);
+        hwc_set_power_mode(pScrn, HWC_DISPLAY_PRIMARY, 0);
+        hwc_power_suspend(pScrn, HWC_SUSPEND_DPMS);
+        return;
+    }
+
+    /* Power the panel on first, a frame presented while it is off is
+       dropped by some HALs, then compose the current contents for it */
+    hwc_set_power_mode(pScrn, HWC_DISPLAY_PRIMARY, 1);
+    resumed = hwc_power_resume(pScrn, HWC_SUSPEND_DPMS);
+    hwc_toggle_screen_brightness(pScrn);
 
-    if (mode == DPMSModeOn)
-        // Force redraw after unblank
-        hwc->dirty = TRUE;
+    if (resumed) {
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO, "backlight on %.1f ms after wakeup\n",
+                   (hwc_stats_now_us() - hwc->resumeTime) / 1000.0);
+    }
 }
 
 static xf86OutputStatus
@@ -170,12 +320,241 @@ static const xf86OutputFuncsRec hwc_output_funcs = {
     .get_modes = hwc_output_get_modes
 };
 
+static void
+hwc_external_set_view(ScrnInfoPtr pScrn, int x, int y, int width, int height)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_external_display *ext = &hwc->external;
+
+    width = min(max(width, 1), pScrn->virtualX);
+    height = min(max(height, 1), pScrn->virtualY);
+    ext->viewX = min(max(x, 0), pScrn->virtualX - width);
+    ext->viewY = min(max(y, 0), pScrn->virtualY - height);
+    ext->viewWidth = width;
+    ext->viewHeight = height;
+
+    __atomic_store_n(&ext->dirty, TRUE, __ATOMIC_RELEASE);
+    hwc_external_update_clone(pScrn);
+}
+
+static void hwc_external_crtc_dpms(xf86CrtcPtr crtc, int mode)
+{
+    ScrnInfoPtr pScrn = crtc->scrn;
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_external_display *ext = &hwc->external;
+    Bool enabled = mode == DPMSModeOn;
+
+    if (enabled == ext->enabled)
+        return;
+
+    ext->enabled = enabled;
+    if (ext->connected)
+        hwc_set_power_mode(pScrn, HWC_DISPLAY_EXTERNAL, enabled);
+    if (!enabled)
+        hwc_egl_renderer_destroy_external(pScrn);
+
+    /* a mirrored panel stops or starts presenting to both */
+    __atomic_store_n(&hwc->dirty, TRUE, __ATOMIC_RELEASE);
+    __atomic_store_n(&ext->dirty, TRUE, __ATOMIC_RELEASE);
+}
+
+static Bool hwc_external_set_mode_major(xf86CrtcPtr crtc, DisplayModePtr mode, Rotation rotation, int x, int y)
+{
+    crtc->mode = *mode;
+    crtc->x = x;
+    crtc->y = y;
+    crtc->rotation = rotation;
+
+    hwc_external_set_view(crtc->scrn, x, y, mode->HDisplay, mode->VDisplay);
+    hwc_external_crtc_dpms(crtc, DPMSModeOn);
+    return TRUE;
+}
+
+static void hwc_external_set_origin(xf86CrtcPtr crtc, int x, int y)
+{
+    crtc->x = x;
+    crtc->y = y;
+
+    hwc_external_set_view(crtc->scrn, x, y, crtc->mode.HDisplay, crtc->mode.VDisplay);
+}
+
+static const xf86CrtcFuncsRec hwc_external_crtc_funcs = {
+    .dpms = hwc_external_crtc_dpms,
+    .set_mode_major = hwc_external_set_mode_major,
+    .set_origin = hwc_external_set_origin,
+    .set_cursor_colors = hwc_set_cursor_colors,
+    .set_cursor_position = hwc_set_cursor_position,
+    .show_cursor = hwc_show_cursor,
+    .hide_cursor = hwc_hide_cursor,
+    .load_cursor_argb_check = hwc_load_cursor_argb_check
+};
+
+static void
+hwc_external_output_dpms(xf86OutputPtr output, int mode)
+{
+}
+
+static xf86OutputStatus
+hwc_external_output_detect(xf86OutputPtr output)
+{
+    HWCPtr hwc = HWCPTR(output->scrn);
+
+    return hwc->external.connected ? XF86OutputStatusConnected : XF86OutputStatusDisconnected;
+}
+
+/*
+ * The display's own mode, plus the panel's so it can mirror the panel
+ * (scaled up by HWComposer) without changing the panel mode. Any mode is
+ * scaled to the display when extending.
+ */
+static DisplayModePtr
+hwc_external_output_get_modes(xf86OutputPtr output)
+{
+    HWCPtr hwc = HWCPTR(output->scrn);
+    hwc_external_display *ext = &hwc->external;
+    DisplayModePtr modes;
+
+    if (!ext->connected)
+        return NULL;
+
+    if (ext->dpi) {
+        output->mm_width = ext->width * 254 / (ext->dpi * 10);
+        output->mm_height = ext->height * 254 / (ext->dpi * 10);
+    }
+
+    modes = xf86CVTMode(ext->width, ext->height, ext->refresh, 0, 0);
+    modes->type |= M_T_PREFERRED;
+
+    if (hwc->modes->HDisplay != ext->width || hwc->modes->VDisplay != ext->height)
+        modes = xf86ModesAdd(modes, xf86DuplicateModes(NULL, hwc->modes));
+
+    return modes;
+}
+
+static const xf86OutputFuncsRec hwc_external_output_funcs = {
+    .dpms = hwc_external_output_dpms,
+    .detect = hwc_external_output_detect,
+    .mode_valid = hwc_output_mode_valid,
+    .get_modes = hwc_external_output_get_modes
+};
+
+/*
+ * Hotplug events arrive on a HWComposer thread, which pokes this eventfd.
+ * The display is queried here, on the main thread, and RandR re-probes
+ * the output so clients see it come and go.
+ */
+static void hwc_hotplug_notify(int fd, int ready, void *data)
+{
+    ScreenPtr pScreen = (ScreenPtr) data;
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    HWCPtr hwc = HWCPTR(pScrn);
+    uint64_t count;
+
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        return;
+
+    if (!hwc_external_probe(pScrn))
+        return;
+
+    /* sized for the old display, if any */
+    hwc_egl_renderer_destroy_external(pScrn);
+    if (hwc->external.connected && hwc->external.enabled)
+        hwc_set_power_mode(pScrn, HWC_DISPLAY_EXTERNAL, 1);
+
+    RRGetInfo(pScreen, TRUE);
+
+    __atomic_store_n(&hwc->dirty, TRUE, __ATOMIC_RELEASE);
+    __atomic_store_n(&hwc->external.dirty, TRUE, __ATOMIC_RELEASE);
+}
+
+Bool hwc_hotplug_init(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    HWCPtr hwc = HWCPTR(pScrn);
+    int fd;
+
+    fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fd < 0) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                   "failed to create hotplug eventfd, external displays are not detected\n");
+        return FALSE;
+    }
+
+    if (!SetNotifyFd(fd, hwc_hotplug_notify, X_NOTIFY_READ, pScreen)) {
+        close(fd);
+        return FALSE;
+    }
+    __atomic_store_n(&hwc->hotplugFd, fd, __ATOMIC_RELEASE);
+
+    /* events from here on wake up the main loop, RandR probes the
+       output itself while the screen is set up */
+    hwc_register_procs(pScrn);
+    hwc_external_probe(pScrn);
+
+    return TRUE;
+}
+
+void hwc_hotplug_close(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    HWCPtr hwc = HWCPTR(pScrn);
+    int fd = __atomic_exchange_n(&hwc->hotplugFd, -1, __ATOMIC_ACQ_REL);
+
+    if (fd >= 0) {
+        RemoveNotifyFd(fd);
+        close(fd);
+    }
+}
+
+static int hwc_scale_size(int size, double scale)
+{
+    return max((int) (size * scale + 0.5), 8);
+}
+
+/*
+ * Modes at a few fractions of the panel-sized mode, each upscaled to the
+ * panel by the renderer, so RandR clients can trade sharpness for speed.
+ * The one matching Option "RenderScale" is preferred.
+ */
+static DisplayModePtr hwc_display_modes(ScrnInfoPtr pScrn, int width, int height)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    const double scales[] = { 1.0, 0.75, 0.5 };
+    int preferredWidth = hwc_scale_size(width, hwc->renderScale);
+    int preferredHeight = hwc_scale_size(height, hwc->renderScale);
+    DisplayModePtr modes, mode, m;
+    int i;
+
+    modes = hwc_refresh_modes(pScrn, preferredWidth, preferredHeight);
+    for (i = 0; i < ARRAY_SIZE(scales); i++) {
+        int w = hwc_scale_size(width, scales[i]), h = hwc_scale_size(height, scales[i]);
+
+        if (w == preferredWidth && h == preferredHeight)
+            continue;
+        mode = hwc_refresh_modes(pScrn, w, h);
+        for (m = mode; m; m = m->next)
+            m->type &= ~M_T_PREFERRED;
+        modes = xf86ModesAdd(modes, mode);
+    }
+
+    return modes;
+}
+
 Bool
 hwc_display_pre_init(ScrnInfoPtr pScrn)
 {
     HWCPtr hwc = HWCPTR(pScrn);
     xf86OutputPtr output;
     xf86CrtcPtr crtc;
+    int modeWidth, modeHeight, panelWidth, panelHeight;
+
+    if (hwc->rotation == HWC_ROTATE_CW || hwc->rotation == HWC_ROTATE_CCW) {
+        panelWidth = hwc->hwcHeight;
+        panelHeight = hwc->hwcWidth;
+    } else {
+        panelWidth = hwc->hwcWidth;
+        panelHeight = hwc->hwcHeight;
+    }
 
     /* Pick up size from the "Display" subsection if it exists */
     if (pScrn->display->virtualX) {
@@ -188,14 +567,41 @@ hwc_display_pre_init(ScrnInfoPtr pScrn)
      }
     pScrn->displayWidth = pScrn->virtualX;
 
-    /* Construct a mode with the screen's initial dimensions */
-    hwc->modes = xf86CVTMode(pScrn->virtualX, pScrn->virtualY, 60, 0, 0);
+    modeWidth = pScrn->virtualX;
+    modeHeight = pScrn->virtualY;
+    if (pScrn->virtualX >= panelWidth && pScrn->virtualY >= panelHeight &&
+        (pScrn->virtualX > panelWidth || pScrn->virtualY > panelHeight)) {
+        /* A virtual desktop bigger than the panel: pan a panel-sized mode over it */
+        modeWidth = panelWidth;
+        modeHeight = panelHeight;
+        xf86DrvMsg(pScrn->scrnIndex, X_CONFIG, "virtual desktop %dx%d, panning a %dx%d viewport\n",
+                   pScrn->virtualX, pScrn->virtualY, modeWidth, modeHeight);
+    }
+
+    /* Modes at the panel's size and scaled down, one per refresh rate */
+    hwc->modes = hwc_display_modes(pScrn, modeWidth, modeHeight);
+
+    if (hwc->renderScale < 1.0) {
+        /* render fewer pixels, the renderer scales them up to the panel */
+        modeWidth = hwc_scale_size(modeWidth, hwc->renderScale);
+        modeHeight = hwc_scale_size(modeHeight, hwc->renderScale);
+        if (!pScrn->display->virtualX) {
+            pScrn->virtualX = pScrn->displayWidth = modeWidth;
+            pScrn->virtualY = modeHeight;
+        }
+        xf86DrvMsg(pScrn->scrnIndex, X_CONFIG, "render scale %g, %dx%d mode scaled up to the panel\n",
+                   hwc->renderScale, modeWidth, modeHeight);
+    }
+
+    hwc->viewX = hwc->viewY = 0;
+    hwc->viewWidth = modeWidth;
+    hwc->viewHeight = modeHeight;
 
     xf86CrtcConfigInit(pScrn, &hwc_xf86crtc_config_funcs);
     xf86CrtcSetSizeRange(pScrn, 8, 8, SHRT_MAX, SHRT_MAX);
 
     output = xf86OutputCreate(pScrn, &hwc_output_funcs, "hwcomposer");
-    output->possible_crtcs = 0x7f;
+    output->possible_crtcs = 1 << 0;
 
     crtc = xf86CrtcCreate(pScrn, &hwcomposer_crtc_funcs);
 
@@ -203,6 +609,17 @@ hwc_display_pre_init(ScrnInfoPtr pScrn)
 
     xf86InitialConfiguration(pScrn, TRUE);
 
+    /*
+     * The external display is added after the initial configuration, so
+     * the root keeps the panel's size. It starts off; RandR clients turn
+     * it on, mirroring the panel or on a part of a larger Virtual screen.
+     */
+    hwc->external.output = xf86OutputCreate(pScrn, &hwc_external_output_funcs, "external");
+    hwc->external.output->possible_crtcs = 1 << 1;
+    hwc->external.output->driver_private = &hwc->external;
+    hwc->external.crtc = xf86CrtcCreate(pScrn, &hwc_external_crtc_funcs);
+    hwc->external.crtc->driver_private = &hwc->external;
+
     pScrn->currentMode = pScrn->modes;
     crtc->funcs->set_mode_major(crtc, pScrn->currentMode, RR_Rotate_0, 0, 0);
 
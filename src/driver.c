@@ -73,8 +73,8 @@ static Bool	hwc_driver_func(ScrnInfoPtr pScrn, xorgDriverFuncOp op,
 #define HWC_MINOR_VERSION PACKAGE_VERSION_MINOR
 #define HWC_PATCHLEVEL PACKAGE_VERSION_PATCHLEVEL
 
-// For ~60 FPS
-#define TIMER_DELAY 17 /* in milliseconds */
+#define HWC_CURSOR_SIZE_DEFAULT 64
+#define HWC_CURSOR_SIZE_MAX 256
 
 /*
  * This is intentionally screen-independent.  It indicates the binding
@@ -110,7 +110,28 @@ typedef enum {
     OPTION_ACCEL_METHOD,
     OPTION_EGL_PLATFORM,
     OPTION_SW_CURSOR,
-    OPTION_ROTATE
+    OPTION_ROTATE,
+    OPTION_CURSOR_SIZE,
+    OPTION_MOCK_HAL,
+    OPTION_MOCK_HAL_MODE,
+    OPTION_MOCK_HAL_READBACK,
+    OPTION_STATS_FILE,
+    OPTION_TRACE_FILE,
+    OPTION_TRACE_PIXELS,
+    OPTION_TRACE_REPLAY,
+    OPTION_MEASURE_LATENCY,
+    OPTION_PARALLEL_INIT,
+    OPTION_SHADER_CACHE,
+    OPTION_SHADER_CACHE_DIR,
+    OPTION_RELEASE_ON_SUSPEND,
+    OPTION_SHADOW_FB,
+    OPTION_TILE_HASH,
+    OPTION_NATIVE_BUFFERS,
+    OPTION_IDLE_REFRESH_TIMEOUT,
+    OPTION_RENDER_SCALE,
+    OPTION_HWCOMPOSER_API,
+    OPTION_PROBE_CACHE,
+    OPTION_FB_THREADS
 } Opts;
 
 static const OptionInfoRec Options[] = {
@@ -118,6 +139,27 @@ static const OptionInfoRec Options[] = {
     { OPTION_EGL_PLATFORM, "EGLPlatform", OPTV_STRING, {0}, FALSE},
     { OPTION_SW_CURSOR,     "SWcursor",    OPTV_BOOLEAN,{0}, FALSE},
     { OPTION_ROTATE,       "Rotate",      OPTV_STRING, {0}, FALSE },
+    { OPTION_CURSOR_SIZE,  "CursorSize",  OPTV_INTEGER,{0}, FALSE },
+    { OPTION_MOCK_HAL,     "MockHAL",     OPTV_BOOLEAN,{0}, FALSE },
+    { OPTION_MOCK_HAL_MODE, "MockHALMode", OPTV_STRING, {0}, FALSE },
+    { OPTION_MOCK_HAL_READBACK, "MockHALReadback", OPTV_BOOLEAN,{0}, FALSE },
+    { OPTION_STATS_FILE,   "StatsFile",   OPTV_STRING, {0}, FALSE },
+    { OPTION_TRACE_FILE,   "TraceFile",   OPTV_STRING, {0}, FALSE },
+    { OPTION_TRACE_PIXELS, "TracePixels", OPTV_BOOLEAN,{0}, FALSE },
+    { OPTION_TRACE_REPLAY, "TraceReplay", OPTV_STRING, {0}, FALSE },
+    { OPTION_MEASURE_LATENCY, "MeasureLatency", OPTV_BOOLEAN,{0}, FALSE },
+    { OPTION_PARALLEL_INIT, "ParallelInit", OPTV_BOOLEAN,{0}, FALSE },
+    { OPTION_SHADER_CACHE, "ShaderCache", OPTV_BOOLEAN,{0}, FALSE },
+    { OPTION_SHADER_CACHE_DIR, "ShaderCacheDir", OPTV_STRING, {0}, FALSE },
+    { OPTION_RELEASE_ON_SUSPEND, "ReleaseBuffersOnSuspend", OPTV_BOOLEAN,{0}, FALSE },
+    { OPTION_SHADOW_FB,    "ShadowFB",    OPTV_BOOLEAN,{0}, FALSE },
+    { OPTION_TILE_HASH,    "TileHash",    OPTV_BOOLEAN,{0}, FALSE },
+    { OPTION_NATIVE_BUFFERS, "NativeBuffers", OPTV_BOOLEAN,{0}, FALSE },
+    { OPTION_IDLE_REFRESH_TIMEOUT, "IdleRefreshTimeout", OPTV_INTEGER,{0}, FALSE },
+    { OPTION_RENDER_SCALE, "RenderScale", OPTV_REAL,  {0}, FALSE },
+    { OPTION_HWCOMPOSER_API, "HWComposerAPI", OPTV_STRING, {0}, FALSE },
+    { OPTION_PROBE_CACHE,  "ProbeCache",  OPTV_BOOLEAN,{0}, FALSE },
+    { OPTION_FB_THREADS,   "FbThreads",   OPTV_INTEGER,{0}, FALSE },
     { -1,               NULL,       OPTV_NONE,    {0}, FALSE }
 };
 
@@ -176,15 +218,18 @@ Setup(pointer module, pointer opts, int *errmaj, int *errmin)
  * Build a DisplayModeRec that matches the screen's dimensions.
  *
  * Make up a fake pixel clock so that applications that use the VidMode
- * extension to query the "refresh rate" get 60 Hz.
+ * extension to query the "refresh rate" get the panel's.
  */
 static void ConstructFakeDisplayMode(ScrnInfoPtr pScrn, DisplayModePtr mode)
 {
+    HWCPtr hwc = HWCPTR(pScrn);
+
     mode->HDisplay = mode->HSyncStart = mode->HSyncEnd = mode->HTotal =
         pScrn->virtualX;
     mode->VDisplay = mode->VSyncStart = mode->VSyncEnd = mode->VTotal =
         pScrn->virtualY;
-    mode->Clock = mode->HTotal * mode->VTotal * 60 / 1000;
+    mode->Clock = (double) mode->HTotal * mode->VTotal * 1000000 /
+                  hwc->configs[hwc->activeConfig].vsyncPeriod;
 
     xf86SetCrtcForModes(pScrn, 0);
 }
@@ -207,11 +252,25 @@ GetRec(ScrnInfoPtr pScrn)
     return TRUE;
 }
 
+/* PreInit failed, wait for the startup tasks it started */
+static Bool
+hwc_preinit_fail(HWCPtr hwc)
+{
+    hwc_startup_join(&hwc->eglDisplayTask);
+    hwc_startup_join(&hwc->lightsTask);
+    return FALSE;
+}
+
 static void
 FreeRec(ScrnInfoPtr pScrn)
 {
-    if (pScrn->driverPrivate == NULL)
+    HWCPtr hwc = HWCPTR(pScrn);
+
+    if (hwc == NULL)
 	return;
+    /* PreInit may have failed with startup tasks still running */
+    hwc_startup_join(&hwc->eglDisplayTask);
+    hwc_startup_join(&hwc->lightsTask);
     free(pScrn->driverPrivate);
     pScrn->driverPrivate = NULL;
 }
@@ -298,6 +357,12 @@ try_enable_glamor(ScrnInfoPtr pScrn)
         return;
     }
 
+    if (!hwc->renderer.nativeBuffers) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                   "glamor needs EGL_HYBRIS_native_buffer, disabled\n");
+        return;
+    }
+
 #ifdef ENABLE_DRIHYBRIS
 #ifndef __ANDROID__
     if (xf86LoadSubModule(pScrn, "drihybris"))
@@ -328,6 +393,57 @@ try_enable_glamor(ScrnInfoPtr pScrn)
 }
 #endif
 
+/*
+ * Pick the hardware cursor size. Cursor themes scale with the panel
+ * density, and any image larger than the hardware cursor makes the server
+ * fall back to the software cursor, so size it from the DPI reported by
+ * HWComposer unless the "CursorSize" option says otherwise. The cursor is
+ * drawn by GL, so the texture size limit is the only real bound.
+ */
+static void
+hwc_pick_cursor_size(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    int dpi = hwc->hwcDpi ? hwc->hwcDpi : pScrn->xDpi;
+    int max = HWC_CURSOR_SIZE_MAX;
+    int size;
+    MessageType from = X_PROBED;
+
+    if (hwc->renderer.maxTextureSize > 0 && hwc->renderer.maxTextureSize < max)
+        max = hwc->renderer.maxTextureSize;
+
+    if (xf86GetOptValInteger(hwc->Options, OPTION_CURSOR_SIZE, &size)) {
+        from = X_CONFIG;
+    } else if (dpi > 320) {
+        size = 256;
+    } else if (dpi > 160) {
+        size = 128;
+    } else {
+        size = HWC_CURSOR_SIZE_DEFAULT;
+        from = X_DEFAULT;
+    }
+
+    if (size < 16)
+        size = 16;
+    if (size > max)
+        size = max;
+
+    hwc->cursorWidth = hwc->cursorHeight = size;
+    xf86DrvMsg(pScrn->scrnIndex, from, "hardware cursor size %dx%d (%d dpi)\n",
+               size, size, dpi);
+}
+
+static void *hwc_lights_init_thread(void *data)
+{
+    ScrnInfoPtr pScrn = (ScrnInfoPtr) data;
+    HWCPtr hwc = HWCPTR(pScrn);
+    int phase = hwc_startup_phase_begin(hwc, "lights");
+
+    hwc_lights_init(pScrn);
+    hwc_startup_phase_end(hwc, phase);
+    return NULL;
+}
+
 # define RETURN \
     { FreeRec(pScrn);\
 			    return FALSE;\
@@ -338,7 +454,11 @@ void hwc_set_egl_platform(ScrnInfoPtr pScrn)
     HWCPtr hwc = HWCPTR(pScrn);
     const char *egl_platform_str = xf86GetOptValString(hwc->Options,
                                                     OPTION_EGL_PLATFORM);
-    if (egl_platform_str) {
+    if (hwc->mockHal) {
+        // The mock HAL runs on Mesa, which picks its platform explicitly
+        unsetenv("EGL_PLATFORM");
+    }
+    else if (egl_platform_str) {
         setenv("EGL_PLATFORM", egl_platform_str, 1);
     }
     else {
@@ -355,7 +475,9 @@ PreInit(ScrnInfoPtr pScrn, int flags)
     GDevPtr device = xf86GetEntityInfo(pScrn->entityList[0])->device;
     xf86CrtcPtr crtc;
     xf86OutputPtr output;
-    const char *s;
+    const char *s, *probeDir;
+    Bool optBool;
+    int phase;
 
     if (flags & PROBE_DETECT)
         return TRUE;
@@ -366,20 +488,17 @@ PreInit(ScrnInfoPtr pScrn, int flags)
     }
 
     hwc = HWCPTR(pScrn);
+    hwc_startup_begin(hwc);
+    hwc->cursorWakeFd = -1;
+    hwc->hotplugFd = -1;
     pScrn->monitor = pScrn->confScreen->monitor;
 
     if (!xf86SetDepthBpp(pScrn, 0, 0, 0,  Support24bppFb | Support32bppFb))
         return FALSE;
     else {
         /* Check that the returned depth is one we support */
-        switch (pScrn->depth) {
-        case 8:
-        case 15:
-        case 16:
-        case 24:
-        case 30:
-            break;
-        default:
+        /* Only depths with a root buffer format, see hwc_root_formats */
+        if (!hwc_root_format_supported(pScrn->depth)) {
             xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
                        "Given depth (%d) is not supported by this driver\n",
                        pScrn->depth);
@@ -453,24 +572,91 @@ PreInit(ScrnInfoPtr pScrn, int flags)
         }
     }
 
+    hwc->renderScale = 1.0;
+    if (xf86GetOptValReal(hwc->Options, OPTION_RENDER_SCALE, &hwc->renderScale) &&
+        (hwc->renderScale <= 0.0 || hwc->renderScale > 1.0)) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                   "Option \"RenderScale\" must be in (0, 1], ignoring %g\n", hwc->renderScale);
+        hwc->renderScale = 1.0;
+    }
+
     hwc->swCursor = xf86ReturnOptValBool(hwc->Options, OPTION_SW_CURSOR, FALSE);
     if (hwc->swCursor) {
         xf86DrvMsg(pScrn->scrnIndex, X_INFO,
                     "hardware cursor disabled\n");
     }
 
+    hwc->mockHal = xf86ReturnOptValBool(hwc->Options, OPTION_MOCK_HAL, FALSE);
+    if (hwc->mockHal) {
+#ifdef ENABLE_MOCK_HAL
+        hwc->mockHalMode = xf86GetOptValString(hwc->Options, OPTION_MOCK_HAL_MODE);
+        hwc->mockReadback = xf86ReturnOptValBool(hwc->Options,
+                                                 OPTION_MOCK_HAL_READBACK, FALSE);
+        xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                    "using the mock HAL instead of Android hardware\n");
+#else
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                    "Option \"MockHAL\" requires a driver built with --enable-mock-hal\n");
+        hwc->mockHal = FALSE;
+#endif
+    }
+
+    hwc->hwcApi = HWC_API_AUTO;
+    if ((s = xf86GetOptValString(hwc->Options, OPTION_HWCOMPOSER_API))) {
+        if (!xf86NameCmp(s, "hwc1")) {
+            hwc->hwcApi = HWC_API_1;
+        } else if (!xf86NameCmp(s, "hwc2")) {
+#ifdef ENABLE_HWC2
+            hwc->hwcApi = HWC_API_2;
+#else
+            xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                        "Option \"HWComposerAPI\" \"hwc2\" requires a driver built with libhybris' hwc2\n");
+#endif
+        } else if (xf86NameCmp(s, "auto")) {
+            xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                        "Option \"HWComposerAPI\" must be auto, hwc1 or hwc2, ignoring %s\n", s);
+        }
+    }
+    if (hwc->mockHal && hwc->hwcApi == HWC_API_2) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING, "the mock HAL only implements HWComposer 1.x\n");
+        hwc->hwcApi = HWC_API_1;
+    }
+
+    hwc->parallelInit = xf86ReturnOptValBool(hwc->Options, OPTION_PARALLEL_INIT, TRUE);
+    if (!hwc->parallelInit) {
+        xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                    "initializing HAL modules sequentially\n");
+    }
+
+    hwc->releaseOnSuspend = xf86ReturnOptValBool(hwc->Options,
+                                                 OPTION_RELEASE_ON_SUSPEND, FALSE);
+
+    hwc->shaderCacheDir = NULL;
+    if (xf86ReturnOptValBool(hwc->Options, OPTION_SHADER_CACHE, TRUE)) {
+        hwc->shaderCacheDir = xf86GetOptValString(hwc->Options, OPTION_SHADER_CACHE_DIR);
+        if (!hwc->shaderCacheDir)
+            hwc->shaderCacheDir = HWC_SHADER_CACHE_DIR;
+    }
+
     hwc_set_egl_platform(pScrn);
 
+    /*
+     * Loading the vendor EGL and lights libraries does not depend on the
+     * HWComposer device, so let it overlap with hwc_hwcomposer_init. The
+     * mock lights device is part of the mock HWComposer though.
+     */
+    hwc_egl_renderer_preinit(pScrn);
+    if (!hwc->mockHal)
+        hwc_startup_run(hwc, &hwc->lightsTask, hwc_lights_init_thread, pScrn);
+
     if (!hwc_hwcomposer_init(pScrn)) {
         xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
                     "failed to initialize HWComposer API and layers\n");
-        return FALSE;
+        return hwc_preinit_fail(hwc);
     }
 
-    if (!hwc_lights_init(pScrn)) {
-        xf86DrvMsg(pScrn->scrnIndex, X_INFO,
-                    "failed to initialize lights module for backlight control\n");
-    }
+    if (hwc->mockHal)
+        hwc_startup_run(hwc, &hwc->lightsTask, hwc_lights_init_thread, pScrn);
 
     hwc_display_pre_init(pScrn);
 
@@ -494,26 +680,103 @@ PreInit(ScrnInfoPtr pScrn, int flags)
     pScrn->memPhysBase = 0;
     pScrn->fbOffset = 0;
 
+    phase = hwc_startup_phase_begin(hwc, "EGL context");
     if (!hwc_egl_renderer_init(pScrn)) {
         xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
                     "failed to initialize EGL renderer\n");
-            return FALSE;
+        return hwc_preinit_fail(hwc);
     }
+    hwc_startup_phase_end(hwc, phase);
 
+    hwc->renderer.nativeBuffers = xf86ReturnOptValBool(hwc->Options,
+                                                       OPTION_NATIVE_BUFFERS, TRUE);
     if (!hwc_init_hybris_native_buffer(pScrn)) {
         xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
                     "failed to initialize libhybris native buffer EGL extension\n");
-        return FALSE;
+        return hwc_preinit_fail(hwc);
+    }
+
+    phase = hwc_startup_phase_begin(hwc, "capability probe");
+    probeDir = NULL;
+    if (xf86ReturnOptValBool(hwc->Options, OPTION_PROBE_CACHE, TRUE)) {
+        probeDir = xf86GetOptValString(hwc->Options, OPTION_SHADER_CACHE_DIR);
+        if (!probeDir)
+            probeDir = HWC_SHADER_CACHE_DIR;
+    }
+    hwc_probe(pScrn, probeDir);
+    hwc_startup_phase_end(hwc, phase);
+
+    if (hwc->renderer.nativeBuffers && !hwc->renderer.upload && !hwc->caps.eglImage &&
+        !xf86GetOptValBool(hwc->Options, OPTION_NATIVE_BUFFERS, &optBool)) {
+        /*
+         * Uploading reads the root, from malloc memory if the mapping is
+         * uncached. A gralloc root stays locked while it is uploaded and
+         * composed, see hwc_update.
+         */
+        hwc->renderer.upload = TRUE;
+        if (hwc_probe_mapping_uncached(&hwc->caps))
+            hwc->renderer.nativeBuffers = FALSE;
+        xf86DrvMsg(pScrn->scrnIndex, X_PROBED,
+                   "gralloc buffers don't import as textures, uploading the root from %s\n",
+                   hwc->renderer.nativeBuffers ? "gralloc" : "system memory");
     }
 
+    hwc->renderer.uploadAlways = hwc->renderer.upload;
     hwc->buffer = NULL;
 
+    if (!hwc->swCursor)
+        hwc_pick_cursor_size(pScrn);
+
     hwc->glamor = FALSE;
     hwc->drihybris = FALSE;
 #ifdef ENABLE_GLAMOR
     try_enable_glamor(pScrn);
 #endif
 
+    hwc->glAccel.enabled = FALSE;
+    s = xf86GetOptValString(hwc->Options, OPTION_ACCEL_METHOD);
+    if (!hwc->glamor && s && !strcmp(s, "gles")) {
+        if (hwc->renderer.nativeBuffers && !hwc->renderer.upload) {
+            hwc->glAccel.enabled = TRUE;
+            xf86DrvMsg(pScrn->scrnIndex, X_CONFIG, "using gles acceleration\n");
+        } else {
+            xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                       "AccelMethod \"gles\" needs gralloc buffers imported as textures, disabled\n");
+        }
+    }
+
+    hwc->shadowFB = FALSE;
+    if (xf86ReturnOptValBool(hwc->Options, OPTION_SHADOW_FB, FALSE)) {
+        if (hwc->glamor) {
+            xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                        "Option \"ShadowFB\" is ignored with glamor\n");
+        } else {
+            hwc->shadowFB = TRUE;
+            xf86DrvMsg(pScrn->scrnIndex, X_CONFIG, "using a shadow framebuffer\n");
+            if (hwc->glAccel.enabled) {
+                /* fb draws into the shadow, GL can't draw into it */
+                hwc->glAccel.enabled = FALSE;
+                xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                           "AccelMethod \"gles\" is not used with a shadow framebuffer\n");
+            }
+        }
+    } else if (!hwc->glamor && !hwc->glAccel.enabled && hwc->renderer.nativeBuffers &&
+               hwc_probe_mapping_uncached(&hwc->caps) &&
+               !xf86GetOptValBool(hwc->Options, OPTION_SHADOW_FB, &optBool)) {
+        hwc->shadowFB = TRUE;
+        xf86DrvMsg(pScrn->scrnIndex, X_PROBED,
+                   "gralloc mapping reads at %u MB/s against %u MB/s, using a shadow framebuffer\n",
+                   hwc->caps.mappedRead, hwc->caps.cachedRead);
+    }
+
+    hwc_startup_join(&hwc->lightsTask);
+    if (!hwc->lightsDevice) {
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                    "failed to initialize lights module for backlight control\n");
+    }
+
+    hwc_startup_log(pScrn, "PreInit done", FALSE);
+
     return TRUE;
 }
 #undef RETURN
@@ -522,6 +785,9 @@ PreInit(ScrnInfoPtr pScrn, int flags)
 static Bool
 EnterVT(VT_FUNC_ARGS_DECL)
 {
+    SCRN_INFO_PTR(arg);
+
+    hwc_power_resume(pScrn, HWC_SUSPEND_VT);
     return TRUE;
 }
 
@@ -529,6 +795,9 @@ EnterVT(VT_FUNC_ARGS_DECL)
 static void
 LeaveVT(VT_FUNC_ARGS_DECL)
 {
+    SCRN_INFO_PTR(arg);
+
+    hwc_power_suspend(pScrn, HWC_SUSPEND_VT);
 }
 
 static void
@@ -561,28 +830,368 @@ LoadPalette(
        hwc->colors[index].green = colors[index].green << Gshift;
        hwc->colors[index].blue = colors[index].blue << shift;
    }
+
+   if (hwc->rootFormat && hwc->rootFormat->indexed) {
+       /* picked up by the palette texture on the next frame */
+       hwc->renderer.paletteDirty = TRUE;
+       __atomic_store_n(&hwc->dirty, TRUE, __ATOMIC_RELEASE);
+   }
+}
+
+/*
+ * Hand the damage reported since the last call to the frame: dropped if
+ * the tile hashes show it changed nothing, otherwise added to frameDamage
+ * and routed to the displays showing it.
+ */
+void hwc_damage_merge(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    RegionPtr dirty;
+
+    if (!hwc->damage)
+        return;
+
+    dirty = DamageRegion(hwc->damage);
+    if (!REGION_NUM_RECTS(dirty))
+        return;
+
+    if (!hwc_tilehash_filter(pScrn, dirty)) {
+        /* repainted with identical pixels */
+        DamageEmpty(hwc->damage);
+        return;
+    }
+
+    hwc_stats_damage(hwc);
+    if (hwc->trackFrameDamage)
+        RegionUnion(&hwc->frameDamage, &hwc->frameDamage, dirty);
+    hwc_display_damage(pScrn, dirty);
+    DamageEmpty(hwc->damage);
 }
 
 static void hwcBlockHandler(ScreenPtr pScreen, void *timeout)
 {
     ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
     HWCPtr hwc = HWCPTR(pScrn);
-    PixmapPtr rootPixmap;
-    int err;
 
     pScreen->BlockHandler = hwc->BlockHandler;
     pScreen->BlockHandler(pScreen, timeout);
     pScreen->BlockHandler = hwcBlockHandler;
 
-    if (hwc->damage && hwc->dpmsMode == DPMSModeOn) {
-        RegionPtr dirty = DamageRegion(hwc->damage);
-        unsigned num_cliprects = REGION_NUM_RECTS(dirty);
+    if (!hwc->suspended)
+        hwc_damage_merge(pScrn);
+}
+
+/*
+ * poll() returning 0 means a timer woke the server, usually the update
+ * timer. Ticks that run while the server is awake anyway cost nothing
+ * and are not counted.
+ */
+static void hwcWakeupHandler(ScreenPtr pScreen, int result)
+{
+    HWCPtr hwc = HWCPTR(xf86ScreenToScrn(pScreen));
+
+    pScreen->WakeupHandler = hwc->WakeupHandler;
+    pScreen->WakeupHandler(pScreen, result);
+    pScreen->WakeupHandler = hwcWakeupHandler;
+
+    if (result == 0)
+        hwc_stats_wakeup(hwc);
+}
+
+/*
+ * Released root buffers are kept in a small pool, so switching RandR
+ * between a few sizes, or back after a server regeneration, reuses the
+ * gralloc buffers instead of allocating new ones. The oldest buffer is
+ * freed when the pool is full.
+ */
+static void
+hwc_root_pool_put(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_root_pool_entry *entry;
+
+    if (hwc->rootPoolSize == HWC_ROOT_POOL_SIZE) {
+        hwc->renderer.eglHybrisReleaseNativeBuffer(hwc->rootPool[0].buffer);
+        memmove(&hwc->rootPool[0], &hwc->rootPool[1],
+                (HWC_ROOT_POOL_SIZE - 1) * sizeof(hwc_root_pool_entry));
+        hwc->rootPoolSize--;
+    }
+
+    entry = &hwc->rootPool[hwc->rootPoolSize++];
+    entry->buffer = hwc->buffer;
+    entry->width = hwc->bufferWidth;
+    entry->height = hwc->bufferHeight;
+    entry->halFormat = hwc->rootFormat->halFormat;
+    entry->stride = hwc->stride;
+}
+
+static Bool
+hwc_root_pool_take(ScrnInfoPtr pScrn, int halFormat)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    int i;
+
+    for (i = 0; i < hwc->rootPoolSize; i++) {
+        hwc_root_pool_entry *entry = &hwc->rootPool[i];
+
+        if (entry->width != pScrn->virtualX || entry->height != pScrn->virtualY ||
+            entry->halFormat != halFormat)
+            continue;
+
+        hwc->buffer = entry->buffer;
+        hwc->stride = entry->stride;
+        memmove(entry, entry + 1, (hwc->rootPoolSize - i - 1) * sizeof(hwc_root_pool_entry));
+        hwc->rootPoolSize--;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/*
+ * The root buffer, its EGLImage and the HWComposer and EGL state live as
+ * long as the ScrnInfo, not the ScreenRec: a server regeneration keeps
+ * them and CreateScreenResources only reallocates the buffer if the
+ * screen size changed. Everything is released in FreeScreen.
+ */
+static void
+hwc_root_buffer_release(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+
+    hwc_egl_renderer_release_root(pScrn);
+    hwc_shadow_free(pScrn);
+
+    if (hwc->buffer == NULL)
+        return;
+
+    if (hwc->rootPixels)
+        hwc->renderer.eglHybrisUnlockNativeBuffer(hwc->buffer);
+    hwc_root_pool_put(pScrn);
+    hwc->buffer = NULL;
+    hwc->rootPixels = NULL;
+}
+
+/* Release the pooled buffers, from FreeScreen */
+static void
+hwc_root_pool_clear(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    int i;
+
+    for (i = 0; i < hwc->rootPoolSize; i++)
+        hwc->renderer.eglHybrisReleaseNativeBuffer(hwc->rootPool[i].buffer);
+    hwc->rootPoolSize = 0;
+}
+
+/*
+ * Root buffer formats, in order of preference for each depth. Formats
+ * matching the X pixel layout are sampled directly; RGBA_8888 at depth
+ * 24 needs the channels swapped in the shader. There is no 8 bit gralloc
+ * format, so the indexed root lives in system memory and is uploaded as a
+ * luminance texture, then expanded through a palette texture. Without
+ * EGL_HYBRIS_native_buffer every format is kept in system memory.
+ */
+static const hwc_root_format hwc_root_formats[] = {
+    { 8,  0, GL_LUMINANCE, GL_UNSIGNED_BYTE, 1, FALSE, TRUE, "8 bit indexed" },
+    { 16, HYBRIS_PIXEL_FORMAT_RGB_565, GL_RGB, GL_UNSIGNED_SHORT_5_6_5, 2,
+      FALSE, FALSE, "RGB565" },
+    { 24, HYBRIS_PIXEL_FORMAT_BGRA_8888, GL_BGRA_EXT, GL_UNSIGNED_BYTE, 4,
+      FALSE, FALSE, "BGRX8888" },
+    { 24, HYBRIS_PIXEL_FORMAT_RGBA_8888, GL_RGBA, GL_UNSIGNED_BYTE, 4,
+      TRUE, FALSE, "RGBA8888" },
+};
+
+static const hwc_root_format hwc_root_format_glamor =
+    { 24, HYBRIS_PIXEL_FORMAT_RGBA_8888, GL_RGBA, GL_UNSIGNED_BYTE, 4,
+      FALSE, FALSE, "RGBA8888" };
+
+Bool hwc_root_format_supported(int depth)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(hwc_root_formats); i++) {
+        if (hwc_root_formats[i].depth == depth)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/* A virtualX x virtualY gralloc root buffer, from the pool if possible */
+static int
+hwc_root_buffer_create(ScrnInfoPtr pScrn, int halFormat)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+
+    if (hwc_root_pool_take(pScrn, halFormat)) {
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO, "reusing a pooled %dx%d root buffer\n",
+                   pScrn->virtualX, pScrn->virtualY);
+        return 0;
+    }
+
+    return hwc->renderer.eglHybrisCreateNativeBuffer(pScrn->virtualX, pScrn->virtualY,
+                                          HYBRIS_USAGE_HW_TEXTURE |
+                                          HYBRIS_USAGE_SW_READ_OFTEN|HYBRIS_USAGE_SW_WRITE_OFTEN,
+                                          halFormat, &hwc->stride, &hwc->buffer);
+}
+
+static Bool
+hwc_root_buffer_alloc(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    /* can't be imported as one texture, upload it in tiles instead */
+    Bool too_large = pScrn->virtualX > hwc->renderer.maxTextureSize ||
+                     pScrn->virtualY > hwc->renderer.maxTextureSize;
+    int i, err = -1;
+
+    if (hwc->glamor) {
+        if (too_large)
+            xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                       "%dx%d root exceeds GL_MAX_TEXTURE_SIZE %d\n",
+                       pScrn->virtualX, pScrn->virtualY, hwc->renderer.maxTextureSize);
+        hwc->rootFormat = &hwc_root_format_glamor;
+        err = hwc_root_buffer_create(pScrn, HYBRIS_PIXEL_FORMAT_RGBA_8888);
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO, "alloc: status=%d, stride=%d\n", err, hwc->stride);
+        return err == 0;
+    }
+
+    /* set again below if this root can't be imported */
+    hwc->renderer.upload = hwc->renderer.uploadAlways;
+
+    for (i = 0; i < ARRAY_SIZE(hwc_root_formats); i++) {
+        const hwc_root_format *format = &hwc_root_formats[i];
+
+        if (format->depth != pScrn->depth)
+            continue;
 
-        if (num_cliprects) {
-            DamageEmpty(hwc->damage);
-            hwc->dirty = TRUE;
+        /* uploading BGRA needs GL_EXT_texture_format_BGRA8888 */
+        if ((hwc->renderer.upload || too_large) && format->glFormat == GL_BGRA_EXT &&
+            !epoxy_has_gl_extension("GL_EXT_texture_format_BGRA8888"))
+            continue;
+
+        hwc->rootFormat = format;
+        if (format->indexed || !hwc->renderer.nativeBuffers || too_large) {
+            /* fb draws into system memory, the damage is uploaded each frame */
+            hwc->stride = pScrn->displayWidth;
+            hwc->renderer.upload = TRUE;
+            if (!hwc_shadow_alloc(pScrn))
+                return FALSE;
+            break;
         }
+
+        err = hwc_root_buffer_create(pScrn, format->halFormat);
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO, "alloc %s: status=%d, stride=%d\n",
+                   format->name, err, hwc->stride);
+        if (err == 0)
+            break;
+        hwc->buffer = NULL;
+    }
+
+    if (i == ARRAY_SIZE(hwc_root_formats))
+        return FALSE;
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "root buffer format %s\n", hwc->rootFormat->name);
+    return TRUE;
+}
+
+/* Lock the root buffer for the CPU, returns the pixels fb draws into */
+static void *
+hwc_root_buffer_map(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    void *pixels = NULL;
+    int err;
+
+    /* a reused buffer is still locked */
+    if (hwc->buffer && !hwc->rootPixels) {
+        err = hwc->renderer.eglHybrisLockNativeBuffer(hwc->buffer,
+                                        HYBRIS_USAGE_SW_READ_OFTEN|HYBRIS_USAGE_SW_WRITE_OFTEN,
+                                        0, 0, hwc->stride, pScrn->virtualY, &pixels);
+
+        hwc->rootPixels = pixels;
+
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO, "gralloc lock returns %i\n", err);
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO, "lock to vaddr %p\n", pixels);
     }
+
+    if (!hwc->buffer)
+        return hwc->shadow;
+
+    if (hwc->shadowFB) {
+        if (hwc_shadow_alloc(pScrn))
+            return hwc->shadow;
+        hwc->shadowFB = FALSE;
+    }
+    return hwc->rootPixels;
+}
+
+/*
+ * RandR screen resize. The root buffer is reallocated at the new size,
+ * or taken from the pool, and the screen pixmap pointed at it. Its
+ * contents are not kept: the server exposes the whole root afterwards.
+ * glamor's root pixmap can't be swapped under it, so glamor keeps the
+ * size it started with.
+ */
+Bool
+hwc_root_resize(ScrnInfoPtr pScrn, int width, int height)
+{
+    ScreenPtr pScreen = xf86ScrnToScreen(pScrn);
+    HWCPtr hwc = HWCPTR(pScrn);
+    PixmapPtr rootPixmap = pScreen->GetScreenPixmap(pScreen);
+    int oldWidth = pScrn->virtualX, oldHeight = pScrn->virtualY;
+    Bool ret = TRUE;
+    void *pixels;
+
+    if (hwc->glamor) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                   "can't resize the screen to %dx%d with glamor\n", width, height);
+        return FALSE;
+    }
+
+    hwc_root_buffer_release(pScrn);
+
+    pScrn->virtualX = pScrn->displayWidth = width;
+    pScrn->virtualY = height;
+    if (!hwc_root_buffer_alloc(pScrn)) {
+        xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+                   "failed to allocate a %dx%d root buffer\n", width, height);
+        pScrn->virtualX = pScrn->displayWidth = oldWidth;
+        pScrn->virtualY = oldHeight;
+        if (!hwc_root_buffer_alloc(pScrn))
+            FatalError("Couldn't reallocate the root buffer\n");
+        ret = FALSE;
+    }
+    hwc->bufferWidth = pScrn->virtualX;
+    hwc->bufferHeight = pScrn->virtualY;
+    pScrn->displayWidth = hwc->stride;
+
+    hwc_egl_renderer_bind_root(pScrn);
+    if (hwc->renderer.upload)
+        hwc->trackFrameDamage = TRUE;
+
+    pixels = hwc_root_buffer_map(pScrn);
+    if (!pScreen->ModifyPixmapHeader(rootPixmap, pScrn->virtualX, pScrn->virtualY, -1, -1,
+                                     hwc->stride * hwc->rootFormat->cpp, pixels))
+        FatalError("Couldn't adjust screen pixmap\n");
+
+    /* in the old size's coordinates */
+    DamageEmpty(hwc->damage);
+    RegionEmpty(&hwc->frameDamage);
+    hwc_tilehash_resize(pScrn);
+    if (hwc->trace) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                   "frame trace stopped, it can't record a change of screen size\n");
+        hwc_trace_close(pScrn);
+    }
+    if (hwc->replay) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                   "trace replay stopped, the trace was recorded at another screen size\n");
+        hwc_trace_replay_close(pScrn);
+    }
+
+    if (ret)
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO, "screen resized to %dx%d\n", width, height);
+    __atomic_store_n(&hwc->dirty, TRUE, __ATOMIC_RELEASE);
+    return ret;
 }
 
 static Bool
@@ -592,8 +1201,7 @@ CreateScreenResources(ScreenPtr pScreen)
     HWCPtr hwc = HWCPTR(pScrn);
     PixmapPtr rootPixmap;
     Bool ret;
-    void *pixels = NULL;
-    int err;
+    void *pixels;
 
     pScreen->CreateScreenResources = hwc->CreateScreenResources;
     ret = pScreen->CreateScreenResources(pScreen);
@@ -614,13 +1222,28 @@ CreateScreenResources(ScreenPtr pScreen)
     }
 #endif
 
-    err = hwc->renderer.eglHybrisCreateNativeBuffer(pScrn->virtualX, pScrn->virtualY,
-                                      HYBRIS_USAGE_HW_TEXTURE |
-                                      HYBRIS_USAGE_SW_READ_OFTEN|HYBRIS_USAGE_SW_WRITE_OFTEN,
-                                      HYBRIS_PIXEL_FORMAT_RGBA_8888,
-                                      &hwc->stride, &hwc->buffer);
+    if (hwc->rootFormat && (hwc->bufferWidth != pScrn->virtualX ||
+                            hwc->bufferHeight != pScrn->virtualY))
+        hwc_root_buffer_release(pScrn);
 
-    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "alloc: status=%d, stride=%d\n", err, hwc->stride);
+    if (!hwc->buffer && !hwc->shadow) {
+        if (!hwc_root_buffer_alloc(pScrn)) {
+            xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+                        "failed to allocate a depth %d root buffer\n", pScrn->depth);
+            return FALSE;
+        }
+        hwc->bufferWidth = pScrn->virtualX;
+        hwc->bufferHeight = pScrn->virtualY;
+    }
+    else {
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                    "reusing %dx%d root buffer from the previous generation\n",
+                    hwc->bufferWidth, hwc->bufferHeight);
+    }
+
+    /* uploads only copy what changed */
+    if (hwc->renderer.upload)
+        hwc->trackFrameDamage = TRUE;
 
     hwc_egl_renderer_screen_init(pScreen);
 
@@ -629,18 +1252,15 @@ CreateScreenResources(ScreenPtr pScreen)
         hwc->renderer.rootTexture = glamor_get_pixmap_texture(rootPixmap);
 #endif
 
-    err = hwc->renderer.eglHybrisLockNativeBuffer(hwc->buffer,
-                                    HYBRIS_USAGE_SW_READ_OFTEN|HYBRIS_USAGE_SW_WRITE_OFTEN,
-                                    0, 0, hwc->stride, pScrn->virtualY, &pixels);
-
-    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "gralloc lock returns %i\n", err);
-    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "lock to vaddr %p\n", pixels);
+    pixels = hwc_root_buffer_map(pScrn);
 
     if (!hwc->glamor) {
         if (!pScreen->ModifyPixmapHeader(rootPixmap, -1, -1, -1, -1, -1, pixels))
             FatalError("Couldn't adjust screen pixmap\n");
     }
 
+    RegionNull(&hwc->frameDamage);
+
     hwc->damage = DamageCreate(NULL, NULL, DamageReportNone, TRUE,
                                 pScreen, rootPixmap);
 
@@ -658,33 +1278,86 @@ CreateScreenResources(ScreenPtr pScreen)
     return ret;
 }
 
-static CARD32 hwc_update_by_timer(OsTimerPtr timer, CARD32 time, void *ptr) {
-    ScreenPtr pScreen = (ScreenPtr) ptr;
+void hwc_update(ScreenPtr pScreen)
+{
     ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
     HWCPtr hwc = HWCPTR(pScrn);
     PixmapPtr rootPixmap;
+    Bool primary, external;
     int err;
 
-    if (hwc->dirty && hwc->dpmsMode == DPMSModeOn) {
+    if (hwc->suspended)
+        return;
+
+    /* Clear before composing, so a cursor move racing with us is not lost */
+    primary = __atomic_exchange_n(&hwc->dirty, FALSE, __ATOMIC_ACQ_REL);
+    external = __atomic_exchange_n(&hwc->external.dirty, FALSE, __ATOMIC_ACQ_REL) &&
+               hwc_external_extended(hwc);
+    if (primary || external) {
         void *pixels = NULL;
+        hwc_refresh_frame(pScrn);
+        hwc_stats_frame_begin(hwc);
+
+        if (hwc->shadow)
+            hwc_shadow_update(pScreen);
+        if (hwc->trace)
+            hwc_trace_capture(pScreen);
+
         rootPixmap = pScreen->GetScreenPixmap(pScreen);
+        if (!hwc->buffer || hwc->renderer.upload) {
+            /*
+             * Root in system memory, fb draws straight into it, or a
+             * gralloc root that is uploaded: the upload reads the locked
+             * mapping, so it stays locked.
+             */
+            hwc_egl_renderer_update(pScreen, primary, external);
+            goto done;
+        }
         hwc->renderer.eglHybrisUnlockNativeBuffer(hwc->buffer);
 
-        hwc_egl_renderer_update(pScreen);
+        hwc_egl_renderer_update(pScreen, primary, external);
 
         err = hwc->renderer.eglHybrisLockNativeBuffer(hwc->buffer,
                         HYBRIS_USAGE_SW_READ_OFTEN|HYBRIS_USAGE_SW_WRITE_OFTEN,
                         0, 0, hwc->stride, pScrn->virtualY, &pixels);
+        hwc->rootPixels = pixels;
 
-        if (!hwc->glamor) {
+        if (!hwc->glamor && !hwc->shadow) {
             if (!pScreen->ModifyPixmapHeader(rootPixmap, -1, -1, -1, -1, -1, pixels))
                 FatalError("Couldn't adjust screen pixmap\n");
         }
 
-        hwc->dirty = FALSE;
+done:
+        /* emptied after composing, uploads use it */
+        if (hwc->trackFrameDamage)
+            RegionEmpty(&hwc->frameDamage);
+        hwc_stats_frame_end(hwc);
+        hwc_latency_end(pScrn);
+        hwc_startup_log(pScrn, "first frame", TRUE);
     }
+}
 
-    return TIMER_DELAY;
+static CARD32 hwc_update_by_timer(OsTimerPtr timer, CARD32 time, void *ptr);
+
+void hwc_update_timer_start(ScreenPtr pScreen)
+{
+    HWCPtr hwc = HWCPTR(xf86ScreenToScrn(pScreen));
+
+    hwc->timer = TimerSet(hwc->timer, 0, hwc->updateInterval, hwc_update_by_timer, (void*) pScreen);
+}
+
+static CARD32 hwc_update_by_timer(OsTimerPtr timer, CARD32 time, void *ptr) {
+    ScreenPtr pScreen = (ScreenPtr) ptr;
+    HWCPtr hwc = HWCPTR(xf86ScreenToScrn(pScreen));
+
+    if (hwc->replay)
+        hwc_trace_replay_step(pScreen);
+
+    hwc_update(pScreen);
+    hwc_refresh_idle_check(xf86ScreenToScrn(pScreen));
+
+    /* once per vsync of the active config */
+    return hwc->updateInterval;
 }
 
 /* Mandatory */
@@ -693,9 +1366,11 @@ ScreenInit(SCREEN_INIT_ARGS_DECL)
 {
     ScrnInfoPtr pScrn;
     HWCPtr hwc;
-    int ret;
+    int ret, idleTimeout, fbThreads;
     VisualPtr visual;
     void *pixels;
+    const char *s;
+    Bool latency;
 
     /*
      * we need to get the ScrnInfoRec for this screen, so let's allocate
@@ -747,6 +1422,15 @@ ScreenInit(SCREEN_INIT_ARGS_DECL)
     /* must be after RGB ordering fixed */
     fbPictureInit(pScreen, 0, 0);
 
+    /* directly on top of fb, before damage wraps the screen */
+    if (!hwc->glamor) {
+        hwc_glaccel_init(pScreen);
+        /* single threaded unless FbThreads asks for more, 0 for one per CPU */
+        fbThreads = 1;
+        xf86GetOptValInteger(hwc->Options, OPTION_FB_THREADS, &fbThreads);
+        hwc_fb_threads_init(pScreen, fbThreads);
+    }
+
 #ifdef ENABLE_GLAMOR
     if (hwc->glamor && !glamor_init(pScreen, GLAMOR_USE_EGL_SCREEN)) {
         xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
@@ -768,12 +1452,10 @@ ScreenInit(SCREEN_INIT_ARGS_DECL)
 
     /* Need to extend HWcursor support to handle mask interleave */
     if (!hwc->swCursor) {
-        hwc->cursorWidth = 64;
-        hwc->cursorHeight = 64;
-
         xf86_cursors_init(pScreen, hwc->cursorWidth, hwc->cursorHeight,
                           HARDWARE_CURSOR_UPDATE_UNHIDDEN |
                           HARDWARE_CURSOR_ARGB);
+        hwc_cursor_cache_init(pScreen);
     }
 
     /* Initialise default colourmap */
@@ -817,6 +1499,8 @@ ScreenInit(SCREEN_INIT_ARGS_DECL)
     /* Wrap the current BlockHandler function */
     hwc->BlockHandler = pScreen->BlockHandler;
     pScreen->BlockHandler = hwcBlockHandler;
+    hwc->WakeupHandler = pScreen->WakeupHandler;
+    pScreen->WakeupHandler = hwcWakeupHandler;
 
 #ifdef ENABLE_DRIHYBRIS
     if (hwc->drihybris) {
@@ -828,7 +1512,30 @@ ScreenInit(SCREEN_INIT_ARGS_DECL)
                     "Failed to initialize the Present extension.\n");
     }
 
-    TimerSet(hwc->timer, 0, TIMER_DELAY, hwc_update_by_timer, (void*) pScreen);
+    latency = xf86ReturnOptValBool(hwc->Options, OPTION_MEASURE_LATENCY, FALSE);
+    hwc_stats_init(pScrn, xf86GetOptValString(hwc->Options, OPTION_STATS_FILE), latency);
+    hwc_latency_init(pScrn, latency);
+    hwc_tilehash_init(pScrn, xf86ReturnOptValBool(hwc->Options, OPTION_TILE_HASH, FALSE));
+
+    idleTimeout = 0;
+    xf86GetOptValInteger(hwc->Options, OPTION_IDLE_REFRESH_TIMEOUT, &idleTimeout);
+    hwc_refresh_init(pScrn, idleTimeout);
+
+    hwc->trackFrameDamage = hwc->shadowFB;
+    if ((s = xf86GetOptValString(hwc->Options, OPTION_TRACE_FILE)))
+        hwc_trace_open(pScrn, s,
+                       xf86ReturnOptValBool(hwc->Options, OPTION_TRACE_PIXELS, TRUE));
+    if ((s = xf86GetOptValString(hwc->Options, OPTION_TRACE_REPLAY)))
+        hwc_trace_replay_open(pScrn, s);
+
+    if (!hwc->swCursor)
+        hwc_cursor_wakeup_init(pScreen);
+    hwc_hotplug_init(pScreen);
+
+    hwc_power_init(pScrn);
+    hwc_update_timer_start(pScreen);
+
+    hwc_startup_log(pScrn, "ScreenInit done", FALSE);
 
     return TRUE;
 }
@@ -844,6 +1551,11 @@ SwitchMode(SWITCH_MODE_ARGS_DECL)
 void
 AdjustFrame(ADJUST_FRAME_ARGS_DECL)
 {
+    SCRN_INFO_PTR(arg);
+    xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+
+    if (config->num_crtc)
+        xf86CrtcSetOrigin(config->crtc[0], x, y);
 }
 
 /* Mandatory */
@@ -854,21 +1566,23 @@ CloseScreen(CLOSE_SCREEN_ARGS_DECL)
     HWCPtr hwc = HWCPTR(pScrn);
 
     TimerCancel(hwc->timer);
+    hwc_cursor_wakeup_close(pScreen);
+    hwc_hotplug_close(pScreen);
+    hwc_stats_write(pScrn);
+    hwc_latency_close(pScrn);
+    hwc_tilehash_close(pScrn);
+    hwc_fb_threads_close(pScrn);
+
+    hwc_trace_close(pScrn);
+    hwc_trace_replay_close(pScrn);
 
     if (hwc->damage) {
         DamageUnregister(hwc->damage);
         DamageDestroy(hwc->damage);
         hwc->damage = NULL;
     }
+    RegionUninit(&hwc->frameDamage);
 
-    hwc_egl_renderer_screen_close(pScreen);
-
-    if (hwc->buffer != NULL)
-    {
-        hwc->renderer.eglHybrisUnlockNativeBuffer(hwc->buffer);
-        hwc->renderer.eglHybrisReleaseNativeBuffer(hwc->buffer);
-        hwc->buffer = NULL;
-    }
 
     if (hwc->CursorInfo)
         xf86DestroyCursorInfoRec(hwc->CursorInfo);
@@ -883,6 +1597,15 @@ static void
 FreeScreen(FREE_SCREEN_ARGS_DECL)
 {
     SCRN_INFO_PTR(arg);
+
+    if (pScrn->driverPrivate) {
+        hwc_root_buffer_release(pScrn);
+        hwc_root_pool_clear(pScrn);
+        hwc_glaccel_close(pScrn);
+        hwc_egl_renderer_close(pScrn);
+        hwc_hwcomposer_close(pScrn);
+        hwc_latency_fini(pScrn);
+    }
     FreeRec(pScrn);
 }
 
@@ -3,12 +3,15 @@
 #include "xf86_OSproc.h"
 
 #include "xf86Cursor.h"
+#include "xf86Crtc.h"
+#include "picturestr.h"
 
 #ifdef XvExtension
 #include "xf86xv.h"
 #include <X11/extensions/Xv.h>
 #endif
 #include <string.h>
+#include <stdio.h>
 #include <pthread.h>
 
 #include <android-config.h>
@@ -37,27 +40,63 @@ typedef struct _color
 } dummy_colors;
 
 Bool hwc_display_pre_init(ScrnInfoPtr pScrn);
+void hwc_set_view(ScrnInfoPtr pScrn, int x, int y, int width, int height);
+void hwc_display_damage(ScrnInfoPtr pScrn, RegionPtr damage);
+Bool hwc_hotplug_init(ScreenPtr pScreen);
+void hwc_hotplug_close(ScreenPtr pScreen);
 Bool hwc_hwcomposer_init(ScrnInfoPtr pScrn);
 void hwc_hwcomposer_close(ScrnInfoPtr pScrn);
 Bool hwc_lights_init(ScrnInfoPtr pScrn);
 
+struct ANativeWindowBuffer;
+
 struct ANativeWindow *hwc_get_native_window(ScrnInfoPtr pScrn);
+struct ANativeWindow *hwc_get_external_window(ScrnInfoPtr pScrn);
+Bool hwc_external_probe(ScrnInfoPtr pScrn);
+void hwc_destroy_native_window(struct ANativeWindow *win);
+int hwc_present_layers(ScrnInfoPtr pScrn, buffer_handle_t handle, int acquireFenceFd);
 void hwc_toggle_screen_brightness(ScrnInfoPtr pScrn);
 void hwc_set_power_mode(ScrnInfoPtr pScrn, int disp, int mode);
+Bool hwc_can_set_active_config(ScrnInfoPtr pScrn);
+Bool hwc_set_active_config(ScrnInfoPtr pScrn, int index);
+void hwc_register_procs(ScrnInfoPtr pScrn);
+void hwc_set_vsync_enabled(ScrnInfoPtr pScrn, Bool enabled);
+int hwc_merge_fences(int a, int b);
+#ifdef ENABLE_HWC2
+Bool hwc_hwc2_init(ScrnInfoPtr pScrn);
+#endif
 
 Bool hwc_init_hybris_native_buffer(ScrnInfoPtr pScrn);
+void hwc_egl_renderer_preinit(ScrnInfoPtr pScrn);
 Bool hwc_egl_renderer_init(ScrnInfoPtr pScrn);
 void hwc_egl_renderer_close(ScrnInfoPtr pScrn);
 void hwc_egl_renderer_screen_init(ScreenPtr pScreen);
-void hwc_egl_renderer_screen_close(ScreenPtr pScreen);
-void hwc_egl_renderer_update(ScreenPtr pScreen);
+void hwc_egl_renderer_bind_root(ScrnInfoPtr pScrn);
+void hwc_egl_renderer_release_root(ScrnInfoPtr pScrn);
+Bool hwc_egl_renderer_release_surface(ScrnInfoPtr pScrn);
+Bool hwc_egl_renderer_restore_surface(ScrnInfoPtr pScrn);
+void hwc_egl_renderer_update(ScreenPtr pScreen, Bool primary, Bool external);
+void hwc_egl_renderer_destroy_external(ScrnInfoPtr pScrn);
+void hwc_egl_renderer_set_gamma(ScrnInfoPtr pScrn, const CARD16 *red, const CARD16 *green,
+                                const CARD16 *blue, int size);
 
-void hwc_ortho_2d(float* mat, float left, float right, float bottom, float top);
+void hwc_shader_variant_vertex_src(unsigned key, char *buf, size_t size);
+void hwc_shader_variant_fragment_src(unsigned key, char *buf, size_t size);
+void hwc_shader_variant_name(unsigned key, char *buf, size_t size);
+void hwc_program_cache_init(ScrnInfoPtr pScrn, const char *dir);
+void hwc_program_cache_close(void);
+uint64_t hwc_hash_string(uint64_t h, const char *s);
 GLuint hwc_link_program(const GLchar *vert_src, const GLchar *frag_src);
 
 Bool hwc_present_screen_init(ScreenPtr pScreen);
 Bool hwc_cursor_init(ScreenPtr pScreen);
 
+Bool hwc_root_format_supported(int depth);
+Bool hwc_root_resize(ScrnInfoPtr pScrn, int width, int height);
+void hwc_update(ScreenPtr pScreen);
+void hwc_damage_merge(ScrnInfoPtr pScrn);
+void hwc_update_timer_start(ScreenPtr pScreen);
+
 typedef enum {
     HWC_ROTATE_NORMAL,
     HWC_ROTATE_CW,
@@ -65,14 +104,344 @@ typedef enum {
     HWC_ROTATE_CCW
 } hwc_rotation;
 
+typedef struct {
+    uint32_t seq;
+    int x;
+    int y;
+    Bool shown;
+} hwc_cursor_state;
+
+#define HWC_CURSOR_CACHE_SIZE 8
+
+typedef struct {
+    GLuint texture;
+    uint64_t hash;
+    uint32_t lastUse;
+    Bool valid;
+} hwc_cursor_cache_entry;
+
 typedef struct {
 	GLuint program;
     GLint position;
     GLint texcoords;
-    GLint transform;
+    GLint cursorcoords;
     GLint texture;
+    GLint palette;
+    GLint gamma;
+    GLint cursor;
+    GLint color;
 } hwc_renderer_shader;
 
+/* Key bits of a composition shader variant, see shaders.c */
+#define HWC_SHADER_SWIZZLE         (1 << 0)
+#define HWC_SHADER_INDEXED         (1 << 1)
+#define HWC_SHADER_GAMMA           (1 << 2)
+#define HWC_SHADER_CURSOR          (1 << 3)
+#define HWC_SHADER_CURSOR_SWIZZLE  (1 << 4)
+#define HWC_SHADER_VARIANTS        (1 << 5)
+/* generated sources fit in this */
+#define HWC_SHADER_SRC_SIZE        2048
+
+/*
+ * One texture of an uploaded root. Roots larger than GL_MAX_TEXTURE_SIZE
+ * are split into several.
+ */
+typedef struct {
+    GLuint texture;
+    /* area of the root it holds */
+    BoxRec box;
+    /* damage not uploaded yet because it was outside the viewport */
+    RegionRec pending;
+} hwc_root_tile;
+
+/* Pixel layout of the root buffer, see hwc_root_formats in driver.c */
+typedef struct {
+    int depth;
+    int halFormat;
+    /* format and type for uploading it to a texture */
+    GLenum glFormat;
+    GLenum glType;
+    int cpp;
+    /* sampled as RGBA but holds BGRA pixels */
+    Bool swizzle;
+    /* 8 bit pseudocolor, expanded through the palette texture */
+    Bool indexed;
+    const char *name;
+} hwc_root_format;
+
+/* gralloc root buffers kept for reuse after the root changed size */
+#define HWC_ROOT_POOL_SIZE 2
+
+typedef struct {
+    EGLClientBuffer buffer;
+    int width;
+    int height;
+    int halFormat;
+    int stride;
+} hwc_root_pool_entry;
+
+/* HWComposer API picked by Option "HWComposerAPI" */
+typedef enum {
+    HWC_API_AUTO,
+    HWC_API_1,
+    HWC_API_2
+} hwc_api;
+
+/*
+ * The HWComposer API in use: HWC 1.x devices (hwcomposer.c) or HWC2
+ * through libhybris' hwc2 compat layer (hwc2.c). Both present from the
+ * same swap chains, the present hooks return the buffer's release fence.
+ */
+typedef struct {
+    const char *name;
+    void (*close)(ScrnInfoPtr pScrn);
+    void (*set_power_mode)(ScrnInfoPtr pScrn, int disp, int mode);
+    Bool (*can_set_active_config)(ScrnInfoPtr pScrn);
+    Bool (*set_active_config)(ScrnInfoPtr pScrn, int index);
+    void (*register_procs)(ScrnInfoPtr pScrn);
+    Bool (*set_vsync_enabled)(ScrnInfoPtr pScrn, Bool enabled);
+    Bool (*external_probe)(ScrnInfoPtr pScrn);
+    int (*present)(ScrnInfoPtr pScrn, struct ANativeWindowBuffer *buffer, int acquireFenceFd);
+    int (*present_external)(ScrnInfoPtr pScrn, struct ANativeWindowBuffer *buffer,
+                            int acquireFenceFd);
+} hwc_backend_funcs;
+
+/* What PreInit's capability probe found, see probe.c. Bandwidths in MB/s */
+typedef struct {
+    /* read from the probe cache rather than measured */
+    Bool cached;
+    /* gralloc buffers import as EGLImage textures */
+    Bool eglImage;
+    Bool bufferAge;
+    Bool timerQuery;
+    Bool programBinary;
+    Bool unpackSubimage;
+    uint32_t cachedRead;
+    uint32_t mappedRead;
+    uint32_t copy;
+} hwc_caps;
+
+#define HWC_MAX_CONFIGS 16
+
+/* assumed when a config doesn't report its vsync period, 60 Hz */
+#define HWC_DEFAULT_VSYNC_PERIOD 16666667
+
+/* One of the panel's HWComposer configs, as from getDisplayAttributes */
+typedef struct {
+    int width;
+    int height;
+    /* in ns */
+    int64_t vsyncPeriod;
+    int dpi;
+} hwc_display_config;
+
+/*
+ * HWC_DISPLAY_EXTERNAL, driven as a second RandR output and CRTC. It
+ * either shows its own part of the root from a swap chain of its own, or
+ * mirrors the panel by being handed the primary's composed buffer.
+ */
+typedef struct {
+    /* last state reported by the hotplug callback, -1 before any */
+    int hotplugState;
+    /* the fields below are only used on the main thread */
+    Bool connected;
+    int width;
+    int height;
+    int dpi;
+    int refresh;
+    hwc_display_contents_1_t *list;
+    hwc_layer_1_t *fblayer;
+    xf86OutputPtr output;
+    xf86CrtcPtr crtc;
+    /* the CRTC is on */
+    Bool enabled;
+    /* shows the same part of the root as the panel */
+    Bool clone;
+    int viewX;
+    int viewY;
+    int viewWidth;
+    int viewHeight;
+    /* needs a frame, set from the input thread too like HWCRec.dirty */
+    Bool dirty;
+    hwc_cursor_state cursorState;
+    struct ANativeWindow *window;
+    EGLSurface surface;
+} hwc_external_display;
+
+#define HWC_HISTOGRAM_BUCKETS 96
+
+typedef struct {
+    uint32_t buckets[HWC_HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+} hwc_histogram;
+
+typedef struct {
+    Bool enabled;
+    const char *file;
+    uint64_t start;
+    uint64_t frames;
+    uint64_t cpuTime;
+    uint64_t frameCpuStart;
+    uint64_t bytesSampled;
+    uint64_t bytesWritten;
+    uint64_t bytesUploaded;
+    uint64_t shadowBytes;
+    uint64_t shadowTime;
+    /* the server woke from poll() on a timeout or a cursor notification */
+    uint64_t wakeups;
+    /* arrival of the oldest damage not yet presented, 0 if none */
+    uint64_t damageTime;
+    /* damageTime as taken by the frame being composed */
+    uint64_t frameDamageTime;
+    hwc_histogram latency;
+} hwc_stats;
+
+#define HWC_LATENCY_PENDING 8
+
+/* Stage timestamps of one frame, in CLOCK_MONOTONIC us */
+typedef struct {
+    uint64_t arrival;
+    uint64_t compose;
+    uint64_t swap;
+    uint64_t set;
+    int fence;
+    Bool pending;
+} hwc_latency_frame;
+
+typedef struct {
+    Bool enabled;
+    pthread_mutex_t lock;
+    hwc_latency_frame current;
+    hwc_latency_frame pending[HWC_LATENCY_PENDING];
+    uint64_t dropped;
+    hwc_histogram total;
+    hwc_histogram queue;
+    hwc_histogram compose;
+    hwc_histogram swap;
+    hwc_histogram present;
+    /* the lock lives until FreeScreen, see hwc_latency_fini */
+    Bool lockInit;
+} hwc_latency;
+
+/* Per-tile hashes of the root, see tilehash.c */
+typedef struct {
+    Bool enabled;
+    int cols;
+    int rows;
+    uint64_t *hashes;
+    uint8_t *flags;
+    uint64_t reports;
+    uint64_t skipped;
+    uint64_t tiles;
+    uint64_t bytes;
+    uint64_t time;
+} hwc_tilehash;
+
+#define HWC_FB_MAX_THREADS 8
+
+typedef struct {
+    struct hwc_fb_threads *pool;
+    int index;
+    pthread_t thread;
+} hwc_fb_worker;
+
+/* Worker pool drawing large fb operations in tiles, see fbthreads.c */
+typedef struct hwc_fb_threads {
+    /* including the main thread, 1 when disabled */
+    int numThreads;
+    Bool started;
+    hwc_fb_worker workers[HWC_FB_MAX_THREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    Bool quit;
+    unsigned int generation;
+    /* the job, split into cols x numTiles / cols tiles of extents */
+    void (*proc)(void *job, const BoxRec *tile, int worker);
+    void *job;
+    BoxRec extents;
+    int tileWidth;
+    int tileHeight;
+    int cols;
+    int numTiles;
+    int nextTile;
+    /* workers still in the job */
+    int busy;
+    CreateGCProcPtr CreateGC;
+    CompositeProcPtr Composite;
+    uint64_t ops;
+    uint64_t tiles;
+    uint64_t time;
+} hwc_fb_threads;
+
+/* GLES drawing into the fb root, Option "AccelMethod" "gles", see glaccel.c */
+typedef struct {
+    Bool enabled;
+    GLuint fbo;
+    /* copies are staged here, GLES 2 can't sample the texture it draws to */
+    GLuint scratch;
+    int scratchWidth;
+    int scratchHeight;
+    GLenum scratchFormat;
+    GLenum scratchType;
+    hwc_renderer_shader copyShader;
+    hwc_renderer_shader solidShader;
+    /* root format solid fills were checked on, and whether they came
+       out wrong there, in which case only fills are left to fb */
+    const hwc_root_format *checkedFormat;
+    Bool fillsBroken;
+    CopyWindowProcPtr CopyWindow;
+    uint64_t ops;
+    uint64_t pixels;
+    uint64_t time;
+} hwc_gl_accel;
+
+#ifndef HWC_SHADER_CACHE_DIR
+#define HWC_SHADER_CACHE_DIR "/var/cache/xf86-video-hwcomposer"
+#endif
+
+#define HWC_STARTUP_PHASES 24
+
+typedef struct {
+    const char *name;
+    uint64_t start;
+    uint64_t end;
+} hwc_startup_phase;
+
+typedef struct {
+    uint64_t origin;
+    int numPhases;
+    int numLogged;
+    Bool done;
+    hwc_startup_phase phases[HWC_STARTUP_PHASES];
+} hwc_startup_profile;
+
+typedef struct {
+    pthread_t thread;
+    Bool running;
+} hwc_startup_task;
+
+/* hwc_procs_t handed to HWComposer, with a way back to the screen */
+typedef struct {
+    hwc_procs_t procs;
+    ScrnInfoPtr pScrn;
+    Bool registered;
+} hwc_procs_ctx;
+
+#define HWC_MOCK_RECORDS 256
+
+typedef struct {
+    uint64_t seq;
+    int64_t timestamp;
+    int call;
+    size_t numHwLayers;
+    int32_t targetComposition;
+    uint32_t flags;
+    uint64_t checksum;
+} hwc_mock_record;
+
 typedef struct {
     PFNEGLHYBRISCREATENATIVEBUFFERPROC eglHybrisCreateNativeBuffer;
     PFNEGLHYBRISLOCKNATIVEBUFFERPROC eglHybrisLockNativeBuffer;
@@ -85,14 +454,46 @@ typedef struct {
     EGLDisplay display;
     EGLSurface surface;
     EGLContext context;
+    EGLConfig config;
+    struct ANativeWindow *window;
     GLuint rootTexture;
     GLuint cursorTexture;
+    GLint maxTextureSize;
+    hwc_cursor_cache_entry cursorCache[HWC_CURSOR_CACHE_SIZE];
+    uint32_t cursorCacheClock;
+    unsigned long cursorCacheHits;
+    unsigned long cursorCacheMisses;
 
-    float projection[16];
     EGLImageKHR image;
+    /* EGL_HYBRIS_native_buffer is usable, otherwise the root is in system memory */
+    Bool nativeBuffers;
+    /* root buffer can't be imported, upload it to rootTexture instead */
+    Bool upload;
+    /* upload every root, not only those too large to import */
+    Bool uploadAlways;
+    /* next upload has to copy everything, not just the damage */
+    Bool uploadAll;
+    /* GL_UNPACK_ROW_LENGTH is available, for uploading sub-rectangles */
+    Bool unpackSubimage;
+    /* textures an uploaded root is split into, the first is rootTexture */
+    hwc_root_tile *tiles;
+    int numTiles;
+    /* rootTexture storage allocated for uploads */
+    Bool rootStorage;
+    /* colormap of an indexed root, 256x1 RGBA */
+    GLuint paletteTexture;
+    Bool paletteDirty;
+    /* RandR gamma ramp of the panel's CRTC as a 256x1 RGBA LUT, only
+       applied while it is not the identity */
+    GLuint gammaTexture;
+    GLubyte gamma[256 * 4];
+    Bool gammaActive;
+    Bool gammaDirty;
 
-    hwc_renderer_shader rootShader;
-    hwc_renderer_shader projShader;
+    /* composition shader variants by key, linked when first used */
+    hwc_renderer_shader variants[HWC_SHADER_VARIANTS];
+    /* variants that failed to link, not tried again */
+    uint32_t variantsFailed;
 } hwc_renderer_rec, *hwc_renderer_ptr;
 
 typedef struct HWCRec
@@ -105,6 +506,7 @@ typedef struct HWCRec
     CreateScreenResourcesProcPtr	CreateScreenResources;
     xf86CursorInfoPtr CursorInfo;
     ScreenBlockHandlerProcPtr BlockHandler;
+    ScreenWakeupHandlerProcPtr WakeupHandler;
     OsTimerPtr timer;
 
     dummy_colors colors[1024];
@@ -112,7 +514,11 @@ typedef struct HWCRec
     Bool prop;
 
     DamagePtr damage;
+    /* set from the input thread too, use atomics or hwc_cursor_wakeup() */
     Bool dirty;
+    /* damage accumulated since the last composed frame */
+    Bool trackFrameDamage;
+    RegionRec frameDamage;
     Bool glamor;
     Bool drihybris;
     hwc_rotation rotation;
@@ -121,21 +527,56 @@ typedef struct HWCRec
     alloc_device_t *alloc;
     void *libminisf;
 
+    hwc_api hwcApi;
+    const hwc_backend_funcs *backend;
+    /* HWC2 device, displays and layers, see hwc2.c */
+    struct hwc_hwc2 *hwc2;
     hwc_composer_device_1_t *hwcDevicePtr;
     hwc_display_contents_1_t **hwcContents;
     hwc_layer_1_t *fblayer;
     uint32_t hwcVersion;
     int hwcWidth;
     int hwcHeight;
+    int hwcDpi;
+    hwc_display_config configs[HWC_MAX_CONFIGS];
+    int numConfigs;
+    /* config HWComposer runs, and the one the RandR mode asks for */
+    int activeConfig;
+    int modeConfig;
+    /* composition timer period, from the active vsync period, in ms */
+    int updateInterval;
+    /* idle refresh-rate switching, see refresh.c */
+    int idleTimeout;
+    Bool refreshIdle;
+    CARD32 lastFrameTime;
 
     hwc_renderer_rec renderer;
     EGLClientBuffer buffer;
+    int bufferWidth;
+    int bufferHeight;
     int stride;
+    void *rootPixels;
+    const hwc_root_format *rootFormat;
+    /* released root buffers, oldest first */
+    hwc_root_pool_entry rootPool[HWC_ROOT_POOL_SIZE];
+    int rootPoolSize;
+    /* root size relative to the panel, from Option "RenderScale" */
+    double renderScale;
+
+    /* cached copy of the root buffer fb draws into, see shadow.c */
+    Bool shadowFB;
+    void *shadow;
+    size_t shadowSize;
 
-    Bool cursorShown;
+    Bool mockHal;
+    const char *mockHalMode;
+    Bool mockReadback;
+    uint64_t mockChecksum;
+    struct hwc_mock_device *mock;
+
+    hwc_cursor_state cursorState;
+    int cursorWakeFd;
     xf86CursorInfoPtr cursorInfo;
-    int cursorX;
-    int cursorY;
     int cursorWidth;
     int cursorHeight;
 
@@ -143,9 +584,142 @@ typedef struct HWCRec
     int screenBrightness;
 
     DisplayModePtr modes;
+    /* part of the root shown on the panel, from the CRTC mode and origin */
+    int viewX;
+    int viewY;
+    int viewWidth;
+    int viewHeight;
     int dpmsMode;
+    /* HWC_SUSPEND_* reasons for being in the low-power state */
+    unsigned int suspended;
+    Bool releaseOnSuspend;
+    uint64_t resumeTime;
+
+    Bool parallelInit;
+    const char *shaderCacheDir;
+    hwc_caps caps;
+    hwc_startup_profile startup;
+    hwc_startup_task eglDisplayTask;
+    hwc_startup_task lightsTask;
+
+    hwc_procs_ctx hwcProcs;
+    Bool vsyncEnabled;
+
+    hwc_external_display external;
+    int hotplugFd;
+
+    hwc_stats stats;
+    hwc_latency latency;
+    hwc_tilehash tileHash;
+    hwc_fb_threads fbThreads;
+    hwc_gl_accel glAccel;
+    struct hwc_trace *trace;
+    struct hwc_trace_replay *replay;
 } HWCRec, *HWCPtr;
 
+Bool hwc_external_extended(HWCPtr hwc);
+Bool hwc_external_cloned(HWCPtr hwc);
+uint32_t hwc_external_clone_frame(HWCPtr hwc, hwc_rect_t *frame);
+void hwc_hotplug_signal(HWCPtr hwc, int connected);
+
+void hwc_cursor_publish(HWCPtr hwc, hwc_cursor_state *state, int x, int y, Bool shown);
+void hwc_cursor_snapshot(hwc_cursor_state *state, hwc_cursor_state *out);
+void hwc_cursor_wakeup(HWCPtr hwc);
+Bool hwc_cursor_wakeup_init(ScreenPtr pScreen);
+void hwc_cursor_wakeup_close(ScreenPtr pScreen);
+void hwc_cursor_cache_init(ScreenPtr pScreen);
+void hwc_cursor_cache_close(ScrnInfoPtr pScrn);
+void hwc_cursor_cache_load(HWCPtr hwc, CARD32 *image);
+
+#ifdef ENABLE_MOCK_HAL
+hwc_composer_device_1_t *hwc_mock_hal_open(ScrnInfoPtr pScrn, const char *mode);
+void hwc_mock_hal_close(ScrnInfoPtr pScrn);
+struct light_device_t *hwc_mock_hal_lights(ScrnInfoPtr pScrn);
+void hwc_mock_hal_init_native_buffer(ScrnInfoPtr pScrn);
+EGLDisplay hwc_mock_hal_get_display(ScrnInfoPtr pScrn);
+void hwc_mock_hal_present(ScrnInfoPtr pScrn);
+int64_t hwc_mock_hal_last_vsync(ScrnInfoPtr pScrn);
+int hwc_mock_hal_get_records(ScrnInfoPtr pScrn, hwc_mock_record *out, int max);
+void hwc_mock_hal_write_json(FILE *f, ScrnInfoPtr pScrn);
+#endif
+
+void hwc_probe(ScrnInfoPtr pScrn, const char *dir);
+Bool hwc_probe_mapping_uncached(const hwc_caps *caps);
+
+uint64_t hwc_stats_now_us(void);
+void hwc_histogram_add(hwc_histogram *hist, uint64_t us);
+uint64_t hwc_histogram_percentile(const hwc_histogram *hist, double p);
+void hwc_histogram_write_json(FILE *f, const hwc_histogram *hist);
+void hwc_stats_init(ScrnInfoPtr pScrn, const char *file, Bool latency);
+void hwc_stats_damage(HWCPtr hwc);
+void hwc_stats_wakeup(HWCPtr hwc);
+void hwc_stats_frame_begin(HWCPtr hwc);
+void hwc_stats_frame_end(HWCPtr hwc);
+void hwc_stats_bytes(HWCPtr hwc, uint64_t sampled, uint64_t written);
+void hwc_stats_upload(HWCPtr hwc, uint64_t bytes);
+void hwc_stats_shadow(HWCPtr hwc, uint64_t bytes, uint64_t us);
+void hwc_stats_write(ScrnInfoPtr pScrn);
+
+void hwc_refresh_init(ScrnInfoPtr pScrn, int idleTimeout);
+DisplayModePtr hwc_refresh_modes(ScrnInfoPtr pScrn, int width, int height);
+void hwc_refresh_set_mode(ScrnInfoPtr pScrn, DisplayModePtr mode);
+void hwc_refresh_update_interval(ScrnInfoPtr pScrn);
+void hwc_refresh_frame(ScrnInfoPtr pScrn);
+void hwc_refresh_idle_check(ScrnInfoPtr pScrn);
+
+Bool hwc_shadow_alloc(ScrnInfoPtr pScrn);
+void hwc_shadow_free(ScrnInfoPtr pScrn);
+void hwc_shadow_update(ScreenPtr pScreen);
+
+#define HWC_SUSPEND_DPMS (1 << 0)
+#define HWC_SUSPEND_VT   (1 << 1)
+
+void hwc_power_init(ScrnInfoPtr pScrn);
+void hwc_power_suspend(ScrnInfoPtr pScrn, unsigned int reason);
+Bool hwc_power_resume(ScrnInfoPtr pScrn, unsigned int reason);
+
+void hwc_startup_begin(HWCPtr hwc);
+int hwc_startup_phase_begin(HWCPtr hwc, const char *name);
+void hwc_startup_phase_end(HWCPtr hwc, int phase);
+void hwc_startup_log(ScrnInfoPtr pScrn, const char *milestone, Bool last);
+void hwc_startup_run(HWCPtr hwc, hwc_startup_task *task,
+                     void *(*fn)(void *), void *arg);
+void hwc_startup_join(hwc_startup_task *task);
+
+void hwc_latency_init(ScrnInfoPtr pScrn, Bool enabled);
+void hwc_latency_close(ScrnInfoPtr pScrn);
+void hwc_latency_fini(ScrnInfoPtr pScrn);
+void hwc_latency_begin(HWCPtr hwc, uint64_t arrival);
+void hwc_latency_mark_swap(HWCPtr hwc);
+void hwc_latency_mark_set(HWCPtr hwc, int retireFenceFd);
+void hwc_latency_end(ScrnInfoPtr pScrn);
+void hwc_latency_vsync(HWCPtr hwc, uint64_t timestamp);
+void hwc_latency_write_json(FILE *f, HWCPtr hwc);
+
+void hwc_tilehash_init(ScrnInfoPtr pScrn, Bool enabled);
+void hwc_tilehash_close(ScrnInfoPtr pScrn);
+void hwc_tilehash_resize(ScrnInfoPtr pScrn);
+Bool hwc_tilehash_filter(ScrnInfoPtr pScrn, RegionPtr damage);
+void hwc_tilehash_write_json(FILE *f, HWCPtr hwc);
+
+void hwc_fb_threads_init(ScreenPtr pScreen, int threads);
+void hwc_fb_threads_close(ScrnInfoPtr pScrn);
+void hwc_fb_threads_write_json(FILE *f, HWCPtr hwc);
+
+void hwc_glaccel_init(ScreenPtr pScreen);
+void hwc_glaccel_close(ScrnInfoPtr pScrn);
+Bool hwc_glaccel_copy(DrawablePtr pSrc, DrawablePtr pDst, GCPtr pGC,
+                      const BoxRec *pbox, int nbox, int dx, int dy);
+Bool hwc_glaccel_fill(DrawablePtr pDrawable, GCPtr pGC, int nrect, xRectangle *prect);
+void hwc_glaccel_write_json(FILE *f, HWCPtr hwc);
+
+Bool hwc_trace_open(ScrnInfoPtr pScrn, const char *path, Bool pixels);
+void hwc_trace_close(ScrnInfoPtr pScrn);
+void hwc_trace_capture(ScreenPtr pScreen);
+Bool hwc_trace_replay_open(ScrnInfoPtr pScrn, const char *path);
+void hwc_trace_replay_step(ScreenPtr pScreen);
+void hwc_trace_replay_close(ScrnInfoPtr pScrn);
+
 /* The privates of the hwcomposer driver */
 #define HWCPTR(p)	((HWCPtr)((p)->driverPrivate))
 
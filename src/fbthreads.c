@@ -0,0 +1,584 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include "xf86.h"
+#include "fb.h"
+#include "fbpict.h"
+#include "mi.h"
+#include "picturestr.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "driver.h"
+
+/*
+ * Multi-threaded fb for large operations, enabled when Option
+ * "FbThreads" is 0 or above 1 (and fb renders rather than glamor).
+ *
+ * RENDER composites, PolyFillRect and CopyArea covering at least
+ * HWC_FB_MIN_PIXELS are split into HWC_FB_TILE_WIDTH x HWC_FB_TILE_HEIGHT
+ * tiles of the destination, small enough to stay in the cache, and the
+ * tiles are drawn by a pool of worker threads together with the main
+ * thread. Every destination pixel belongs to exactly one tile and each
+ * tile replays the whole operation clipped to it, so the result is the
+ * same as drawing it in one go. Smaller operations run inline.
+ *
+ * The hooks sit directly above fb, under damage and everything else
+ * wrapping the screen, so the workers only ever touch pixels: the GC,
+ * pictures and regions are read-only while a job runs, and pixman images,
+ * which validate themselves lazily, are created per worker on the main
+ * thread.
+ */
+
+#define HWC_FB_TILE_WIDTH 256
+#define HWC_FB_TILE_HEIGHT 64
+#define HWC_FB_MIN_PIXELS (256 * 256)
+/* above this many rectangles times clip boxes every tile walks, run inline */
+#define HWC_FB_MAX_BOXES 256
+/* spin this many times for the workers to finish before sleeping */
+#define HWC_FB_JOIN_SPINS 4096
+
+typedef void (*hwc_fb_tile_proc)(void *job, const BoxRec *tile, int worker);
+
+static GCOps hwc_fb_gc_ops;
+
+static inline void hwc_fb_relax(void)
+{
+#if defined(__SSE2__)
+    _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static hwc_fb_threads *hwc_fb_pool(ScreenPtr pScreen)
+{
+    return &HWCPTR(xf86ScreenToScrn(pScreen))->fbThreads;
+}
+
+static Bool hwc_fb_worth(hwc_fb_threads *pool, uint64_t pixels)
+{
+    return pool->numThreads > 1 && pixels >= HWC_FB_MIN_PIXELS;
+}
+
+static Bool hwc_fb_intersect(BoxPtr out, const BoxRec *a, const BoxRec *b)
+{
+    out->x1 = max(a->x1, b->x1);
+    out->y1 = max(a->y1, b->y1);
+    out->x2 = min(a->x2, b->x2);
+    out->y2 = min(a->y2, b->y2);
+    return out->x1 < out->x2 && out->y1 < out->y2;
+}
+
+static void hwc_fb_threads_work(hwc_fb_threads *pool, int worker)
+{
+    int tile;
+
+    while ((tile = __atomic_fetch_add(&pool->nextTile, 1, __ATOMIC_RELAXED)) < pool->numTiles) {
+        int col = tile % pool->cols, row = tile / pool->cols;
+        BoxRec box;
+
+        box.x1 = pool->extents.x1 + col * pool->tileWidth;
+        box.y1 = pool->extents.y1 + row * pool->tileHeight;
+        box.x2 = min(box.x1 + pool->tileWidth, pool->extents.x2);
+        box.y2 = min(box.y1 + pool->tileHeight, pool->extents.y2);
+        pool->proc(pool->job, &box, worker);
+    }
+}
+
+static void *hwc_fb_threads_worker(void *arg)
+{
+    hwc_fb_worker *worker = arg;
+    hwc_fb_threads *pool = worker->pool;
+    unsigned int seen = 0;
+    Bool quit;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->quit && pool->generation == seen)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        seen = pool->generation;
+        quit = pool->quit;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (quit)
+            return NULL;
+
+        hwc_fb_threads_work(pool, worker->index);
+
+        if (__atomic_sub_fetch(&pool->busy, 1, __ATOMIC_ACQ_REL) == 0) {
+            pthread_mutex_lock(&pool->lock);
+            pthread_cond_signal(&pool->idle);
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+}
+
+/*
+ * Split extents into tiles of tileWidth x tileHeight and run proc on
+ * each, on the workers and the calling thread, returning once all are
+ * drawn. worker is 0 on the main thread and 1..numThreads - 1 otherwise.
+ */
+static void hwc_fb_threads_run(hwc_fb_threads *pool, const BoxRec *extents,
+                               int tileWidth, int tileHeight,
+                               hwc_fb_tile_proc proc, void *job)
+{
+    uint64_t start = hwc_stats_now_us();
+    int spins;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->extents = *extents;
+    pool->tileWidth = tileWidth;
+    pool->tileHeight = tileHeight;
+    pool->cols = (extents->x2 - extents->x1 + tileWidth - 1) / tileWidth;
+    pool->numTiles = pool->cols * ((extents->y2 - extents->y1 + tileHeight - 1) / tileHeight);
+    pool->nextTile = 0;
+    pool->proc = proc;
+    pool->job = job;
+    pool->busy = pool->numThreads - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    hwc_fb_threads_work(pool, 0);
+
+    /* the last tiles are usually finishing right now, don't sleep for them */
+    for (spins = 0; spins < HWC_FB_JOIN_SPINS &&
+         __atomic_load_n(&pool->busy, __ATOMIC_ACQUIRE); spins++)
+        hwc_fb_relax();
+
+    if (__atomic_load_n(&pool->busy, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&pool->lock);
+        while (__atomic_load_n(&pool->busy, __ATOMIC_ACQUIRE))
+            pthread_cond_wait(&pool->idle, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    pool->ops++;
+    pool->tiles += pool->numTiles;
+    pool->time += hwc_stats_now_us() - start;
+}
+
+/* The pixmap pDrawable draws to, and the offset from screen to pixmap coordinates */
+static PixmapPtr hwc_fb_drawable_pixmap(DrawablePtr pDrawable, int *xoff, int *yoff)
+{
+    PixmapPtr pPixmap;
+
+    *xoff = *yoff = 0;
+    if (pDrawable->type != DRAWABLE_WINDOW)
+        return (PixmapPtr) pDrawable;
+
+    pPixmap = (*pDrawable->pScreen->GetWindowPixmap)((WindowPtr) pDrawable);
+#ifdef COMPOSITE
+    *xoff = -pPixmap->screen_x;
+    *yoff = -pPixmap->screen_y;
+#endif
+    return pPixmap;
+}
+
+typedef struct {
+    CARD8 op;
+    pixman_image_t *src[HWC_FB_MAX_THREADS];
+    pixman_image_t *mask[HWC_FB_MAX_THREADS];
+    pixman_image_t *dst[HWC_FB_MAX_THREADS];
+    /* source and mask coordinates of the destination origin */
+    int srcX, srcY;
+    int maskX, maskY;
+    int dstXoff, dstYoff;
+} hwc_fb_composite_job;
+
+static void hwc_fb_composite_tile(void *data, const BoxRec *tile, int worker)
+{
+    hwc_fb_composite_job *job = data;
+
+    pixman_image_composite32(job->op, job->src[worker], job->mask[worker], job->dst[worker],
+                             job->srcX + tile->x1, job->srcY + tile->y1,
+                             job->maskX + tile->x1, job->maskY + tile->y1,
+                             tile->x1 + job->dstXoff, tile->y1 + job->dstYoff,
+                             tile->x2 - tile->x1, tile->y2 - tile->y1);
+}
+
+/* Tiles reading what other tiles write would race */
+static Bool hwc_fb_picture_aliases(PicturePtr pPicture, PicturePtr pDst)
+{
+    int xoff, yoff;
+
+    return pPicture && pPicture->pDrawable &&
+           hwc_fb_drawable_pixmap(pPicture->pDrawable, &xoff, &yoff) ==
+           hwc_fb_drawable_pixmap(pDst->pDrawable, &xoff, &yoff);
+}
+
+/* fbComposite, with the destination rectangle split across the pool */
+static void
+hwc_fb_composite(CARD8 op, PicturePtr pSrc, PicturePtr pMask, PicturePtr pDst,
+                 INT16 xSrc, INT16 ySrc, INT16 xMask, INT16 yMask,
+                 INT16 xDst, INT16 yDst, CARD16 width, CARD16 height)
+{
+    hwc_fb_threads *pool = hwc_fb_pool(pDst->pDrawable->pScreen);
+    hwc_fb_composite_job job;
+    int srcXoff = 0, srcYoff = 0, maskXoff = 0, maskYoff = 0;
+    int i, n = pool->numThreads;
+    Bool ok = TRUE;
+    BoxRec extents;
+
+    if (!hwc_fb_worth(pool, (uint64_t) width * height) ||
+        hwc_fb_picture_aliases(pSrc, pDst) || hwc_fb_picture_aliases(pMask, pDst)) {
+        (*pool->Composite)(op, pSrc, pMask, pDst, xSrc, ySrc, xMask, yMask,
+                           xDst, yDst, width, height);
+        return;
+    }
+
+    miCompositeSourceValidate(pSrc);
+    if (pMask)
+        miCompositeSourceValidate(pMask);
+
+    memset(&job, 0, sizeof(job));
+    for (i = 0; i < n && ok; i++) {
+        job.src[i] = image_from_pict(pSrc, FALSE, &srcXoff, &srcYoff);
+        job.mask[i] = image_from_pict(pMask, FALSE, &maskXoff, &maskYoff);
+        job.dst[i] = image_from_pict(pDst, TRUE, &job.dstXoff, &job.dstYoff);
+        ok = job.src[i] && job.dst[i] && !(pMask && !job.mask[i]);
+    }
+
+    if (ok) {
+        job.op = op;
+        job.srcX = xSrc + srcXoff - xDst;
+        job.srcY = ySrc + srcYoff - yDst;
+        job.maskX = xMask + maskXoff - xDst;
+        job.maskY = yMask + maskYoff - yDst;
+
+        extents.x1 = xDst;
+        extents.y1 = yDst;
+        extents.x2 = xDst + width;
+        extents.y2 = yDst + height;
+        hwc_fb_threads_run(pool, &extents, HWC_FB_TILE_WIDTH, HWC_FB_TILE_HEIGHT,
+                           hwc_fb_composite_tile, &job);
+    }
+
+    for (i = 0; i < n; i++) {
+        free_pixman_pict(pSrc, job.src[i]);
+        free_pixman_pict(pMask, job.mask[i]);
+        free_pixman_pict(pDst, job.dst[i]);
+    }
+}
+
+typedef struct {
+    DrawablePtr pDrawable;
+    GCPtr pGC;
+    int nrect;
+    xRectangle *prect;
+    RegionPtr clip;
+} hwc_fb_fill_job;
+
+/* fbPolyFillRect restricted to one tile, rectangles are drawn in order */
+static void hwc_fb_fill_tile(void *data, const BoxRec *tile, int worker)
+{
+    hwc_fb_fill_job *job = data;
+    const BoxRec *clip = RegionRects(job->clip);
+    int nclip = RegionNumRects(job->clip);
+    int i, j;
+
+    for (i = 0; i < job->nrect; i++) {
+        const xRectangle *r = &job->prect[i];
+        BoxRec rect, part;
+        int x1 = r->x + job->pDrawable->x, y1 = r->y + job->pDrawable->y;
+
+        rect.x1 = max(x1, tile->x1);
+        rect.y1 = max(y1, tile->y1);
+        rect.x2 = min(x1 + (int) r->width, tile->x2);
+        rect.y2 = min(y1 + (int) r->height, tile->y2);
+        if (rect.x1 >= rect.x2 || rect.y1 >= rect.y2)
+            continue;
+
+        for (j = 0; j < nclip; j++) {
+            if (hwc_fb_intersect(&part, &rect, &clip[j]))
+                fbFill(job->pDrawable, job->pGC, part.x1, part.y1,
+                       part.x2 - part.x1, part.y2 - part.y1);
+        }
+    }
+}
+
+static void
+hwc_fb_poly_fill_rect(DrawablePtr pDrawable, GCPtr pGC, int nrect, xRectangle *prect)
+{
+    hwc_fb_threads *pool = hwc_fb_pool(pDrawable->pScreen);
+    RegionPtr clip = fbGetCompositeClip(pGC);
+    const BoxRec *clipExtents = RegionExtents(clip);
+    hwc_fb_fill_job job;
+    BoxRec extents, rect, part;
+    uint64_t pixels = 0;
+    int i;
+
+    if (hwc_glaccel_fill(pDrawable, pGC, nrect, prect))
+        return;
+
+    if (pool->numThreads <= 1 || !RegionNotEmpty(clip) ||
+        (uint64_t) nrect * RegionNumRects(clip) > HWC_FB_MAX_BOXES) {
+        fbPolyFillRect(pDrawable, pGC, nrect, prect);
+        return;
+    }
+
+    extents.x1 = extents.y1 = MAXSHORT;
+    extents.x2 = extents.y2 = MINSHORT;
+    for (i = 0; i < nrect; i++) {
+        int x1 = prect[i].x + pDrawable->x, y1 = prect[i].y + pDrawable->y;
+
+        rect.x1 = max(x1, MINSHORT);
+        rect.y1 = max(y1, MINSHORT);
+        rect.x2 = min(x1 + (int) prect[i].width, MAXSHORT);
+        rect.y2 = min(y1 + (int) prect[i].height, MAXSHORT);
+        if (!hwc_fb_intersect(&part, &rect, clipExtents))
+            continue;
+
+        pixels += (uint64_t) (part.x2 - part.x1) * (part.y2 - part.y1);
+        extents.x1 = min(extents.x1, part.x1);
+        extents.y1 = min(extents.y1, part.y1);
+        extents.x2 = max(extents.x2, part.x2);
+        extents.y2 = max(extents.y2, part.y2);
+    }
+
+    if (!hwc_fb_worth(pool, pixels)) {
+        fbPolyFillRect(pDrawable, pGC, nrect, prect);
+        return;
+    }
+
+    job.pDrawable = pDrawable;
+    job.pGC = pGC;
+    job.nrect = nrect;
+    job.prect = prect;
+    job.clip = clip;
+    hwc_fb_threads_run(pool, &extents, HWC_FB_TILE_WIDTH, HWC_FB_TILE_HEIGHT,
+                       hwc_fb_fill_tile, &job);
+}
+
+typedef struct {
+    DrawablePtr pSrc;
+    DrawablePtr pDst;
+    GCPtr pGC;
+    BoxPtr pbox;
+    int nbox;
+    int dx;
+    int dy;
+    Bool reverse;
+    Bool upsidedown;
+    Pixel bitplane;
+    void *closure;
+} hwc_fb_copy_job;
+
+static void hwc_fb_copy_tile(void *data, const BoxRec *tile, int worker)
+{
+    hwc_fb_copy_job *job = data;
+    BoxRec box;
+    int i;
+
+    /* in miDoCopy's order, which matters where boxes overlap their sources */
+    for (i = 0; i < job->nbox; i++) {
+        if (hwc_fb_intersect(&box, &job->pbox[i], tile))
+            fbCopyNtoN(job->pSrc, job->pDst, job->pGC, &box, 1, job->dx, job->dy,
+                       job->reverse, job->upsidedown, job->bitplane, job->closure);
+    }
+}
+
+/* miCopyProc drawing with GL or splitting fbCopyNtoN across the pool */
+static void
+hwc_fb_copy_boxes(DrawablePtr pSrc, DrawablePtr pDst, GCPtr pGC, BoxPtr pbox, int nbox,
+                  int dx, int dy, Bool reverse, Bool upsidedown, Pixel bitplane,
+                  void *closure)
+{
+    hwc_fb_threads *pool = hwc_fb_pool(pDst->pScreen);
+    int tileWidth = HWC_FB_TILE_WIDTH, tileHeight = HWC_FB_TILE_HEIGHT;
+    int srcXoff, srcYoff, dstXoff, dstYoff;
+    hwc_fb_copy_job job;
+    uint64_t pixels = 0;
+    Bool split = TRUE;
+    BoxRec extents;
+    int i;
+
+    if (!nbox || hwc_glaccel_copy(pSrc, pDst, pGC, pbox, nbox, dx, dy))
+        return;
+
+    extents = pbox[0];
+    for (i = 0; i < nbox; i++) {
+        pixels += (uint64_t) (pbox[i].x2 - pbox[i].x1) * (pbox[i].y2 - pbox[i].y1);
+        extents.x1 = min(extents.x1, pbox[i].x1);
+        extents.y1 = min(extents.y1, pbox[i].y1);
+        extents.x2 = max(extents.x2, pbox[i].x2);
+        extents.y2 = max(extents.y2, pbox[i].y2);
+    }
+
+    /*
+     * Copies within one pixmap (scrolling) are only split along the
+     * direction they move in: a vertical scroll stays inside full height
+     * columns, a horizontal one inside full width rows.
+     */
+    if (hwc_fb_drawable_pixmap(pSrc, &srcXoff, &srcYoff) ==
+        hwc_fb_drawable_pixmap(pDst, &dstXoff, &dstYoff)) {
+        int sx = dx + srcXoff - dstXoff, sy = dy + srcYoff - dstYoff;
+
+        if (sx && sy)
+            split = FALSE;
+        else if (sy)
+            tileHeight = extents.y2 - extents.y1;
+        else
+            tileWidth = extents.x2 - extents.x1;
+    }
+
+    if (!split || nbox > HWC_FB_MAX_BOXES || !hwc_fb_worth(pool, pixels)) {
+        fbCopyNtoN(pSrc, pDst, pGC, pbox, nbox, dx, dy, reverse, upsidedown,
+                   bitplane, closure);
+        return;
+    }
+
+    job.pSrc = pSrc;
+    job.pDst = pDst;
+    job.pGC = pGC;
+    job.pbox = pbox;
+    job.nbox = nbox;
+    job.dx = dx;
+    job.dy = dy;
+    job.reverse = reverse;
+    job.upsidedown = upsidedown;
+    job.bitplane = bitplane;
+    job.closure = closure;
+    hwc_fb_threads_run(pool, &extents, tileWidth, tileHeight, hwc_fb_copy_tile, &job);
+}
+
+static RegionPtr
+hwc_fb_copy_area(DrawablePtr pSrc, DrawablePtr pDst, GCPtr pGC,
+                 int xIn, int yIn, int width, int height, int xOut, int yOut)
+{
+    HWCPtr hwc = HWCPTR(xf86ScreenToScrn(pDst->pScreen));
+
+    if (!hwc->glAccel.enabled && !hwc_fb_worth(&hwc->fbThreads, (uint64_t) width * height))
+        return fbCopyArea(pSrc, pDst, pGC, xIn, yIn, width, height, xOut, yOut);
+
+    return miDoCopy(pSrc, pDst, pGC, xIn, yIn, width, height, xOut, yOut,
+                    hwc_fb_copy_boxes, 0, NULL);
+}
+
+static Bool hwc_fb_create_gc(GCPtr pGC)
+{
+    hwc_fb_threads *pool = hwc_fb_pool(pGC->pScreen);
+
+    if (!(*pool->CreateGC)(pGC))
+        return FALSE;
+
+    if (pGC->ops == &fbGCOps)
+        pGC->ops = &hwc_fb_gc_ops;
+    return TRUE;
+}
+
+static void hwc_fb_threads_start(ScrnInfoPtr pScrn, hwc_fb_threads *pool, int threads)
+{
+    sigset_t all, saved;
+    int i;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    pool->started = TRUE;
+
+    /* signals are for the main thread only */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    for (i = 1; i < threads; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        if (pthread_create(&pool->workers[i].thread, NULL, hwc_fb_threads_worker,
+                           &pool->workers[i]) != 0)
+            break;
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+    pool->numThreads = i;
+    if (pool->numThreads <= 1) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING, "failed to start fb worker threads\n");
+        hwc_fb_threads_close(pScrn);
+        return;
+    }
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+               "fb: drawing operations over %d pixels on %d threads\n",
+               HWC_FB_MIN_PIXELS, pool->numThreads);
+}
+
+/*
+ * Start threads - 1 workers (all online CPUs up to HWC_FB_MAX_THREADS
+ * for 0) and wrap fb's hooks, which the GLES acceleration goes through
+ * as well. Must run right after fbPictureInit and hwc_glaccel_init,
+ * before anything else wraps the screen.
+ */
+void hwc_fb_threads_init(ScreenPtr pScreen, int threads)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    hwc_fb_threads *pool = hwc_fb_pool(pScreen);
+    PictureScreenPtr ps = GetPictureScreenIfSet(pScreen);
+
+    memset(pool, 0, sizeof(*pool));
+    pool->numThreads = 1;
+
+    if (threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        threads = cpus > 0 ? cpus : 1;
+    }
+    if (threads > HWC_FB_MAX_THREADS)
+        threads = HWC_FB_MAX_THREADS;
+    if (threads > 1 && ps)
+        hwc_fb_threads_start(pScrn, pool, threads);
+
+    if (pool->numThreads <= 1 && !HWCPTR(pScrn)->glAccel.enabled)
+        return;
+
+    hwc_fb_gc_ops = fbGCOps;
+    hwc_fb_gc_ops.PolyFillRect = hwc_fb_poly_fill_rect;
+    hwc_fb_gc_ops.CopyArea = hwc_fb_copy_area;
+
+    pool->CreateGC = pScreen->CreateGC;
+    pScreen->CreateGC = hwc_fb_create_gc;
+    if (ps) {
+        pool->Composite = ps->Composite;
+        ps->Composite = hwc_fb_composite;
+    }
+}
+
+/* Stop the workers, the hooks fall through to fb from now on */
+void hwc_fb_threads_close(ScrnInfoPtr pScrn)
+{
+    hwc_fb_threads *pool = &HWCPTR(pScrn)->fbThreads;
+    int i, workers = pool->numThreads;
+
+    if (!pool->started)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = TRUE;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 1; i < workers; i++)
+        pthread_join(pool->workers[i].thread, NULL);
+
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    pool->started = FALSE;
+    pool->numThreads = 1;
+}
+
+void hwc_fb_threads_write_json(FILE *f, HWCPtr hwc)
+{
+    hwc_fb_threads *pool = &hwc->fbThreads;
+
+    fprintf(f, "{\"threads\":%d,\"ops\":%llu,\"tiles\":%llu,\"us\":%llu}",
+            pool->numThreads,
+            (unsigned long long) pool->ops,
+            (unsigned long long) pool->tiles,
+            (unsigned long long) pool->time);
+}
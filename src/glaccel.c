@@ -0,0 +1,591 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include "xf86.h"
+#include "fb.h"
+#include "mi.h"
+
+#include "driver.h"
+
+/*
+ * GLES acceleration of the fb root, Option "AccelMethod" "gles".
+ *
+ * Without glamor everything is drawn by fb on the CPU, often into an
+ * uncached gralloc mapping. The operations that touch the most pixels on
+ * a desktop, moving windows (CopyWindow), scrolling (CopyArea within the
+ * root) and solid fills (PolyFillRect), are drawn by GL instead into a
+ * framebuffer object with the root texture, the EGLImage of the root
+ * gralloc buffer, attached. Copies go through a scratch texture, as GLES 2
+ * can't read and write the same texture in one draw.
+ *
+ * Each accelerated operation is drawn synchronously on the server thread,
+ * between the unlock and lock of the root buffer the composition already
+ * does: unlocking hands the pixels fb wrote to the GPU, and the buffer is
+ * locked again only after glFinish, so fb never sees a partly drawn
+ * result and nothing has to track CPU access to the root. That costs a
+ * GPU round trip, so operations under HWC_GLACCEL_MIN_PIXELS stay on the
+ * CPU.
+ *
+ * The hooks sit on top of fb next to the threaded fb ones (fbthreads.c),
+ * which call hwc_glaccel_copy and hwc_glaccel_fill first.
+ */
+
+#define HWC_GLACCEL_MIN_PIXELS (128 * 128)
+/* rectangles times clip boxes drawn in one operation */
+#define HWC_GLACCEL_MAX_BOXES 1024
+
+extern const char vertex_src[];
+extern const char fragment_src[];
+
+static const char fragment_src_solid[] =
+    "uniform lowp vec4 color;\n"
+
+    "void main()\n"
+    "{\n"
+    "    gl_FragColor = color;\n"
+    "}\n";
+
+static hwc_gl_accel *hwc_glaccel_get(ScreenPtr pScreen)
+{
+    return &HWCPTR(xf86ScreenToScrn(pScreen))->glAccel;
+}
+
+/* GL can draw into the root right now */
+static Bool hwc_glaccel_usable(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+
+    return hwc->glAccel.enabled && pScrn->vtSema && !hwc->suspended &&
+           hwc->buffer && hwc->rootPixels && !hwc->shadow &&
+           !hwc->rootFormat->indexed && hwc->renderer.image != EGL_NO_IMAGE_KHR;
+}
+
+/* The root pixmap if pDrawable draws into it, with the offset into it */
+static PixmapPtr hwc_glaccel_root(DrawablePtr pDrawable, int *xoff, int *yoff)
+{
+    ScreenPtr pScreen = pDrawable->pScreen;
+    PixmapPtr pPixmap;
+
+    *xoff = *yoff = 0;
+    if (pDrawable->type != DRAWABLE_WINDOW) {
+        pPixmap = (PixmapPtr) pDrawable;
+    } else {
+        pPixmap = (*pScreen->GetWindowPixmap)((WindowPtr) pDrawable);
+#ifdef COMPOSITE
+        *xoff = -pPixmap->screen_x;
+        *yoff = -pPixmap->screen_y;
+#endif
+    }
+
+    return pPixmap == (*pScreen->GetScreenPixmap)(pScreen) ? pPixmap : NULL;
+}
+
+/* Plain copies: GXcopy with every plane of the drawable */
+static Bool hwc_glaccel_gc_copies(GCPtr pGC, int depth)
+{
+    unsigned long mask = depth >= 32 ? ~0UL : (1UL << depth) - 1;
+
+    return !pGC || (pGC->alu == GXcopy && (pGC->planemask & mask) == mask);
+}
+
+static Bool hwc_glaccel_link(ScrnInfoPtr pScrn, hwc_renderer_shader *shader,
+                             const char *fragment, const char *what)
+{
+    shader->program = hwc_link_program(vertex_src, fragment);
+    if (!shader->program) {
+        xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "failed to link %s shader\n", what);
+        return FALSE;
+    }
+
+    shader->position = glGetAttribLocation(shader->program, "position");
+    shader->texcoords = glGetAttribLocation(shader->program, "texcoords");
+    shader->texture = glGetUniformLocation(shader->program, "texture");
+    shader->color = glGetUniformLocation(shader->program, "color");
+    return TRUE;
+}
+
+static void hwc_glaccel_disable(ScrnInfoPtr pScrn, const char *why)
+{
+    xf86DrvMsg(pScrn->scrnIndex, X_WARNING, "gles acceleration disabled: %s\n", why);
+    HWCPTR(pScrn)->glAccel.enabled = FALSE;
+}
+
+/* Wait for the GPU and hand the root back to fb, counting pixels drawn */
+static void hwc_glaccel_end(ScrnInfoPtr pScrn, uint64_t start, uint64_t pixels)
+{
+    ScreenPtr pScreen = xf86ScrnToScreen(pScrn);
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_gl_accel *accel = &hwc->glAccel;
+    void *mapped = NULL;
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(0, 0, hwc->hwcWidth, hwc->hwcHeight);
+    /* fb may read or write the pixels as soon as this returns */
+    glFinish();
+
+    hwc->renderer.eglHybrisLockNativeBuffer(hwc->buffer,
+                                            HYBRIS_USAGE_SW_READ_OFTEN|HYBRIS_USAGE_SW_WRITE_OFTEN,
+                                            0, 0, hwc->stride, pScrn->virtualY, &mapped);
+    hwc->rootPixels = mapped;
+    if (!pScreen->ModifyPixmapHeader(pScreen->GetScreenPixmap(pScreen),
+                                     -1, -1, -1, -1, -1, mapped))
+        FatalError("Couldn't adjust screen pixmap\n");
+
+    if (pixels) {
+        accel->ops++;
+        accel->pixels += pixels;
+        accel->time += hwc_stats_now_us() - start;
+    }
+}
+
+/* Give the root to the GPU and draw into it from here on */
+static Bool hwc_glaccel_begin(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_gl_accel *accel = &hwc->glAccel;
+    hwc_renderer_ptr renderer = &hwc->renderer;
+    GLenum status;
+
+    if (!accel->fbo) {
+        if (!hwc_glaccel_link(pScrn, &accel->copyShader, fragment_src, "copy") ||
+            !hwc_glaccel_link(pScrn, &accel->solidShader, fragment_src_solid, "solid fill")) {
+            hwc_glaccel_disable(pScrn, "no shaders");
+            return FALSE;
+        }
+        glGenFramebuffers(1, &accel->fbo);
+    }
+
+    /* unlocking flushes what fb wrote for the GPU */
+    renderer->eglHybrisUnlockNativeBuffer(hwc->buffer);
+
+    /* the root texture changes storage when the screen is resized */
+    glBindFramebuffer(GL_FRAMEBUFFER, accel->fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                           renderer->rootTexture, 0);
+    status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING, "root framebuffer status 0x%x\n", status);
+        hwc_glaccel_disable(pScrn, "the root texture can't be rendered to");
+        hwc_glaccel_end(pScrn, 0, 0);
+        return FALSE;
+    }
+
+    glViewport(0, 0, pScrn->virtualX, pScrn->virtualY);
+    glActiveTexture(GL_TEXTURE0);
+    return TRUE;
+}
+
+/* Two triangles per box, in root pixel coordinates */
+static void hwc_glaccel_quad(GLfloat *out, const BoxRec *box, float scaleX, float scaleY,
+                             float offsetX, float offsetY)
+{
+    const float x1 = box->x1 * scaleX + offsetX, y1 = box->y1 * scaleY + offsetY;
+    const float x2 = box->x2 * scaleX + offsetX, y2 = box->y2 * scaleY + offsetY;
+    const GLfloat quad[12] = { x1, y1, x2, y1, x1, y2, x1, y2, x2, y1, x2, y2 };
+
+    memcpy(out, quad, sizeof(quad));
+}
+
+/* The scratch texture copies are staged in, at least width x height */
+static Bool hwc_glaccel_scratch(ScrnInfoPtr pScrn, int width, int height)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_gl_accel *accel = &hwc->glAccel;
+    GLenum format = GL_RGBA, type = GL_UNSIGNED_BYTE;
+    GLint alphaBits = 0;
+
+    if (hwc->rootFormat->cpp == 2) {
+        format = GL_RGB;
+        type = GL_UNSIGNED_SHORT_5_6_5;
+    } else {
+        /* copying to a format with more channels than the root is an error */
+        glGetIntegerv(GL_ALPHA_BITS, &alphaBits);
+        if (!alphaBits)
+            format = GL_RGB;
+    }
+
+    if (!accel->scratch) {
+        glGenTextures(1, &accel->scratch);
+        glBindTexture(GL_TEXTURE_2D, accel->scratch);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    } else {
+        glBindTexture(GL_TEXTURE_2D, accel->scratch);
+    }
+
+    if (width > accel->scratchWidth || height > accel->scratchHeight ||
+        format != accel->scratchFormat || type != accel->scratchType) {
+        width = max(width, accel->scratchWidth);
+        height = max(height, accel->scratchHeight);
+        while (glGetError() != GL_NO_ERROR)
+            ;
+        glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, type, NULL);
+        if (glGetError() != GL_NO_ERROR) {
+            accel->scratchWidth = accel->scratchHeight = 0;
+            return FALSE;
+        }
+        accel->scratchWidth = width;
+        accel->scratchHeight = height;
+        accel->scratchFormat = format;
+        accel->scratchType = type;
+    }
+    return TRUE;
+}
+
+/*
+ * Copy nbox boxes of the root, in root pixmap coordinates, from
+ * box + (dx, dy). All sources are staged in the scratch texture before
+ * anything is drawn, so overlapping copies need no ordering.
+ */
+static Bool hwc_glaccel_copy_root(ScrnInfoPtr pScrn, const BoxRec *pbox, int nbox,
+                                  int dx, int dy, uint64_t pixels)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_gl_accel *accel = &hwc->glAccel;
+    hwc_renderer_shader *shader = &accel->copyShader;
+    uint64_t start = hwc_stats_now_us();
+    GLfloat *vertices, *texcoords;
+    BoxRec src;
+    int i, width, height;
+
+    src.x1 = src.y1 = MAXSHORT;
+    src.x2 = src.y2 = MINSHORT;
+    for (i = 0; i < nbox; i++) {
+        src.x1 = min(src.x1, pbox[i].x1 + dx);
+        src.y1 = min(src.y1, pbox[i].y1 + dy);
+        src.x2 = max(src.x2, pbox[i].x2 + dx);
+        src.y2 = max(src.y2, pbox[i].y2 + dy);
+    }
+    width = src.x2 - src.x1;
+    height = src.y2 - src.y1;
+    if (width > hwc->renderer.maxTextureSize || height > hwc->renderer.maxTextureSize)
+        return FALSE;
+
+    vertices = malloc(sizeof(GLfloat) * 24 * nbox);
+    if (!vertices)
+        return FALSE;
+    texcoords = vertices + 12 * nbox;
+
+    if (!hwc_glaccel_begin(pScrn)) {
+        free(vertices);
+        return FALSE;
+    }
+
+    if (!hwc_glaccel_scratch(pScrn, width, height)) {
+        hwc_glaccel_end(pScrn, start, 0);
+        free(vertices);
+        return FALSE;
+    }
+    glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, src.x1, src.y1, width, height);
+
+    for (i = 0; i < nbox; i++) {
+        hwc_glaccel_quad(vertices + 12 * i, &pbox[i],
+                         2.0f / pScrn->virtualX, 2.0f / pScrn->virtualY, -1.0f, -1.0f);
+        hwc_glaccel_quad(texcoords + 12 * i, &pbox[i],
+                         1.0f / accel->scratchWidth, 1.0f / accel->scratchHeight,
+                         (float) (dx - src.x1) / accel->scratchWidth,
+                         (float) (dy - src.y1) / accel->scratchHeight);
+    }
+
+    glUseProgram(shader->program);
+    glUniform1i(shader->texture, 0);
+    glVertexAttribPointer(shader->position, 2, GL_FLOAT, 0, 0, vertices);
+    glEnableVertexAttribArray(shader->position);
+    glVertexAttribPointer(shader->texcoords, 2, GL_FLOAT, 0, 0, texcoords);
+    glEnableVertexAttribArray(shader->texcoords);
+
+    glDrawArrays(GL_TRIANGLES, 0, 6 * nbox);
+
+    glDisableVertexAttribArray(shader->position);
+    glDisableVertexAttribArray(shader->texcoords);
+
+    hwc_glaccel_end(pScrn, start, pixels);
+    free(vertices);
+    return TRUE;
+}
+
+/*
+ * miCopyProc boxes from fb's CopyArea and CopyWindow, in screen
+ * coordinates of pDst. Returns FALSE to leave them to fb.
+ */
+Bool hwc_glaccel_copy(DrawablePtr pSrc, DrawablePtr pDst, GCPtr pGC,
+                      const BoxRec *pbox, int nbox, int dx, int dy)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pDst->pScreen);
+    int srcXoff, srcYoff, dstXoff, dstYoff;
+    uint64_t pixels = 0;
+    BoxRec *boxes;
+    Bool ret;
+    int i;
+
+    if (!hwc_glaccel_usable(pScrn) || !nbox || nbox > HWC_GLACCEL_MAX_BOXES ||
+        !hwc_glaccel_gc_copies(pGC, pDst->depth) ||
+        !hwc_glaccel_root(pSrc, &srcXoff, &srcYoff) ||
+        !hwc_glaccel_root(pDst, &dstXoff, &dstYoff))
+        return FALSE;
+
+    for (i = 0; i < nbox; i++)
+        pixels += (uint64_t) (pbox[i].x2 - pbox[i].x1) * (pbox[i].y2 - pbox[i].y1);
+    if (pixels < HWC_GLACCEL_MIN_PIXELS)
+        return FALSE;
+
+    boxes = malloc(sizeof(BoxRec) * nbox);
+    if (!boxes)
+        return FALSE;
+    for (i = 0; i < nbox; i++) {
+        boxes[i].x1 = pbox[i].x1 + dstXoff;
+        boxes[i].y1 = pbox[i].y1 + dstYoff;
+        boxes[i].x2 = pbox[i].x2 + dstXoff;
+        boxes[i].y2 = pbox[i].y2 + dstYoff;
+    }
+
+    ret = hwc_glaccel_copy_root(pScrn, boxes, nbox, dx + srcXoff - dstXoff,
+                                dy + srcYoff - dstYoff, pixels);
+    free(boxes);
+    return ret;
+}
+
+/*
+ * The GL color writing pixel into the root. GL sees the channels of a
+ * BGRX8888 or RGB565 root as X does; RGBA8888 holds BGRX pixels, so GL's
+ * red is X's blue there.
+ */
+static void hwc_glaccel_color(HWCPtr hwc, Pixel pixel, GLfloat *color)
+{
+    const hwc_root_format *format = hwc->rootFormat;
+
+    if (format->cpp == 2) {
+        color[0] = ((pixel >> 11) & 0x1f) / 31.0f;
+        color[1] = ((pixel >> 5) & 0x3f) / 63.0f;
+        color[2] = (pixel & 0x1f) / 31.0f;
+        color[3] = 1.0f;
+    } else {
+        color[0] = ((pixel >> (format->swizzle ? 0 : 16)) & 0xff) / 255.0f;
+        color[1] = ((pixel >> 8) & 0xff) / 255.0f;
+        color[2] = ((pixel >> (format->swizzle ? 16 : 0)) & 0xff) / 255.0f;
+        color[3] = ((pixel >> 24) & 0xff) / 255.0f;
+    }
+}
+
+/*
+ * Before the first fill on a root format, fill the root's first pixel
+ * with a known color and read it back through the mapping, so a channel
+ * order that doesn't match the gralloc format leaves the fills to fb
+ * instead of drawing wrong colors. Copies don't depend on the channel
+ * order and stay accelerated. The pixel is restored afterwards.
+ */
+static Bool hwc_glaccel_check_fill(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_gl_accel *accel = &hwc->glAccel;
+    hwc_renderer_shader *shader = &accel->solidShader;
+    const hwc_root_format *format = hwc->rootFormat;
+    /* distinct red, green and blue */
+    const Pixel expected = format->cpp == 2 ? 0x8ca3 : 0x123456;
+    const BoxRec box = { 0, 0, 1, 1 };
+    uint32_t saved, value;
+    GLfloat color[4], vertices[12];
+
+    if (accel->checkedFormat == format)
+        return !accel->fillsBroken;
+
+    if (format->cpp == 2)
+        saved = *(uint16_t *) hwc->rootPixels;
+    else
+        saved = *(uint32_t *) hwc->rootPixels;
+
+    if (!hwc_glaccel_begin(pScrn))
+        return FALSE;
+
+    hwc_glaccel_quad(vertices, &box,
+                     2.0f / pScrn->virtualX, 2.0f / pScrn->virtualY, -1.0f, -1.0f);
+    hwc_glaccel_color(hwc, expected, color);
+    glUseProgram(shader->program);
+    glUniform4fv(shader->color, 1, color);
+    glVertexAttribPointer(shader->position, 2, GL_FLOAT, 0, 0, vertices);
+    glEnableVertexAttribArray(shader->position);
+    glDrawArrays(GL_TRIANGLES, 0, 6);
+    glDisableVertexAttribArray(shader->position);
+
+    hwc_glaccel_end(pScrn, 0, 0);
+
+    if (format->cpp == 2) {
+        value = *(uint16_t *) hwc->rootPixels;
+        *(uint16_t *) hwc->rootPixels = saved;
+    } else {
+        value = *(uint32_t *) hwc->rootPixels & 0xffffff;
+        *(uint32_t *) hwc->rootPixels = saved;
+    }
+
+    accel->checkedFormat = format;
+    accel->fillsBroken = value != expected;
+    if (accel->fillsBroken) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                   "solid fill of 0x%06lx reads back as 0x%06x on the %s root, "
+                   "leaving fills to fb\n",
+                   (unsigned long) expected, value, format->name);
+        return FALSE;
+    }
+    xf86DrvMsgVerb(pScrn->scrnIndex, X_INFO, 3, "gles solid fills checked on the %s root\n",
+                   format->name);
+    return TRUE;
+}
+
+/* Solid PolyFillRect into the root. Returns FALSE to leave it to fb */
+Bool hwc_glaccel_fill(DrawablePtr pDrawable, GCPtr pGC, int nrect, xRectangle *prect)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pDrawable->pScreen);
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_shader *shader = &hwc->glAccel.solidShader;
+    RegionPtr clip = fbGetCompositeClip(pGC);
+    const BoxRec *clipBoxes = RegionRects(clip);
+    int nclip = RegionNumRects(clip);
+    uint64_t start = hwc_stats_now_us(), pixels = 0;
+    int xoff, yoff, i, j, n = 0;
+    GLfloat color[4], *vertices;
+    BoxRec rect, box;
+
+    if (!hwc_glaccel_usable(pScrn) || pGC->fillStyle != FillSolid ||
+        !hwc_glaccel_gc_copies(pGC, pDrawable->depth) || !nclip ||
+        (uint64_t) nrect * nclip > HWC_GLACCEL_MAX_BOXES ||
+        !hwc_glaccel_root(pDrawable, &xoff, &yoff))
+        return FALSE;
+
+    vertices = malloc(sizeof(GLfloat) * 12 * nrect * nclip);
+    if (!vertices)
+        return FALSE;
+
+    /* clipped like fbPolyFillRect, then moved into the root pixmap */
+    for (i = 0; i < nrect; i++) {
+        int x1 = prect[i].x + pDrawable->x, y1 = prect[i].y + pDrawable->y;
+
+        rect.x1 = max(x1, MINSHORT);
+        rect.y1 = max(y1, MINSHORT);
+        rect.x2 = min(x1 + (int) prect[i].width, MAXSHORT);
+        rect.y2 = min(y1 + (int) prect[i].height, MAXSHORT);
+
+        for (j = 0; j < nclip; j++) {
+            box.x1 = max(rect.x1, clipBoxes[j].x1) + xoff;
+            box.y1 = max(rect.y1, clipBoxes[j].y1) + yoff;
+            box.x2 = min(rect.x2, clipBoxes[j].x2) + xoff;
+            box.y2 = min(rect.y2, clipBoxes[j].y2) + yoff;
+            if (box.x1 >= box.x2 || box.y1 >= box.y2)
+                continue;
+
+            pixels += (uint64_t) (box.x2 - box.x1) * (box.y2 - box.y1);
+            hwc_glaccel_quad(vertices + 12 * n++, &box,
+                             2.0f / pScrn->virtualX, 2.0f / pScrn->virtualY, -1.0f, -1.0f);
+        }
+    }
+
+    if (pixels < HWC_GLACCEL_MIN_PIXELS || !hwc_glaccel_check_fill(pScrn) ||
+        !hwc_glaccel_begin(pScrn)) {
+        free(vertices);
+        return FALSE;
+    }
+
+    hwc_glaccel_color(hwc, pGC->fgPixel, color);
+    glUseProgram(shader->program);
+    glUniform4fv(shader->color, 1, color);
+    glVertexAttribPointer(shader->position, 2, GL_FLOAT, 0, 0, vertices);
+    glEnableVertexAttribArray(shader->position);
+
+    glDrawArrays(GL_TRIANGLES, 0, 6 * n);
+
+    glDisableVertexAttribArray(shader->position);
+
+    hwc_glaccel_end(pScrn, start, pixels);
+    free(vertices);
+    return TRUE;
+}
+
+static void
+hwc_glaccel_copy_window_proc(DrawablePtr pSrc, DrawablePtr pDst, GCPtr pGC,
+                             BoxPtr pbox, int nbox, int dx, int dy, Bool reverse,
+                             Bool upsidedown, Pixel bitplane, void *closure)
+{
+    if (!hwc_glaccel_copy(pSrc, pDst, pGC, pbox, nbox, dx, dy))
+        fbCopyNtoN(pSrc, pDst, pGC, pbox, nbox, dx, dy, reverse, upsidedown,
+                   bitplane, closure);
+}
+
+/* fbCopyWindow, with moves within the root drawn by GL */
+static void hwc_glaccel_copy_window(WindowPtr pWin, DDXPointRec ptOldOrg, RegionPtr prgnSrc)
+{
+    ScreenPtr pScreen = pWin->drawable.pScreen;
+    hwc_gl_accel *accel = hwc_glaccel_get(pScreen);
+    PixmapPtr pPixmap = (*pScreen->GetWindowPixmap)(pWin);
+    RegionRec rgnDst;
+    int dx, dy;
+
+    if (!hwc_glaccel_usable(xf86ScreenToScrn(pScreen)) ||
+        pPixmap != (*pScreen->GetScreenPixmap)(pScreen)) {
+        (*accel->CopyWindow)(pWin, ptOldOrg, prgnSrc);
+        return;
+    }
+
+    dx = ptOldOrg.x - pWin->drawable.x;
+    dy = ptOldOrg.y - pWin->drawable.y;
+    RegionTranslate(prgnSrc, -dx, -dy);
+    RegionNull(&rgnDst);
+    RegionIntersect(&rgnDst, &pWin->borderClip, prgnSrc);
+#ifdef COMPOSITE
+    if (pPixmap->screen_x || pPixmap->screen_y)
+        RegionTranslate(&rgnDst, -pPixmap->screen_x, -pPixmap->screen_y);
+#endif
+    miCopyRegion(&pPixmap->drawable, &pPixmap->drawable, NULL, &rgnDst, dx, dy,
+                 hwc_glaccel_copy_window_proc, 0, NULL);
+    RegionUninit(&rgnDst);
+}
+
+/* Wrap CopyWindow, right on top of fb like hwc_fb_threads_init */
+void hwc_glaccel_init(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    hwc_gl_accel *accel = hwc_glaccel_get(pScreen);
+
+    if (!accel->enabled)
+        return;
+
+    accel->ops = accel->pixels = accel->time = 0;
+    accel->CopyWindow = pScreen->CopyWindow;
+    pScreen->CopyWindow = hwc_glaccel_copy_window;
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+               "gles acceleration of window moves, scrolls and solid fills over %d pixels\n",
+               HWC_GLACCEL_MIN_PIXELS);
+}
+
+/* Called before the renderer closes, while the context is still current */
+void hwc_glaccel_close(ScrnInfoPtr pScrn)
+{
+    hwc_gl_accel *accel = &HWCPTR(pScrn)->glAccel;
+
+    if (accel->fbo) {
+        glDeleteFramebuffers(1, &accel->fbo);
+        glDeleteProgram(accel->copyShader.program);
+        glDeleteProgram(accel->solidShader.program);
+        accel->fbo = 0;
+        accel->checkedFormat = NULL;
+    }
+    if (accel->scratch) {
+        glDeleteTextures(1, &accel->scratch);
+        accel->scratch = 0;
+        accel->scratchWidth = accel->scratchHeight = 0;
+    }
+}
+
+void hwc_glaccel_write_json(FILE *f, HWCPtr hwc)
+{
+    hwc_gl_accel *accel = &hwc->glAccel;
+
+    fprintf(f, "{\"ops\":%llu,\"pixels\":%llu,\"us\":%llu}",
+            (unsigned long long) accel->ops,
+            (unsigned long long) accel->pixels,
+            (unsigned long long) accel->time);
+}
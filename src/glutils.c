@@ -2,40 +2,13 @@
 #include "config.h"
 #endif
 
-#include "driver.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-void hwc_ortho_2d(float* mat, float left, float right, float bottom, float top)
-{
-    const float zNear = -1.0f;
-    const float zFar = 1.0f;
-    const float inv_z = 1.0f / (zFar - zNear);
-    const float inv_y = 1.0f / (top - bottom);
-    const float inv_x = 1.0f / (right - left);
-
-    // first column
-    *mat++ = (2.0f*inv_x);
-    *mat++ = (0.0f);
-    *mat++ = (0.0f);
-    *mat++ = (0.0f);
-
-    // second
-    *mat++ = (0.0f);
-    *mat++ = (2.0*inv_y);
-    *mat++ = (0.0f);
-    *mat++ = (0.0f);
-
-    // third
-    *mat++ = (0.0f);
-    *mat++ = (0.0f);
-    *mat++ = (-2.0f*inv_z);
-    *mat++ = (0.0f);
-
-    // fourth
-    *mat++ = (-(right + left)*inv_x);
-    *mat++ = (-(top + bottom)*inv_y);
-    *mat++ = (-(zFar + zNear)*inv_z);
-    *mat++ = (1.0f);
-}
+#include "driver.h"
 
 /* The following code is based on
  * https://github.com/swaywm/wlroots/blob/master/render/gles2/renderer.c */
@@ -53,7 +26,214 @@ static GLuint compile_shader(GLuint type, const GLchar *src) {
 	return shader;
 }
 
-GLuint hwc_link_program(const GLchar *vert_src, const GLchar *frag_src) {
+/*
+ * Linked programs are cached on disk through GL_OES_get_program_binary.
+ * Entries are keyed by a hash of both shader sources and the GL vendor,
+ * renderer and version strings, so a driver update invalidates them. Any
+ * entry that fails validation or is rejected by glProgramBinaryOES is
+ * removed and the program is compiled from source.
+ */
+#define HWC_PROGRAM_CACHE_MAGIC "HWCPROG1"
+#define HWC_PROGRAM_CACHE_MAX_SIZE (16 << 20)
+
+typedef struct {
+	char magic[8];
+	uint64_t key;
+	uint32_t format;
+	uint32_t length;
+	uint64_t checksum;
+} hwc_program_cache_header;
+
+static struct {
+	Bool enabled;
+	int scrnIndex;
+	char *dir;
+	const char *vendor;
+	const char *renderer;
+	const char *version;
+	unsigned long hits;
+	unsigned long misses;
+} program_cache;
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len) {
+	const unsigned char *p = data;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+uint64_t hwc_hash_string(uint64_t h, const char *s) {
+	/* include the terminator so adjacent strings can't alias */
+	return fnv1a(h, s ? s : "", s ? strlen(s) + 1 : 1);
+}
+
+void hwc_program_cache_init(ScrnInfoPtr pScrn, const char *dir) {
+	GLint formats = 0;
+
+	hwc_program_cache_close();
+
+	if (!dir || !epoxy_has_gl_extension("GL_OES_get_program_binary"))
+		return;
+
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &formats);
+	if (formats <= 0)
+		return;
+
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+		xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+				   "shader cache disabled, can't create %s: %s\n", dir, strerror(errno));
+		return;
+	}
+
+	program_cache.dir = strdup(dir);
+	program_cache.vendor = (const char *) glGetString(GL_VENDOR);
+	program_cache.renderer = (const char *) glGetString(GL_RENDERER);
+	program_cache.version = (const char *) glGetString(GL_VERSION);
+	program_cache.scrnIndex = pScrn->scrnIndex;
+	program_cache.enabled = program_cache.dir != NULL;
+
+	if (program_cache.enabled)
+		xf86DrvMsg(pScrn->scrnIndex, X_INFO, "shader cache in %s\n", dir);
+}
+
+void hwc_program_cache_close(void) {
+	if (program_cache.enabled && (program_cache.hits || program_cache.misses)) {
+		xf86DrvMsg(program_cache.scrnIndex, X_INFO,
+				   "shader cache: %lu programs loaded, %lu compiled\n",
+				   program_cache.hits, program_cache.misses);
+	}
+
+	free(program_cache.dir);
+	memset(&program_cache, 0, sizeof(program_cache));
+}
+
+static uint64_t program_cache_key(const GLchar *vert_src, const GLchar *frag_src) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	h = hwc_hash_string(h, vert_src);
+	h = hwc_hash_string(h, frag_src);
+	h = hwc_hash_string(h, program_cache.vendor);
+	h = hwc_hash_string(h, program_cache.renderer);
+	h = hwc_hash_string(h, program_cache.version);
+	return h;
+}
+
+static char *program_cache_path(uint64_t key, const char *suffix) {
+	char *path;
+
+	if (Xasprintf(&path, "%s/%016llx%s", program_cache.dir,
+				  (unsigned long long) key, suffix) < 0)
+		return NULL;
+	return path;
+}
+
+static GLuint program_cache_load(uint64_t key) {
+	hwc_program_cache_header header;
+	char *path = program_cache_path(key, ".bin");
+	void *binary = NULL;
+	GLuint prog = 0;
+	GLint ok = GL_FALSE;
+	int fd;
+
+	if (!path)
+		return 0;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		goto out;
+
+	if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+		memcmp(header.magic, HWC_PROGRAM_CACHE_MAGIC, sizeof(header.magic)) ||
+		header.key != key ||
+		header.length == 0 || header.length > HWC_PROGRAM_CACHE_MAX_SIZE)
+		goto invalid;
+
+	binary = malloc(header.length);
+	if (!binary || read(fd, binary, header.length) != (ssize_t) header.length ||
+		fnv1a(0xcbf29ce484222325ULL, binary, header.length) != header.checksum)
+		goto invalid;
+
+	prog = glCreateProgram();
+	glProgramBinaryOES(prog, header.format, binary, header.length);
+	glGetProgramiv(prog, GL_LINK_STATUS, &ok);
+	if (ok == GL_FALSE) {
+		glDeleteProgram(prog);
+		prog = 0;
+		goto invalid;
+	}
+	goto out;
+
+invalid:
+	xf86DrvMsgVerb(program_cache.scrnIndex, X_INFO, 3,
+				   "discarding stale shader cache entry %s\n", path);
+	unlink(path);
+out:
+	if (fd >= 0)
+		close(fd);
+	free(binary);
+	free(path);
+	return prog;
+}
+
+static void program_cache_store(uint64_t key, GLuint prog) {
+	hwc_program_cache_header header;
+	char *path = NULL, *tmp = NULL;
+	void *binary = NULL;
+	GLint length = 0;
+	GLsizei written = 0;
+	GLenum format;
+	int fd = -1;
+
+	glGetProgramiv(prog, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+	if (length <= 0 || length > HWC_PROGRAM_CACHE_MAX_SIZE)
+		return;
+
+	binary = malloc(length);
+	if (!binary)
+		return;
+
+	glGetProgramBinaryOES(prog, length, &written, &format, binary);
+	if (written <= 0)
+		goto out;
+
+	memcpy(header.magic, HWC_PROGRAM_CACHE_MAGIC, sizeof(header.magic));
+	header.key = key;
+	header.format = format;
+	header.length = written;
+	header.checksum = fnv1a(0xcbf29ce484222325ULL, binary, written);
+
+	path = program_cache_path(key, ".bin");
+	tmp = program_cache_path(key, ".tmp");
+	if (!path || !tmp)
+		goto out;
+
+	/* write to a temporary file and rename, so readers never see half an entry */
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		goto out;
+
+	if (write(fd, &header, sizeof(header)) != sizeof(header) ||
+		write(fd, binary, written) != written) {
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+	close(fd);
+
+	if (rename(tmp, path) < 0)
+		unlink(tmp);
+
+out:
+	free(binary);
+	free(path);
+	free(tmp);
+}
+
+static GLuint link_program(const GLchar *vert_src, const GLchar *frag_src) {
 	GLuint vert = compile_shader(GL_VERTEX_SHADER, vert_src);
 	if (!vert) {
 		return 0;
@@ -84,3 +264,28 @@ GLuint hwc_link_program(const GLchar *vert_src, const GLchar *frag_src) {
 
 	return prog;
 }
+
+GLuint hwc_link_program(const GLchar *vert_src, const GLchar *frag_src) {
+	uint64_t key;
+	GLuint prog;
+
+	if (!program_cache.enabled)
+		return link_program(vert_src, frag_src);
+
+	key = program_cache_key(vert_src, frag_src);
+	prog = program_cache_load(key);
+	if (prog) {
+		xf86DrvMsgVerb(program_cache.scrnIndex, X_INFO, 3,
+					   "loaded shader program %016llx from cache\n",
+					   (unsigned long long) key);
+		program_cache.hits++;
+		return prog;
+	}
+
+	prog = link_program(vert_src, frag_src);
+	if (prog) {
+		program_cache.misses++;
+		program_cache_store(key, prog);
+	}
+	return prog;
+}
@@ -0,0 +1,574 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "xf86.h"
+
+#include <android-config.h>
+#include <sync/sync.h>
+#include <hybris/hwc2/hwc2_compatibility_layer.h>
+
+#include "driver.h"
+
+/*
+ * HWComposer 2 through libhybris' hwc2 compat layer, for vendor stacks
+ * that no longer ship an HWC 1.x module.
+ *
+ * Each display has a single layer. Normally it is client composited, and
+ * the buffer composed by the renderer is the display's client target.
+ * When the external display mirrors the panel, its layer is a device
+ * layer showing the panel's buffer instead.
+ *
+ * validateDisplay only runs when a layer changed (created, moved, after
+ * a power mode change) or when presentDisplay fails with NOT_VALIDATED.
+ * Otherwise a frame is just setClientTarget and presentDisplay. The
+ * present fence releases the client target, and the previous one is
+ * waited for before returning, as hwc_commit does with retire fences.
+ */
+
+/* how long to wait for the primary display to be reported, in ms */
+#define HWC2_PRIMARY_TIMEOUT 5000
+
+typedef struct {
+    /* the compat layer's wrapper, looked up once and owned by us */
+    hwc2_compat_display_t *display;
+    hwc2_compat_layer_t *layer;
+    int64_t id;
+    int width;
+    int height;
+    /* layer state */
+    Bool device;
+    hwc_rect_t crop;
+    hwc_rect_t frame;
+    uint32_t transform;
+    /* changed since the last validateDisplay */
+    Bool changed;
+    /* the device refused to scan out the mirrored buffer */
+    Bool cloneRefused;
+    int lastPresentFence;
+} hwc2_display;
+
+struct hwc_hwc2 {
+    /* first, the callbacks get back here from the listener */
+    HWC2EventListener listener;
+    ScrnInfoPtr pScrn;
+    hwc2_compat_device_t *device;
+    /* from the hotplug callback, -1 until reported */
+    int64_t primaryId;
+    int64_t externalId;
+    Bool externalConnected;
+    /* external hotplug events reported, and applied by the main thread */
+    uint32_t externalEvents;
+    uint32_t externalApplied;
+    /* the external display the compat layer has, -1 for none */
+    int64_t compatExternalId;
+    /* set once closed, the callbacks can't be unregistered */
+    Bool closed;
+    hwc2_display primary;
+    hwc2_display external;
+    uint64_t frames;
+    uint64_t validations;
+};
+
+/*
+ * Called from a HWComposer thread, possibly from within register_callback.
+ * The event is only recorded: passing it to the compat layer creates or
+ * destroys its display, which the server thread may be presenting to, so
+ * that is left to hwc_hwc2_init and hwc2_external_probe.
+ */
+static void hwc2_on_hotplug(HWC2EventListener *listener, int32_t sequenceId,
+                            hwc2_display_t display, bool connected, bool primaryDisplay)
+{
+    struct hwc_hwc2 *hwc2 = (struct hwc_hwc2 *) listener;
+
+    if (__atomic_load_n(&hwc2->closed, __ATOMIC_ACQUIRE))
+        return;
+
+    if (primaryDisplay) {
+        if (connected)
+            __atomic_store_n(&hwc2->primaryId, (int64_t) display, __ATOMIC_RELEASE);
+        return;
+    }
+
+    __atomic_store_n(&hwc2->externalId, (int64_t) display, __ATOMIC_RELAXED);
+    __atomic_store_n(&hwc2->externalConnected, connected, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hwc2->externalEvents, 1, __ATOMIC_RELEASE);
+    hwc_hotplug_signal(HWCPTR(hwc2->pScrn), connected);
+}
+
+/* Called from the HWComposer vsync thread */
+static void hwc2_on_vsync(HWC2EventListener *listener, int32_t sequenceId,
+                          hwc2_display_t display, int64_t timestamp)
+{
+    struct hwc_hwc2 *hwc2 = (struct hwc_hwc2 *) listener;
+
+    if (__atomic_load_n(&hwc2->closed, __ATOMIC_ACQUIRE))
+        return;
+
+    if ((int64_t) display == __atomic_load_n(&hwc2->primaryId, __ATOMIC_ACQUIRE))
+        hwc_latency_vsync(HWCPTR(hwc2->pScrn), timestamp / 1000);
+}
+
+static void hwc2_on_refresh(HWC2EventListener *listener, int32_t sequenceId,
+                            hwc2_display_t display)
+{
+}
+
+/* Sets what changed, so the next frame is validated */
+static void hwc2_layer_set(hwc2_display *disp, Bool device, int width, int height,
+                           const hwc_rect_t *frame, uint32_t transform)
+{
+    hwc2_compat_layer_t *layer = disp->layer;
+    const hwc_rect_t crop = { 0, 0, width, height };
+
+    if (device != disp->device) {
+        hwc2_compat_layer_set_composition_type(layer, device ? HWC2_COMPOSITION_DEVICE :
+                                                               HWC2_COMPOSITION_CLIENT);
+        disp->device = device;
+        disp->changed = TRUE;
+    }
+    if (memcmp(&crop, &disp->crop, sizeof(crop))) {
+        hwc2_compat_layer_set_source_crop(layer, 0.0f, 0.0f, (float) width, (float) height);
+        disp->crop = crop;
+        disp->changed = TRUE;
+    }
+    if (memcmp(frame, &disp->frame, sizeof(*frame))) {
+        hwc2_compat_layer_set_display_frame(layer, frame->left, frame->top,
+                                            frame->right, frame->bottom);
+        hwc2_compat_layer_set_visible_region(layer, frame->left, frame->top,
+                                             frame->right, frame->bottom);
+        disp->frame = *frame;
+        disp->changed = TRUE;
+    }
+    if (transform != disp->transform) {
+        hwc2_compat_layer_set_transform(layer, transform);
+        disp->transform = transform;
+        disp->changed = TRUE;
+    }
+}
+
+/* A client composited layer covering the whole display */
+static Bool hwc2_display_init(hwc2_display *disp, hwc2_compat_display_t *display,
+                              int64_t id, int width, int height)
+{
+    const hwc_rect_t frame = { 0, 0, width, height };
+
+    memset(disp, 0, sizeof(*disp));
+    disp->lastPresentFence = -1;
+    disp->display = display;
+    disp->id = id;
+    disp->width = width;
+    disp->height = height;
+
+    disp->layer = hwc2_compat_display_create_layer(display);
+    if (!disp->layer)
+        return FALSE;
+
+    hwc2_compat_layer_set_composition_type(disp->layer, HWC2_COMPOSITION_CLIENT);
+    hwc2_compat_layer_set_blend_mode(disp->layer, HWC2_BLEND_MODE_NONE);
+    hwc2_compat_layer_set_plane_alpha(disp->layer, 1.0f);
+    hwc2_compat_layer_set_source_crop(disp->layer, 0.0f, 0.0f, (float) width, (float) height);
+    hwc2_compat_layer_set_display_frame(disp->layer, 0, 0, width, height);
+    hwc2_compat_layer_set_visible_region(disp->layer, 0, 0, width, height);
+    hwc2_compat_layer_set_transform(disp->layer, 0);
+    disp->crop = frame;
+    disp->frame = frame;
+    disp->changed = TRUE;
+
+    return TRUE;
+}
+
+/*
+ * Destroy the layer and free the wrapper. Must run before an unplug is
+ * passed to the compat layer, which destroys the display with it.
+ */
+static void hwc2_display_fini(hwc2_display *disp)
+{
+    if (disp->layer)
+        hwc2_compat_display_destroy_layer(disp->display, disp->layer);
+    free(disp->display);
+    if (disp->lastPresentFence >= 0)
+        close(disp->lastPresentFence);
+
+    memset(disp, 0, sizeof(*disp));
+    disp->id = -1;
+    disp->lastPresentFence = -1;
+}
+
+static hwc2_display *hwc2_get_display(HWCPtr hwc, int disp)
+{
+    hwc2_display *display = disp == HWC_DISPLAY_PRIMARY ? &hwc->hwc2->primary :
+                                                          &hwc->hwc2->external;
+
+    return display->layer ? display : NULL;
+}
+
+static Bool hwc2_validate(ScrnInfoPtr pScrn, hwc2_display *disp)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    uint32_t numTypes = 0, numRequests = 0;
+    hwc2_error_t err;
+
+    hwc->hwc2->validations++;
+    err = hwc2_compat_display_validate(disp->display, &numTypes, &numRequests);
+    if (err != HWC2_ERROR_NONE && err != HWC2_ERROR_HAS_CHANGES) {
+        xf86DrvMsgVerb(pScrn->scrnIndex, X_WARNING, 3, "HWC2: validateDisplay failed: %d\n", err);
+        return FALSE;
+    }
+
+    if (numTypes && disp->device) {
+        /* wants the mirrored buffer composed by the client, which has nothing for it */
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                   "HWC2: the external display can't show the panel's buffer, composing it separately\n");
+        disp->cloneRefused = TRUE;
+        return FALSE;
+    }
+
+    if (numTypes || numRequests)
+        hwc2_compat_display_accept_changes(disp->display);
+    disp->changed = FALSE;
+
+    return TRUE;
+}
+
+/*
+ * presentDisplay, validating first only when needed. Returns a copy of
+ * the present fence, or -1.
+ */
+static int hwc2_commit(ScrnInfoPtr pScrn, hwc2_display *disp)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    int32_t presentFence = -1;
+    hwc2_error_t err = HWC2_ERROR_NOT_VALIDATED;
+    int old;
+
+    if (!disp->changed)
+        err = hwc2_compat_display_present(disp->display, &presentFence);
+    if (err == HWC2_ERROR_NOT_VALIDATED) {
+        if (!hwc2_validate(pScrn, disp))
+            return -1;
+        err = hwc2_compat_display_present(disp->display, &presentFence);
+    }
+    if (err != HWC2_ERROR_NONE) {
+        xf86DrvMsgVerb(pScrn->scrnIndex, X_WARNING, 3, "HWC2: presentDisplay failed: %d\n", err);
+        if (presentFence >= 0)
+            close(presentFence);
+        return -1;
+    }
+
+    hwc->hwc2->frames++;
+    if (disp == &hwc->hwc2->primary)
+        hwc_latency_mark_set(hwc, presentFence);
+
+    old = disp->lastPresentFence;
+    disp->lastPresentFence = presentFence;
+    if (old >= 0) {
+        sync_wait(old, -1);
+        close(old);
+    }
+
+    return presentFence >= 0 ? dup(presentFence) : -1;
+}
+
+/* Release fence of the buffer on a device layer */
+static int hwc2_layer_release_fence(hwc2_display *disp)
+{
+    hwc2_compat_out_fences_t *fences = NULL;
+    int fence;
+
+    if (hwc2_compat_display_get_release_fences(disp->display, &fences) != HWC2_ERROR_NONE ||
+        !fences)
+        return -1;
+
+    fence = hwc2_compat_out_fences_get_fence(fences, disp->layer);
+    hwc2_compat_out_fences_destroy(fences);
+    return fence;
+}
+
+static int hwc2_present(ScrnInfoPtr pScrn, struct ANativeWindowBuffer *buffer,
+                        int acquireFenceFd)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    struct hwc_hwc2 *hwc2 = hwc->hwc2;
+    hwc2_display *ext = &hwc2->external;
+    Bool clone = hwc_external_cloned(hwc) && ext->layer;
+    int releaseFenceFd, cloneFenceFd;
+
+    if (clone && ext->cloneRefused) {
+        /* compose it from its own swap chain instead */
+        hwc->external.clone = FALSE;
+        __atomic_store_n(&hwc->external.dirty, TRUE, __ATOMIC_RELEASE);
+        clone = FALSE;
+    }
+
+    if (clone) {
+        hwc_rect_t frame;
+        uint32_t transform = hwc_external_clone_frame(hwc, &frame);
+
+        hwc2_layer_set(ext, TRUE, hwc->hwcWidth, hwc->hwcHeight, &frame, transform);
+        hwc2_compat_layer_set_buffer(ext->layer, 0, buffer,
+                                     acquireFenceFd >= 0 ? dup(acquireFenceFd) : -1);
+    }
+
+    /* takes the acquire fence */
+    hwc2_compat_display_set_client_target(hwc2->primary.display, 0, buffer, acquireFenceFd,
+                                          HAL_DATASPACE_UNKNOWN);
+    releaseFenceFd = hwc2_commit(pScrn, &hwc2->primary);
+
+    if (clone) {
+        cloneFenceFd = hwc2_commit(pScrn, ext);
+        if (cloneFenceFd >= 0) {
+            int layerFenceFd = hwc2_layer_release_fence(ext);
+
+            if (layerFenceFd >= 0) {
+                close(cloneFenceFd);
+                cloneFenceFd = layerFenceFd;
+            }
+        }
+        releaseFenceFd = hwc_merge_fences(releaseFenceFd, cloneFenceFd);
+    }
+
+    return releaseFenceFd;
+}
+
+/* The external display's own swap chain */
+static int hwc2_present_external(ScrnInfoPtr pScrn, struct ANativeWindowBuffer *buffer,
+                                 int acquireFenceFd)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc2_display *ext = &hwc->hwc2->external;
+    hwc_rect_t frame = { 0, 0, ext->width, ext->height };
+
+    if (!ext->layer) {
+        /* unplugged since the frame was composed */
+        if (acquireFenceFd >= 0)
+            close(acquireFenceFd);
+        return -1;
+    }
+
+    hwc2_layer_set(ext, FALSE, ext->width, ext->height, &frame, 0);
+    hwc2_compat_display_set_client_target(ext->display, 0, buffer, acquireFenceFd,
+                                          HAL_DATASPACE_UNKNOWN);
+
+    return hwc2_commit(pScrn, ext);
+}
+
+static void hwc2_set_power_mode(ScrnInfoPtr pScrn, int disp, int mode)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc2_display *display = hwc2_get_display(hwc, disp);
+
+    if (!display)
+        return;
+
+    hwc2_compat_display_set_power_mode(display->display, mode ? HWC2_POWER_MODE_ON :
+                                                                HWC2_POWER_MODE_OFF);
+    display->changed = TRUE;
+}
+
+/* The compat layer only exposes the active config */
+static Bool hwc2_can_set_active_config(ScrnInfoPtr pScrn)
+{
+    return FALSE;
+}
+
+static Bool hwc2_set_active_config(ScrnInfoPtr pScrn, int index)
+{
+    return FALSE;
+}
+
+/* The listener is registered when the device is created */
+static void hwc2_register_procs(ScrnInfoPtr pScrn)
+{
+}
+
+static Bool hwc2_set_vsync_enabled(ScrnInfoPtr pScrn, Bool enabled)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+
+    return hwc2_compat_display_set_vsync_enabled(hwc->hwc2->primary.display,
+                                                 enabled ? HWC2_VSYNC_ENABLE :
+                                                           HWC2_VSYNC_DISABLE) == HWC2_ERROR_NONE;
+}
+
+/*
+ * See hwc1_external_probe. Applies the hotplug events recorded since the
+ * last probe to the compat layer, on the server thread so nothing is
+ * presenting to the display it destroys. Without new events the display
+ * and its layer are kept as they are.
+ */
+static Bool hwc2_external_probe(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    struct hwc_hwc2 *hwc2 = hwc->hwc2;
+    hwc_external_display *ext = &hwc->external;
+    uint32_t events = __atomic_load_n(&hwc2->externalEvents, __ATOMIC_ACQUIRE);
+    int64_t id = __atomic_load_n(&hwc2->externalId, __ATOMIC_RELAXED);
+    Bool plugged = __atomic_load_n(&hwc2->externalConnected, __ATOMIC_RELAXED);
+    hwc2_compat_display_t *display = NULL;
+    HWC2DisplayConfig *config = NULL;
+    Bool wasConnected = ext->connected, connected;
+    int width = ext->width, height = ext->height;
+
+    if (events == hwc2->externalApplied)
+        return FALSE;
+    hwc2->externalApplied = events;
+
+    /* even a reconnect of the same display replaces the compat layer's */
+    hwc2_display_fini(&hwc2->external);
+    ext->connected = FALSE;
+    if (hwc2->compatExternalId >= 0 && hwc2->compatExternalId != id)
+        hwc2_compat_device_on_hotplug(hwc2->device, hwc2->compatExternalId, false);
+    hwc2_compat_device_on_hotplug(hwc2->device, id, plugged);
+    hwc2->compatExternalId = plugged ? id : -1;
+
+    if (plugged && (display = hwc2_compat_device_get_display_by_id(hwc2->device, id)))
+        config = hwc2_compat_display_get_active_config(display);
+    connected = config && config->width > 0 && config->height > 0;
+
+    if (!connected) {
+        free(config);
+        free(display);
+        if (wasConnected)
+            xf86DrvMsg(pScrn->scrnIndex, X_INFO, "external display disconnected\n");
+        return wasConnected;
+    }
+
+    /* the wrapper is kept by hwc2->external from here on */
+    if (!hwc2_display_init(&hwc2->external, display, id, config->width, config->height)) {
+        free(config);
+        hwc2_display_fini(&hwc2->external);
+        return wasConnected;
+    }
+
+    ext->width = config->width;
+    ext->height = config->height;
+    ext->dpi = config->dpiX > 0 ? (int) config->dpiX : 0;
+    ext->refresh = config->vsyncPeriod > 0 ?
+                   (int) ((1000000000 + config->vsyncPeriod / 2) / config->vsyncPeriod) : 60;
+    ext->connected = TRUE;
+    free(config);
+
+    if (wasConnected && ext->width == width && ext->height == height)
+        return FALSE;
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "external display connected: %dx%d@%d\n",
+               ext->width, ext->height, ext->refresh);
+    return TRUE;
+}
+
+static void hwc2_close(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    struct hwc_hwc2 *hwc2 = hwc->hwc2;
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "HWC2: %llu frames presented, %llu validated\n",
+               (unsigned long long) hwc2->frames, (unsigned long long) hwc2->validations);
+
+    hwc2_display_fini(&hwc2->external);
+    hwc2_display_fini(&hwc2->primary);
+
+    /* the device and its listener stay around, the compat layer can't
+       destroy them */
+    __atomic_store_n(&hwc2->closed, TRUE, __ATOMIC_RELEASE);
+    hwc->hwc2 = NULL;
+}
+
+static const hwc_backend_funcs hwc2_backend = {
+    .name = "HWComposer 2",
+    .close = hwc2_close,
+    .set_power_mode = hwc2_set_power_mode,
+    .can_set_active_config = hwc2_can_set_active_config,
+    .set_active_config = hwc2_set_active_config,
+    .register_procs = hwc2_register_procs,
+    .set_vsync_enabled = hwc2_set_vsync_enabled,
+    .external_probe = hwc2_external_probe,
+    .present = hwc2_present,
+    .present_external = hwc2_present_external
+};
+
+/*
+ * Create the HWC2 device and wait for the primary display, which the
+ * device reports through the hotplug callback.
+ */
+Bool hwc_hwc2_init(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    struct hwc_hwc2 *hwc2;
+    hwc2_compat_display_t *display = NULL;
+    HWC2DisplayConfig *config;
+    hwc_display_config *mode = &hwc->configs[0];
+    int64_t id = -1;
+    int i;
+
+    hwc2 = calloc(1, sizeof(*hwc2));
+    if (!hwc2)
+        return FALSE;
+
+    hwc2->listener.on_vsync_received = hwc2_on_vsync;
+    hwc2->listener.on_hotplug_received = hwc2_on_hotplug;
+    hwc2->listener.on_refresh_received = hwc2_on_refresh;
+    hwc2->pScrn = pScrn;
+    hwc2->primaryId = -1;
+    hwc2->externalId = -1;
+    hwc2->compatExternalId = -1;
+    hwc2->primary.id = -1;
+    hwc2->primary.lastPresentFence = -1;
+    hwc2->external.id = -1;
+    hwc2->external.lastPresentFence = -1;
+
+    hwc2->device = hwc2_compat_device_new(false);
+    if (!hwc2->device) {
+        free(hwc2);
+        return FALSE;
+    }
+
+    /* from here on the listener may be called, and hwc2 has to stay */
+    hwc2_compat_device_register_callback(hwc2->device, &hwc2->listener, 0);
+
+    for (i = 0; i < HWC2_PRIMARY_TIMEOUT; i++) {
+        id = __atomic_load_n(&hwc2->primaryId, __ATOMIC_ACQUIRE);
+        if (id >= 0)
+            break;
+        usleep(1000);
+    }
+    if (id >= 0) {
+        /* creates the compat layer's display, see hwc2_on_hotplug */
+        hwc2_compat_device_on_hotplug(hwc2->device, id, true);
+        display = hwc2_compat_device_get_display_by_id(hwc2->device, id);
+    }
+    if (!display) {
+        xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "HWC2: no primary display\n");
+        hwc2->closed = TRUE;
+        return FALSE;
+    }
+
+    config = hwc2_compat_display_get_active_config(display);
+    if (!config || !hwc2_display_init(&hwc2->primary, display, id, config->width, config->height)) {
+        xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "HWC2: failed to set up the primary display\n");
+        if (config)
+            hwc2_display_fini(&hwc2->primary);
+        else
+            free(display);
+        free(config);
+        hwc2->closed = TRUE;
+        return FALSE;
+    }
+
+    mode->width = config->width;
+    mode->height = config->height;
+    mode->dpi = config->dpiX > 0 ? (int) config->dpiX : 0;
+    mode->vsyncPeriod = config->vsyncPeriod > 0 ? config->vsyncPeriod : HWC_DEFAULT_VSYNC_PERIOD;
+    hwc->numConfigs = 1;
+    hwc->activeConfig = 0;
+    free(config);
+
+    hwc->hwc2 = hwc2;
+    hwc->backend = &hwc2_backend;
+    hwc_set_power_mode(pScrn, HWC_DISPLAY_PRIMARY, 1);
+
+    return TRUE;
+}
@@ -12,6 +12,8 @@
 #include <stddef.h>
 #include <malloc.h>
 #include <dlfcn.h>
+#include <unistd.h>
+#include <errno.h>
 
 #include <android-config.h>
 #include <sync/sync.h>
@@ -19,6 +21,8 @@
 
 #include "driver.h"
 
+static const hwc_backend_funcs hwc1_backend;
+
 void *android_dlopen(const char *filename, int flags);
 void *android_dlsym(void *handle, const char *symbol);
 int android_dlclose(void *handle);
@@ -37,7 +41,7 @@ inline static uint32_t interpreted_version(hw_device_t *hwc_device)
 	return version;
 }
 
-void hwc_set_power_mode(ScrnInfoPtr pScrn, int disp, int mode)
+static void hwc1_set_power_mode(ScrnInfoPtr pScrn, int disp, int mode)
 {
 	HWCPtr hwc = HWCPTR(pScrn);
     
@@ -59,6 +63,66 @@ void hwc_set_power_mode(ScrnInfoPtr pScrn, int disp, int mode)
 		hwcDevicePtr->blank(hwcDevicePtr, disp, (mode) ? 0 : 1);
 }
 
+/* Only HWC 1.4 and later can switch configs at runtime */
+static Bool hwc1_can_set_active_config(ScrnInfoPtr pScrn)
+{
+#ifdef HWC_DEVICE_API_VERSION_1_4
+	HWCPtr hwc = HWCPTR(pScrn);
+
+	return hwc->hwcVersion >= HWC_DEVICE_API_VERSION_1_4 &&
+		   hwc->hwcDevicePtr->setActiveConfig != NULL;
+#else
+	return FALSE;
+#endif
+}
+
+static Bool hwc1_set_active_config(ScrnInfoPtr pScrn, int index)
+{
+#ifdef HWC_DEVICE_API_VERSION_1_4
+	HWCPtr hwc = HWCPTR(pScrn);
+	hwc_composer_device_1_t *hwcDevicePtr = hwc->hwcDevicePtr;
+
+	if (hwc1_can_set_active_config(pScrn) &&
+		hwcDevicePtr->setActiveConfig(hwcDevicePtr, HWC_DISPLAY_PRIMARY, index) == 0)
+		return TRUE;
+#endif
+
+	return FALSE;
+}
+
+void hwc_set_power_mode(ScrnInfoPtr pScrn, int disp, int mode)
+{
+	HWCPtr hwc = HWCPTR(pScrn);
+
+	hwc->backend->set_power_mode(pScrn, disp, mode);
+}
+
+Bool hwc_can_set_active_config(ScrnInfoPtr pScrn)
+{
+	HWCPtr hwc = HWCPTR(pScrn);
+
+	return hwc->backend->can_set_active_config(pScrn);
+}
+
+/*
+ * Switch the panel to another of its configs, by index into
+ * HWCRec.configs.
+ */
+Bool hwc_set_active_config(ScrnInfoPtr pScrn, int index)
+{
+	HWCPtr hwc = HWCPTR(pScrn);
+
+	if (index == hwc->activeConfig)
+		return TRUE;
+
+	if (!hwc->backend->set_active_config(pScrn, index))
+		return FALSE;
+
+	hwc->activeConfig = index;
+	hwc_refresh_update_interval(pScrn);
+	return TRUE;
+}
+
 void hwc_start_fake_surfaceflinger(ScrnInfoPtr pScrn) {
 	HWCPtr hwc = HWCPTR(pScrn);
 	void (*startMiniSurfaceFlinger)(void) = NULL;
@@ -82,66 +146,33 @@ void hwc_start_fake_surfaceflinger(ScrnInfoPtr pScrn) {
 	}
 }
 
-Bool hwc_hwcomposer_init(ScrnInfoPtr pScrn)
+static void *hwc_fake_surfaceflinger_thread(void *data)
 {
+	ScrnInfoPtr pScrn = (ScrnInfoPtr)data;
 	HWCPtr hwc = HWCPTR(pScrn);
-	int err;
-
-	hw_module_t const* module = NULL;
-	err = hw_get_module(GRALLOC_HARDWARE_MODULE_ID, &module);
-	assert(err == 0);
-
-	hwc->gralloc = (gralloc_module_t*) module;
-	err = gralloc_open((const hw_module_t *) hwc->gralloc, &hwc->alloc);
-
-	framebuffer_device_t* fbDev = NULL;
-	framebuffer_open(module, &fbDev);
+	int phase = hwc_startup_phase_begin(hwc, "minisf");
 
 	hwc_start_fake_surfaceflinger(pScrn);
+	hwc_startup_phase_end(hwc, phase);
+	return NULL;
+}
 
-	hw_module_t *hwcModule = 0;
-
-	err = hw_get_module(HWC_HARDWARE_MODULE_ID, (const hw_module_t **) &hwcModule);
-	assert(err == 0);
-
-	hwc_composer_device_1_t *hwcDevicePtr = 0;
-	err = hwc_open_1(hwcModule, &hwcDevicePtr);
-	assert(err == 0);
-
-	hwc->hwcDevicePtr = hwcDevicePtr;
-	hw_device_t *hwcDevice = &hwcDevicePtr->common;
-
-	hwc_set_power_mode(pScrn, HWC_DISPLAY_PRIMARY, 1);	uint32_t hwc_version = hwc->hwcVersion = interpreted_version(hwcDevice);
-
-	uint32_t configs[5];
-	size_t numConfigs = 5;
-
-	err = hwcDevicePtr->getDisplayConfigs(hwcDevicePtr, HWC_DISPLAY_PRIMARY, configs, &numConfigs);
-	assert (err == 0);
-
-	int32_t attr_values[2];
-	uint32_t attributes[] = { HWC_DISPLAY_WIDTH, HWC_DISPLAY_HEIGHT, HWC_DISPLAY_NO_ATTRIBUTE };
-
-	hwcDevicePtr->getDisplayAttributes(hwcDevicePtr, HWC_DISPLAY_PRIMARY,
-			configs[0], attributes, attr_values);
-
-	xf86DrvMsg(pScrn->scrnIndex, X_INFO, "width: %i height: %i\n", attr_values[0], attr_values[1]);
-	hwc->hwcWidth = attr_values[0];
-	hwc->hwcHeight = attr_values[1];
-
+/*
+ * Layer list for one display: a HWC_FRAMEBUFFER layer standing for the
+ * root and the HWC_FRAMEBUFFER_TARGET it is composed into.
+ */
+static hwc_display_contents_1_t *hwc_create_contents(int width, int height,
+													 hwc_layer_1_t **fblayer)
+{
+	hwc_layer_1_t *layer;
 	size_t size = sizeof(hwc_display_contents_1_t) + 2 * sizeof(hwc_layer_1_t);
 	hwc_display_contents_1_t *list = (hwc_display_contents_1_t *) malloc(size);
-	hwc->hwcContents = (hwc_display_contents_1_t **) malloc(HWC_NUM_DISPLAY_TYPES * sizeof(hwc_display_contents_1_t *));
-	const hwc_rect_t r = { 0, 0, attr_values[0], attr_values[1] };
+	const hwc_rect_t r = { 0, 0, width, height };
 
-	int counter = 0;
-	for (; counter < HWC_NUM_DISPLAY_TYPES; counter++)
-		hwc->hwcContents[counter] = NULL;
-	// Assign the layer list only to the first display,
-	// otherwise HWC might freeze if others are disconnected
-	hwc->hwcContents[0] = list;
+	if (!list)
+		return NULL;
 
-	hwc_layer_1_t *layer = &list->hwLayers[0];
+	layer = &list->hwLayers[0];
 	memset(layer, 0, sizeof(hwc_layer_1_t));
 	layer->compositionType = HWC_FRAMEBUFFER;
 	layer->hints = 0;
@@ -152,8 +183,8 @@ Bool hwc_hwcomposer_init(ScrnInfoPtr pScrn)
 #ifdef HWC_DEVICE_API_VERSION_1_3
 	layer->sourceCropf.top = 0.0f;
 	layer->sourceCropf.left = 0.0f;
-	layer->sourceCropf.bottom = (float) attr_values[1];
-	layer->sourceCropf.right = (float) attr_values[0];
+	layer->sourceCropf.bottom = (float) height;
+	layer->sourceCropf.right = (float) width;
 #else
 	layer->sourceCrop = r;
 #endif
@@ -175,7 +206,7 @@ Bool hwc_hwcomposer_init(ScrnInfoPtr pScrn)
 	layer->surfaceDamage.numRects = 0;
 #endif
 
-	hwc->fblayer = layer = &list->hwLayers[1];
+	*fblayer = layer = &list->hwLayers[1];
 	memset(layer, 0, sizeof(hwc_layer_1_t));
 	layer->compositionType = HWC_FRAMEBUFFER_TARGET;
 	layer->hints = 0;
@@ -186,8 +217,8 @@ Bool hwc_hwcomposer_init(ScrnInfoPtr pScrn)
 #ifdef HWC_DEVICE_API_VERSION_1_3
 	layer->sourceCropf.top = 0.0f;
 	layer->sourceCropf.left = 0.0f;
-	layer->sourceCropf.bottom = (float) attr_values[1];
-	layer->sourceCropf.right = (float) attr_values[0];
+	layer->sourceCropf.bottom = (float) height;
+	layer->sourceCropf.right = (float) width;
 #else
 	layer->sourceCrop = r;
 #endif
@@ -207,42 +238,636 @@ Bool hwc_hwcomposer_init(ScrnInfoPtr pScrn)
 	list->flags = HWC_GEOMETRY_CHANGED;
 	list->numHwLayers = 2;
 
+	return list;
+}
+
+static void hwc_destroy_contents(hwc_display_contents_1_t *list)
+{
+	if (list && list->retireFenceFd != -1)
+		close(list->retireFenceFd);
+	free(list);
+}
+
+/*
+ * Query HWC_DISPLAY_EXTERNAL, at startup and after each hotplug event.
+ * getDisplayConfigs fails while nothing is connected. The layer list is
+ * (re)created for the size of the display. Returns TRUE if the display
+ * was connected, disconnected or changed size.
+ */
+static Bool hwc1_external_probe(ScrnInfoPtr pScrn)
+{
+	HWCPtr hwc = HWCPTR(pScrn);
+	hwc_external_display *ext = &hwc->external;
+	hwc_composer_device_1_t *hwcDevicePtr = hwc->hwcDevicePtr;
+	uint32_t configs[5];
+	size_t numConfigs = 5;
+	int32_t values[4] = { 0, 0, 0, 0 };
+	uint32_t attributes[] = { HWC_DISPLAY_WIDTH, HWC_DISPLAY_HEIGHT, HWC_DISPLAY_DPI_X,
+							  HWC_DISPLAY_VSYNC_PERIOD, HWC_DISPLAY_NO_ATTRIBUTE };
+	Bool connected;
+
+	connected = __atomic_load_n(&ext->hotplugState, __ATOMIC_ACQUIRE) != 0 &&
+				hwcDevicePtr->getDisplayConfigs(hwcDevicePtr, HWC_DISPLAY_EXTERNAL,
+												configs, &numConfigs) == 0 &&
+				numConfigs > 0 &&
+				hwcDevicePtr->getDisplayAttributes(hwcDevicePtr, HWC_DISPLAY_EXTERNAL,
+												   configs[0], attributes, values) == 0 &&
+				values[0] > 0 && values[1] > 0;
+
+	if (connected == ext->connected &&
+		(!connected || (values[0] == ext->width && values[1] == ext->height)))
+		return FALSE;
+
+	hwc_destroy_contents(ext->list);
+	ext->list = NULL;
+	ext->fblayer = NULL;
+	ext->connected = FALSE;
+
+	if (!connected) {
+		xf86DrvMsg(pScrn->scrnIndex, X_INFO, "external display disconnected\n");
+		return TRUE;
+	}
+
+	ext->list = hwc_create_contents(values[0], values[1], &ext->fblayer);
+	if (!ext->list)
+		return TRUE;
+
+	ext->width = values[0];
+	ext->height = values[1];
+	ext->dpi = values[2] > 0 ? values[2] / 1000 : 0;
+	/* vsync period in ns */
+	ext->refresh = values[3] > 0 ? (1000000000 + values[3] / 2) / values[3] : 60;
+	ext->connected = TRUE;
+
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO, "external display connected: %dx%d@%d\n",
+			   ext->width, ext->height, ext->refresh);
+	return TRUE;
+}
+
+/*
+ * Query the panel's configs and set up its layer list, once the HWC 1.x
+ * device is open.
+ */
+static Bool hwc1_init(ScrnInfoPtr pScrn, hwc_composer_device_1_t *hwcDevicePtr)
+{
+	HWCPtr hwc = HWCPTR(pScrn);
+	int err;
+
+	hwc->hwcDevicePtr = hwcDevicePtr;
+	hwc->backend = &hwc1_backend;
+	hw_device_t *hwcDevice = &hwcDevicePtr->common;
+
+	hwc_set_power_mode(pScrn, HWC_DISPLAY_PRIMARY, 1);	uint32_t hwc_version = hwc->hwcVersion = interpreted_version(hwcDevice);
+
+	uint32_t configs[HWC_MAX_CONFIGS];
+	size_t numConfigs = HWC_MAX_CONFIGS;
+
+	err = hwcDevicePtr->getDisplayConfigs(hwcDevicePtr, HWC_DISPLAY_PRIMARY, configs, &numConfigs);
+	assert (err == 0 && numConfigs > 0);
+	hwc->numConfigs = min(numConfigs, HWC_MAX_CONFIGS);
+
+	int32_t attr_values[4];
+	uint32_t attributes[] = { HWC_DISPLAY_WIDTH, HWC_DISPLAY_HEIGHT, HWC_DISPLAY_DPI_X,
+							  HWC_DISPLAY_VSYNC_PERIOD, HWC_DISPLAY_NO_ATTRIBUTE };
+	int i;
+
+	for (i = 0; i < hwc->numConfigs; i++) {
+		hwc_display_config *config = &hwc->configs[i];
+
+		attr_values[3] = 0;
+		hwcDevicePtr->getDisplayAttributes(hwcDevicePtr, HWC_DISPLAY_PRIMARY,
+				configs[i], attributes, attr_values);
+
+		config->width = attr_values[0];
+		config->height = attr_values[1];
+		/* reported in dots per thousand inches, 0 if unknown */
+		config->dpi = attr_values[2] > 0 ? attr_values[2] / 1000 : 0;
+		config->vsyncPeriod = attr_values[3] > 0 ? attr_values[3] : HWC_DEFAULT_VSYNC_PERIOD;
+	}
+
+	hwc->activeConfig = 0;
+#ifdef HWC_DEVICE_API_VERSION_1_4
+	if (hwc_version >= HWC_DEVICE_API_VERSION_1_4 && hwcDevicePtr->getActiveConfig) {
+		int active = hwcDevicePtr->getActiveConfig(hwcDevicePtr, HWC_DISPLAY_PRIMARY);
+
+		if (active >= 0 && active < hwc->numConfigs)
+			hwc->activeConfig = active;
+	}
+#endif
+
+	hwc->hwcContents = (hwc_display_contents_1_t **) malloc(HWC_NUM_DISPLAY_TYPES * sizeof(hwc_display_contents_1_t *));
+
+	int counter = 0;
+	for (; counter < HWC_NUM_DISPLAY_TYPES; counter++)
+		hwc->hwcContents[counter] = NULL;
+	// Assign the layer list only to the first display,
+	// otherwise HWC might freeze if others are disconnected.
+	// The external display has its own, see hwc1_external_probe
+	hwc->hwcContents[0] = hwc_create_contents(hwc->configs[hwc->activeConfig].width,
+											  hwc->configs[hwc->activeConfig].height,
+											  &hwc->fblayer);
+	assert(hwc->hwcContents[0] != NULL);
+
+	return TRUE;
+}
+
+static void hwc1_close(ScrnInfoPtr pScrn)
+{
+	HWCPtr hwc = HWCPTR(pScrn);
+
+	if (hwc->hwcContents) {
+		hwc_destroy_contents(hwc->hwcContents[0]);
+		free(hwc->hwcContents);
+		hwc->hwcContents = NULL;
+		hwc->fblayer = NULL;
+	}
+	hwc_destroy_contents(hwc->external.list);
+	hwc->external.list = NULL;
+	hwc->external.fblayer = NULL;
+
+#ifdef ENABLE_MOCK_HAL
+	if (hwc->mockHal) {
+		/* the mock lights device belongs to the mock hwcomposer */
+		hwc->lightsDevice = NULL;
+		hwc_mock_hal_close(pScrn);
+		hwc->hwcDevicePtr = NULL;
+		return;
+	}
+#endif
+
+	hwc_close_1(hwc->hwcDevicePtr);
+	hwc->hwcDevicePtr = NULL;
+}
+
+/*
+ * Open the HWC 1.x device, unless Option "HWComposerAPI" asks for HWC2.
+ * Leaves *device NULL when there is no HWC 1.x module, or when the
+ * module turns out to implement HWC2, which needs the compat layer.
+ */
+static void hwc1_open(ScrnInfoPtr pScrn, hwc_composer_device_1_t **device)
+{
+	HWCPtr hwc = HWCPTR(pScrn);
+	hw_module_t *hwcModule = 0;
+	hwc_composer_device_1_t *hwcDevicePtr = NULL;
+
+	*device = NULL;
+	if (hwc->hwcApi == HWC_API_2)
+		return;
+
+	if (hw_get_module(HWC_HARDWARE_MODULE_ID, (const hw_module_t **) &hwcModule) != 0 ||
+		hwc_open_1(hwcModule, &hwcDevicePtr) != 0 || !hwcDevicePtr) {
+		xf86DrvMsg(pScrn->scrnIndex, X_INFO, "no HWComposer 1.x module\n");
+		return;
+	}
+
+	if (interpreted_version(&hwcDevicePtr->common) >= HARDWARE_DEVICE_API_VERSION(2, 0)) {
+		xf86DrvMsg(pScrn->scrnIndex, X_INFO, "HWComposer module implements HWC2\n");
+		hwc_close_1(hwcDevicePtr);
+		return;
+	}
+
+	*device = hwcDevicePtr;
+}
+
+Bool hwc_hwcomposer_init(ScrnInfoPtr pScrn)
+{
+	HWCPtr hwc = HWCPTR(pScrn);
+	hwc_composer_device_1_t *hwcDevicePtr = 0;
+	int phase, i;
+
+	/* HWC2 reports the displays from within device creation */
+	hwc->external.hotplugState = -1;
+	hwc->backend = NULL;
+
+#ifdef ENABLE_MOCK_HAL
+	if (hwc->mockHal) {
+		hwcDevicePtr = hwc_mock_hal_open(pScrn, hwc->mockHalMode);
+		if (!hwcDevicePtr)
+			return FALSE;
+	} else
+#endif
+	{
+		hwc_startup_task minisf;
+		int err;
+
+		/* The binder thread pool only has to be up before the HWC
+		   module is opened, so start it while gralloc loads */
+		hwc_startup_run(hwc, &minisf, hwc_fake_surfaceflinger_thread, pScrn);
+
+		phase = hwc_startup_phase_begin(hwc, "gralloc");
+		hw_module_t const* module = NULL;
+		err = hw_get_module(GRALLOC_HARDWARE_MODULE_ID, &module);
+		assert(err == 0);
+
+		hwc->gralloc = (gralloc_module_t*) module;
+		err = gralloc_open((const hw_module_t *) hwc->gralloc, &hwc->alloc);
+
+		framebuffer_device_t* fbDev = NULL;
+		framebuffer_open(module, &fbDev);
+		hwc_startup_phase_end(hwc, phase);
+
+		hwc_startup_join(&minisf);
+
+		phase = hwc_startup_phase_begin(hwc, "hwc open");
+		hwc1_open(pScrn, &hwcDevicePtr);
+		hwc_startup_phase_end(hwc, phase);
+	}
+
+	phase = hwc_startup_phase_begin(hwc, "hwc configure");
+	if (hwcDevicePtr) {
+		hwc1_init(pScrn, hwcDevicePtr);
+	}
+#ifdef ENABLE_HWC2
+	else if (hwc->hwcApi != HWC_API_1 && !hwc_hwc2_init(pScrn)) {
+		xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "failed to open HWComposer 2\n");
+	}
+#endif
+	if (!hwc->backend) {
+		hwc_startup_phase_end(hwc, phase);
+		xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "no usable HWComposer device\n");
+		return FALSE;
+	}
+
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO, "using %s\n", hwc->backend->name);
+	for (i = 0; i < hwc->numConfigs; i++) {
+		hwc_display_config *config = &hwc->configs[i];
+
+		xf86DrvMsg(pScrn->scrnIndex, X_INFO, "config %d: %dx%d@%.2f Hz, %d dpi\n", i,
+				   config->width, config->height, 1e9 / config->vsyncPeriod, config->dpi);
+	}
+	hwc->modeConfig = hwc->activeConfig;
+
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO, "width: %i height: %i\n",
+			   hwc->configs[hwc->activeConfig].width, hwc->configs[hwc->activeConfig].height);
+	hwc->hwcWidth = hwc->configs[hwc->activeConfig].width;
+	hwc->hwcHeight = hwc->configs[hwc->activeConfig].height;
+	hwc->hwcDpi = hwc->configs[hwc->activeConfig].dpi;
+	hwc_refresh_update_interval(pScrn);
+
+	hwc_external_probe(pScrn);
+	hwc_startup_phase_end(hwc, phase);
+
 	return TRUE;
 }
 
+/*
+ * Counterpart of hwc_hwcomposer_init and hwc_lights_init, called from
+ * FreeScreen once the renderer no longer uses the device.
+ */
 void hwc_hwcomposer_close(ScrnInfoPtr pScrn)
+{
+	HWCPtr hwc = HWCPTR(pScrn);
+
+	hwc->external.connected = FALSE;
+
+	if (!hwc->backend)
+		return;
+
+	hwc_set_vsync_enabled(pScrn, FALSE);
+	hwc->backend->close(pScrn);
+	hwc->backend = NULL;
+
+	if (hwc->lightsDevice) {
+		hwc->lightsDevice->common.close(&hwc->lightsDevice->common);
+		hwc->lightsDevice = NULL;
+	}
+
+	if (hwc->alloc) {
+		gralloc_close(hwc->alloc);
+		hwc->alloc = NULL;
+	}
+}
+
+static void hwc_procs_invalidate(const struct hwc_procs *procs)
 {
 }
 
-static void present(void *user_data, struct ANativeWindow *window,
-								struct ANativeWindowBuffer *buffer)
+/* Called from the HWComposer vsync thread */
+static void hwc_procs_vsync(const struct hwc_procs *procs, int disp, int64_t timestamp)
+{
+	hwc_procs_ctx *ctx = (hwc_procs_ctx *)procs;
+
+	if (disp == HWC_DISPLAY_PRIMARY)
+		hwc_latency_vsync(HWCPTR(ctx->pScrn), timestamp / 1000);
+}
+
+/*
+ * Called from a HWComposer thread, possibly from within registerProcs.
+ * The main thread queries the display and updates RandR once it sees the
+ * eventfd, see hwc_hotplug_init.
+ */
+void hwc_hotplug_signal(HWCPtr hwc, int connected)
+{
+	uint64_t one = 1;
+	int fd;
+
+	__atomic_store_n(&hwc->external.hotplugState, connected, __ATOMIC_RELEASE);
+
+	fd = __atomic_load_n(&hwc->hotplugFd, __ATOMIC_ACQUIRE);
+	if (fd >= 0 && write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		ErrorF("hwcomposer: failed to signal hotplug: %d\n", errno);
+}
+
+static void hwc_procs_hotplug(const struct hwc_procs *procs, int disp, int connected)
+{
+	hwc_procs_ctx *ctx = (hwc_procs_ctx *)procs;
+
+	if (disp == HWC_DISPLAY_EXTERNAL)
+		hwc_hotplug_signal(HWCPTR(ctx->pScrn), connected);
+}
+
+/* HWComposer keeps the procs pointer, so they live in HWCRec and are
+   registered only once per device */
+static void hwc1_register_procs(ScrnInfoPtr pScrn)
 {
-	ScrnInfoPtr pScrn = (ScrnInfoPtr)user_data;
 	HWCPtr hwc = HWCPTR(pScrn);
+	hwc_composer_device_1_t *hwcDevicePtr = hwc->hwcDevicePtr;
+	hwc_procs_ctx *ctx = &hwc->hwcProcs;
 
-	hwc_display_contents_1_t **contents = hwc->hwcContents;
-	hwc_layer_1_t *fblayer = hwc->fblayer;
-	hwc_composer_device_1_t *hwcdevice = hwc->hwcDevicePtr;
+	if (ctx->registered || !hwcDevicePtr->registerProcs)
+		return;
 
-	int oldretire = contents[0]->retireFenceFd;
-	contents[0]->retireFenceFd = -1;
+	ctx->procs.invalidate = hwc_procs_invalidate;
+	ctx->procs.vsync = hwc_procs_vsync;
+	ctx->procs.hotplug = hwc_procs_hotplug;
+	ctx->pScrn = pScrn;
+
+	hwcDevicePtr->registerProcs(hwcDevicePtr, &ctx->procs);
+	ctx->registered = TRUE;
+}
+
+static Bool hwc1_set_vsync_enabled(ScrnInfoPtr pScrn, Bool enabled)
+{
+	HWCPtr hwc = HWCPTR(pScrn);
+	hwc_composer_device_1_t *hwcDevicePtr = hwc->hwcDevicePtr;
+
+	return hwcDevicePtr->eventControl &&
+		   hwcDevicePtr->eventControl(hwcDevicePtr, HWC_DISPLAY_PRIMARY,
+									  HWC_EVENT_VSYNC, enabled) == 0;
+}
+
+void hwc_register_procs(ScrnInfoPtr pScrn)
+{
+	HWCPtr hwc = HWCPTR(pScrn);
+
+	hwc->backend->register_procs(pScrn);
+}
+
+void hwc_set_vsync_enabled(ScrnInfoPtr pScrn, Bool enabled)
+{
+	HWCPtr hwc = HWCPTR(pScrn);
+
+	if (hwc->vsyncEnabled == enabled)
+		return;
+
+	if (hwc->backend->set_vsync_enabled(pScrn, enabled))
+		hwc->vsyncEnabled = enabled;
+	else
+		xf86DrvMsg(pScrn->scrnIndex, X_WARNING, "failed to %s vsync events\n",
+				   enabled ? "enable" : "disable");
+}
+
+Bool hwc_external_probe(ScrnInfoPtr pScrn)
+{
+	HWCPtr hwc = HWCPTR(pScrn);
+
+	return hwc->backend->external_probe(pScrn);
+}
+
+/*
+ * prepare/set for the displays with a list in contents. The others are
+ * NULL, which HWComposer skips, as it does for displays SurfaceFlinger
+ * has nothing for. This lets every display present from its own swap
+ * chain.
+ */
+static void hwc_commit(HWCPtr hwc, hwc_display_contents_1_t **contents)
+{
+	hwc_composer_device_1_t *hwcdevice = hwc->hwcDevicePtr;
+	int oldretire[HWC_NUM_DISPLAY_TYPES];
+	int i;
+
+	for (i = 0; i < HWC_NUM_DISPLAY_TYPES; i++) {
+		oldretire[i] = -1;
+		if (contents[i]) {
+			oldretire[i] = contents[i]->retireFenceFd;
+			contents[i]->retireFenceFd = -1;
+		}
+	}
 
-	fblayer->handle = buffer->handle;
-	fblayer->acquireFenceFd = HWCNativeBufferGetFence(buffer);
-	fblayer->releaseFenceFd = -1;
 	int err = hwcdevice->prepare(hwcdevice, HWC_NUM_DISPLAY_TYPES, contents);
 	assert(err == 0);
 
 	err = hwcdevice->set(hwcdevice, HWC_NUM_DISPLAY_TYPES, contents);
 	/* in Android, SurfaceFlinger ignores the return value as not all
 		display types may be supported */
-	HWCNativeBufferSetFence(buffer, fblayer->releaseFenceFd);
+	/* only the panel's frames are measured, see hwc1_present_external */
+	if (contents[HWC_DISPLAY_PRIMARY])
+		hwc_latency_mark_set(hwc, contents[HWC_DISPLAY_PRIMARY]->retireFenceFd);
+
+	for (i = 0; i < HWC_NUM_DISPLAY_TYPES; i++) {
+		if (oldretire[i] != -1)
+		{
+			sync_wait(oldretire[i], -1);
+			close(oldretire[i]);
+		}
+	}
+}
 
-	if (oldretire != -1)
-	{
-		sync_wait(oldretire, -1);
-		close(oldretire);
+static void hwc_layer_set_frame(hwc_layer_1_t *layer, int width, int height,
+								const hwc_rect_t *frame)
+{
+#ifdef HWC_DEVICE_API_VERSION_1_3
+	layer->sourceCropf.top = 0.0f;
+	layer->sourceCropf.left = 0.0f;
+	layer->sourceCropf.bottom = (float) height;
+	layer->sourceCropf.right = (float) width;
+#else
+	layer->sourceCrop.left = 0;
+	layer->sourceCrop.top = 0;
+	layer->sourceCrop.right = width;
+	layer->sourceCrop.bottom = height;
+#endif
+	layer->displayFrame = *frame;
+}
+
+/*
+ * Where the panel's framebuffer target goes on the external display when
+ * mirrored: scaled to fit with the aspect ratio kept, and turned back
+ * upright if the panel is rotated. Returns the HWC_TRANSFORM_* for that,
+ * which HWC2 shares.
+ */
+uint32_t hwc_external_clone_frame(HWCPtr hwc, hwc_rect_t *out)
+{
+	static const uint32_t transforms[] = {
+		[HWC_ROTATE_NORMAL] = 0,
+		[HWC_ROTATE_CW] = HWC_TRANSFORM_ROT_270,
+		[HWC_ROTATE_UD] = HWC_TRANSFORM_ROT_180,
+		[HWC_ROTATE_CCW] = HWC_TRANSFORM_ROT_90
+	};
+	hwc_external_display *ext = &hwc->external;
+	int width = hwc->hwcWidth, height = hwc->hwcHeight;
+	hwc_rect_t frame;
+
+	if (hwc->rotation == HWC_ROTATE_CW || hwc->rotation == HWC_ROTATE_CCW) {
+		width = hwc->hwcHeight;
+		height = hwc->hwcWidth;
+	}
+
+	if ((int64_t) ext->width * height <= (int64_t) ext->height * width) {
+		frame.right = ext->width;
+		frame.bottom = (int64_t) ext->width * height / width;
+	} else {
+		frame.right = (int64_t) ext->height * width / height;
+		frame.bottom = ext->height;
+	}
+	frame.left = (ext->width - frame.right) / 2;
+	frame.top = (ext->height - frame.bottom) / 2;
+	frame.right += frame.left;
+	frame.bottom += frame.top;
+
+	*out = frame;
+	return transforms[hwc->rotation];
+}
+
+/* Show the panel's framebuffer target on the external display too */
+static void hwc_external_clone_target(HWCPtr hwc, buffer_handle_t handle, int acquireFenceFd)
+{
+	hwc_layer_1_t *layer = hwc->external.fblayer;
+	hwc_rect_t frame;
+
+	layer->transform = hwc_external_clone_frame(hwc, &frame);
+	hwc_layer_set_frame(layer, hwc->hwcWidth, hwc->hwcHeight, &frame);
+	layer->handle = handle;
+	layer->acquireFenceFd = acquireFenceFd >= 0 ? dup(acquireFenceFd) : -1;
+	layer->releaseFenceFd = -1;
+}
+
+/* One release fence for a buffer shown on two displays */
+int hwc_merge_fences(int a, int b)
+{
+	int merged;
+
+	if (a < 0)
+		return b;
+	if (b < 0)
+		return a;
+
+	merged = sync_merge("hwc clone", a, b);
+	if (merged < 0) {
+		/* wait for one, so the other covers both */
+		sync_wait(b, -1);
+		close(b);
+		return a;
 	}
+
+	close(a);
+	close(b);
+	return merged;
+}
+
+/*
+ * Hand a composed framebuffer target to HWComposer. When the external
+ * display mirrors the panel it gets the same buffer. Returns the release
+ * fence for the buffer, or -1.
+ */
+int hwc_present_layers(ScrnInfoPtr pScrn, buffer_handle_t handle, int acquireFenceFd)
+{
+	HWCPtr hwc = HWCPTR(pScrn);
+
+	hwc_display_contents_1_t *contents[HWC_NUM_DISPLAY_TYPES] = { NULL };
+	hwc_layer_1_t *fblayer = hwc->fblayer;
+	int releaseFenceFd;
+
+	contents[HWC_DISPLAY_PRIMARY] = hwc->hwcContents[HWC_DISPLAY_PRIMARY];
+
+	fblayer->handle = handle;
+	fblayer->acquireFenceFd = acquireFenceFd;
+	fblayer->releaseFenceFd = -1;
+
+	if (hwc_external_cloned(hwc)) {
+		hwc_external_clone_target(hwc, handle, acquireFenceFd);
+		contents[HWC_DISPLAY_EXTERNAL] = hwc->external.list;
+	}
+
+	hwc_commit(hwc, contents);
+
+	releaseFenceFd = fblayer->releaseFenceFd;
+	if (contents[HWC_DISPLAY_EXTERNAL])
+		releaseFenceFd = hwc_merge_fences(releaseFenceFd,
+										  hwc->external.fblayer->releaseFenceFd);
+	return releaseFenceFd;
+}
+
+static int hwc1_present(ScrnInfoPtr pScrn, struct ANativeWindowBuffer *buffer,
+						int acquireFenceFd)
+{
+	return hwc_present_layers(pScrn, buffer->handle, acquireFenceFd);
+}
+
+/* The external display's own swap chain */
+static int hwc1_present_external(ScrnInfoPtr pScrn, struct ANativeWindowBuffer *buffer,
+								 int acquireFenceFd)
+{
+	HWCPtr hwc = HWCPTR(pScrn);
+	hwc_external_display *ext = &hwc->external;
+	hwc_display_contents_1_t *contents[HWC_NUM_DISPLAY_TYPES] = { NULL };
+	hwc_layer_1_t *fblayer = ext->fblayer;
+	const hwc_rect_t frame = { 0, 0, ext->width, ext->height };
+
+	if (!ext->list) {
+		/* unplugged since the frame was composed */
+		if (acquireFenceFd >= 0)
+			close(acquireFenceFd);
+		return -1;
+	}
+
+	hwc_layer_set_frame(fblayer, ext->width, ext->height, &frame);
+	fblayer->transform = 0;
+	fblayer->handle = buffer->handle;
+	fblayer->acquireFenceFd = acquireFenceFd;
+	fblayer->releaseFenceFd = -1;
+
+	contents[HWC_DISPLAY_EXTERNAL] = ext->list;
+	hwc_commit(hwc, contents);
+
+	return fblayer->releaseFenceFd;
+}
+
+static const hwc_backend_funcs hwc1_backend = {
+	.name = "HWComposer 1.x",
+	.close = hwc1_close,
+	.set_power_mode = hwc1_set_power_mode,
+	.can_set_active_config = hwc1_can_set_active_config,
+	.set_active_config = hwc1_set_active_config,
+	.register_procs = hwc1_register_procs,
+	.set_vsync_enabled = hwc1_set_vsync_enabled,
+	.external_probe = hwc1_external_probe,
+	.present = hwc1_present,
+	.present_external = hwc1_present_external
+};
+
+static void present(void *user_data, struct ANativeWindow *window,
+								struct ANativeWindowBuffer *buffer)
+{
+	ScrnInfoPtr pScrn = (ScrnInfoPtr)user_data;
+	HWCPtr hwc = HWCPTR(pScrn);
+	int releaseFenceFd;
+
+	releaseFenceFd = hwc->backend->present(pScrn, buffer, HWCNativeBufferGetFence(buffer));
+	HWCNativeBufferSetFence(buffer, releaseFenceFd);
+}
+
+/* present callback of the external display's own swap chain */
+static void present_external(void *user_data, struct ANativeWindow *window,
+							 struct ANativeWindowBuffer *buffer)
+{
+	ScrnInfoPtr pScrn = (ScrnInfoPtr)user_data;
+	HWCPtr hwc = HWCPTR(pScrn);
+	int releaseFenceFd;
+
+	releaseFenceFd = hwc->backend->present_external(pScrn, buffer,
+													HWCNativeBufferGetFence(buffer));
+	HWCNativeBufferSetFence(buffer, releaseFenceFd);
 }
 
 struct ANativeWindow *hwc_get_native_window(ScrnInfoPtr pScrn) {
@@ -251,6 +876,16 @@ struct ANativeWindow *hwc_get_native_window(ScrnInfoPtr pScrn) {
 	return win;
 }
 
+struct ANativeWindow *hwc_get_external_window(ScrnInfoPtr pScrn) {
+	HWCPtr hwc = HWCPTR(pScrn);
+	return HWCNativeWindowCreate(hwc->external.width, hwc->external.height,
+								 HAL_PIXEL_FORMAT_RGBA_8888, present_external, pScrn);
+}
+
+void hwc_destroy_native_window(struct ANativeWindow *win) {
+	HWCNativeWindowDestroy(win);
+}
+
 void hwc_toggle_screen_brightness(ScrnInfoPtr pScrn)
 {
 	HWCPtr hwc = HWCPTR(pScrn);
@@ -0,0 +1,285 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "xf86.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "driver.h"
+
+/*
+ * Input-to-photon latency, enabled with Option "MeasureLatency".
+ *
+ * Each composed frame carries the arrival time of the oldest damage (or
+ * cursor update) it contains, and gets timestamped when composition
+ * starts, when eglSwapBuffers is called and when HWComposer set() returns,
+ * which on hybris happens within eglSwapBuffers.
+ * The frame is complete when its retire fence signals or, if HWComposer
+ * gives us no retire fence, at the first vsync after set(). The mock HAL
+ * generates vsync too, so this works unchanged there.
+ *
+ * Frames waiting for completion are shared with the HWComposer vsync
+ * thread and protected by latency->lock. The vsync thread can run until
+ * the HWComposer device is closed, so the lock is only destroyed then.
+ */
+
+static uint64_t hwc_latency_start(const hwc_latency_frame *frame)
+{
+    return frame->arrival ? frame->arrival : frame->compose;
+}
+
+/* Called with latency->lock held */
+static void hwc_latency_complete(hwc_latency *latency, hwc_latency_frame *frame,
+                                 uint64_t t)
+{
+    uint64_t start = hwc_latency_start(frame);
+
+    if (t >= start)
+        hwc_histogram_add(&latency->total, t - start);
+    if (frame->arrival && frame->compose >= frame->arrival)
+        hwc_histogram_add(&latency->queue, frame->compose - frame->arrival);
+    if (frame->swap >= frame->compose)
+        hwc_histogram_add(&latency->compose, frame->swap - frame->compose);
+    if (frame->swap && frame->set >= frame->swap)
+        hwc_histogram_add(&latency->swap, frame->set - frame->swap);
+    if (frame->set && t >= frame->set)
+        hwc_histogram_add(&latency->present, t - frame->set);
+
+    if (frame->fence >= 0) {
+        RemoveNotifyFd(frame->fence);
+        close(frame->fence);
+        frame->fence = -1;
+    }
+    frame->pending = FALSE;
+}
+
+static void hwc_latency_fence_notify(int fd, int ready, void *data)
+{
+    ScrnInfoPtr pScrn = (ScrnInfoPtr) data;
+    hwc_latency *latency = &HWCPTR(pScrn)->latency;
+    uint64_t now = hwc_stats_now_us();
+    int i;
+
+    pthread_mutex_lock(&latency->lock);
+    for (i = 0; i < HWC_LATENCY_PENDING; i++) {
+        hwc_latency_frame *frame = &latency->pending[i];
+
+        if (frame->pending && frame->fence == fd) {
+            hwc_latency_complete(latency, frame, now);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&latency->lock);
+}
+
+void hwc_latency_init(ScrnInfoPtr pScrn, Bool enabled)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_latency *latency = &hwc->latency;
+    int i;
+
+    if (!latency->lockInit) {
+        pthread_mutex_init(&latency->lock, NULL);
+        latency->lockInit = TRUE;
+    }
+
+    /* the lock is kept from the previous generation */
+    pthread_mutex_lock(&latency->lock);
+    memset(&latency->current, 0, sizeof(latency->current));
+    memset(latency->pending, 0, sizeof(latency->pending));
+    latency->dropped = 0;
+    memset(&latency->total, 0, sizeof(latency->total));
+    memset(&latency->queue, 0, sizeof(latency->queue));
+    memset(&latency->compose, 0, sizeof(latency->compose));
+    memset(&latency->swap, 0, sizeof(latency->swap));
+    memset(&latency->present, 0, sizeof(latency->present));
+    latency->current.fence = -1;
+    for (i = 0; i < HWC_LATENCY_PENDING; i++)
+        latency->pending[i].fence = -1;
+    __atomic_store_n(&latency->enabled, enabled, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&latency->lock);
+
+    if (!enabled)
+        return;
+
+    hwc_register_procs(pScrn);
+    hwc_set_vsync_enabled(pScrn, TRUE);
+
+    xf86DrvMsg(pScrn->scrnIndex, X_CONFIG, "measuring input-to-photon latency\n");
+}
+
+void hwc_latency_close(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_latency *latency = &hwc->latency;
+    int i;
+
+    if (!latency->enabled)
+        return;
+
+    hwc_set_vsync_enabled(pScrn, FALSE);
+
+    /* from here on the vsync thread leaves the frames alone */
+    pthread_mutex_lock(&latency->lock);
+    __atomic_store_n(&latency->enabled, FALSE, __ATOMIC_RELEASE);
+    for (i = 0; i < HWC_LATENCY_PENDING; i++) {
+        hwc_latency_frame *frame = &latency->pending[i];
+
+        if (frame->fence >= 0) {
+            RemoveNotifyFd(frame->fence);
+            close(frame->fence);
+            frame->fence = -1;
+        }
+        frame->pending = FALSE;
+    }
+    pthread_mutex_unlock(&latency->lock);
+
+    if (latency->current.fence >= 0) {
+        close(latency->current.fence);
+        latency->current.fence = -1;
+    }
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+               "latency: %llu frames, p50 %llu us, p90 %llu us, p99 %llu us, max %llu us\n",
+               (unsigned long long) latency->total.count,
+               (unsigned long long) hwc_histogram_percentile(&latency->total, 0.50),
+               (unsigned long long) hwc_histogram_percentile(&latency->total, 0.90),
+               (unsigned long long) hwc_histogram_percentile(&latency->total, 0.99),
+               (unsigned long long) latency->total.max);
+}
+
+/* Called once the HWComposer device is closed and no vsync can arrive */
+void hwc_latency_fini(ScrnInfoPtr pScrn)
+{
+    hwc_latency *latency = &HWCPTR(pScrn)->latency;
+
+    if (!latency->lockInit)
+        return;
+
+    pthread_mutex_destroy(&latency->lock);
+    latency->lockInit = FALSE;
+}
+
+void hwc_latency_begin(HWCPtr hwc, uint64_t arrival)
+{
+    hwc_latency_frame *frame = &hwc->latency.current;
+
+    if (!hwc->latency.enabled)
+        return;
+
+    if (frame->fence >= 0)
+        close(frame->fence);
+
+    memset(frame, 0, sizeof(*frame));
+    frame->fence = -1;
+    frame->arrival = arrival;
+    frame->compose = hwc_stats_now_us();
+}
+
+void hwc_latency_mark_swap(HWCPtr hwc)
+{
+    if (hwc->latency.enabled)
+        hwc->latency.current.swap = hwc_stats_now_us();
+}
+
+void hwc_latency_mark_set(HWCPtr hwc, int retireFenceFd)
+{
+    hwc_latency_frame *frame = &hwc->latency.current;
+
+    if (!hwc->latency.enabled)
+        return;
+
+    frame->set = hwc_stats_now_us();
+    if (retireFenceFd >= 0 && frame->fence < 0)
+        frame->fence = dup(retireFenceFd);
+}
+
+void hwc_latency_end(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_latency *latency = &hwc->latency;
+    hwc_latency_frame *slot = NULL;
+    int i;
+
+    if (!latency->enabled || !latency->current.compose)
+        return;
+
+    pthread_mutex_lock(&latency->lock);
+    for (i = 0; i < HWC_LATENCY_PENDING; i++) {
+        hwc_latency_frame *frame = &latency->pending[i];
+
+        if (!frame->pending) {
+            slot = frame;
+            break;
+        }
+        if (!slot || frame->compose < slot->compose)
+            slot = frame;
+    }
+
+    if (slot->pending) {
+        /* never completed, most likely the display went off */
+        if (slot->fence >= 0) {
+            RemoveNotifyFd(slot->fence);
+            close(slot->fence);
+        }
+        latency->dropped++;
+    }
+
+    *slot = latency->current;
+    slot->pending = TRUE;
+    latency->current.fence = -1;
+    latency->current.compose = 0;
+
+    if (slot->fence >= 0 &&
+        !SetNotifyFd(slot->fence, hwc_latency_fence_notify, X_NOTIFY_READ, pScrn)) {
+        close(slot->fence);
+        slot->fence = -1;
+    }
+    pthread_mutex_unlock(&latency->lock);
+}
+
+/* Called from the HWComposer vsync thread, timestamp in CLOCK_MONOTONIC us */
+void hwc_latency_vsync(HWCPtr hwc, uint64_t timestamp)
+{
+    hwc_latency *latency = &hwc->latency;
+    int i;
+
+    if (!__atomic_load_n(&latency->enabled, __ATOMIC_ACQUIRE))
+        return;
+
+    pthread_mutex_lock(&latency->lock);
+    for (i = 0; latency->enabled && i < HWC_LATENCY_PENDING; i++) {
+        hwc_latency_frame *frame = &latency->pending[i];
+
+        if (frame->pending && frame->fence < 0 && frame->set &&
+            frame->set <= timestamp)
+            hwc_latency_complete(latency, frame, timestamp);
+    }
+    pthread_mutex_unlock(&latency->lock);
+}
+
+void hwc_latency_write_json(FILE *f, HWCPtr hwc)
+{
+    hwc_latency *latency = &hwc->latency;
+
+    pthread_mutex_lock(&latency->lock);
+    fprintf(f, "{\"dropped\":%llu,\"total_us\":",
+            (unsigned long long) latency->dropped);
+    hwc_histogram_write_json(f, &latency->total);
+    fprintf(f, ",\"queue_us\":");
+    hwc_histogram_write_json(f, &latency->queue);
+    fprintf(f, ",\"compose_us\":");
+    hwc_histogram_write_json(f, &latency->compose);
+    fprintf(f, ",\"swap_us\":");
+    hwc_histogram_write_json(f, &latency->swap);
+    fprintf(f, ",\"present_us\":");
+    hwc_histogram_write_json(f, &latency->present);
+    fprintf(f, ",\"buckets\":[");
+    for (int i = 0; i < HWC_HISTOGRAM_BUCKETS; i++)
+        fprintf(f, "%s%u", i ? "," : "", latency->total.buckets[i]);
+    fprintf(f, "]}");
+    pthread_mutex_unlock(&latency->lock);
+}
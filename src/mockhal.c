@@ -0,0 +1,692 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "xf86.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/memfd.h>
+
+#include "driver.h"
+
+/*
+ * Stand-in HAL for running the driver without Android hardware.
+ *
+ * The hwcomposer device records every prepare/set call and drives vsync
+ * from a thread, gralloc buffers live in memfd mappings, the backlight
+ * only remembers its last state, and EGL runs on Mesa's surfaceless
+ * platform with a pbuffer in place of the HWComposer native window.
+ * Since a memfd mapping can't be imported as an EGLImage, the root buffer
+ * goes through the renderer's texture upload path.
+ */
+
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+
+#define HWC_MOCK_DEFAULT_WIDTH 720
+#define HWC_MOCK_DEFAULT_HEIGHT 1280
+#define HWC_MOCK_DEFAULT_REFRESH 60
+#define HWC_MOCK_DEFAULT_DPI 300
+#define HWC_MOCK_MAX_CONFIGS 4
+
+#define HWC_MOCK_CALL_PREPARE 0
+#define HWC_MOCK_CALL_SET 1
+
+typedef struct {
+    int fd;
+    void *map;
+    size_t size;
+    int width;
+    int height;
+    int stride;
+    int format;
+} hwc_mock_buffer;
+
+typedef struct hwc_mock_device {
+    hwc_composer_device_1_t device;
+    hw_module_t module;
+    hwc_procs_t const *procs;
+
+    int width;
+    int height;
+    int dpi;
+    /* one config per refresh rate, all of the same size */
+    int64_t vsyncPeriods[HWC_MOCK_MAX_CONFIGS];
+    int numConfigs;
+    int activeConfig;
+    int64_t vsyncPeriod;
+
+    pthread_t vsyncThread;
+    pthread_mutex_t lock;
+    Bool vsyncEnabled;
+    Bool running;
+    int64_t lastVsync;
+    Bool powered;
+
+    hwc_mock_record records[HWC_MOCK_RECORDS];
+    uint64_t numRecords;
+    uint64_t numFrames;
+
+    struct light_device_t lights;
+    unsigned int lightColor;
+} hwc_mock_device;
+
+static int64_t hwc_mock_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void hwc_mock_record_call(hwc_mock_device *mock, int call,
+                                 hwc_display_contents_1_t *contents)
+{
+    hwc_mock_record *rec;
+    size_t last;
+
+    if (!contents)
+        return;
+
+    pthread_mutex_lock(&mock->lock);
+    rec = &mock->records[mock->numRecords % HWC_MOCK_RECORDS];
+    last = contents->numHwLayers ? contents->numHwLayers - 1 : 0;
+
+    rec->seq = mock->numRecords++;
+    rec->timestamp = hwc_mock_now();
+    rec->call = call;
+    rec->numHwLayers = contents->numHwLayers;
+    rec->flags = contents->flags;
+    rec->targetComposition = contents->numHwLayers ?
+                             contents->hwLayers[last].compositionType : -1;
+    rec->checksum = 0;
+    if (call == HWC_MOCK_CALL_SET)
+        mock->numFrames++;
+    pthread_mutex_unlock(&mock->lock);
+}
+
+static int hwc_mock_prepare(hwc_composer_device_1_t *dev, size_t numDisplays,
+                            hwc_display_contents_1_t **displays)
+{
+    hwc_mock_device *mock = (hwc_mock_device *) dev;
+    hwc_display_contents_1_t *contents = displays[HWC_DISPLAY_PRIMARY];
+    size_t i;
+
+    if (!contents)
+        return 0;
+
+    /* Like a GLES-only HWC: everything goes to the framebuffer target */
+    for (i = 0; i < contents->numHwLayers; i++) {
+        if (contents->hwLayers[i].compositionType != HWC_FRAMEBUFFER_TARGET)
+            contents->hwLayers[i].compositionType = HWC_FRAMEBUFFER;
+    }
+
+    hwc_mock_record_call(mock, HWC_MOCK_CALL_PREPARE, contents);
+    return 0;
+}
+
+static int hwc_mock_set(hwc_composer_device_1_t *dev, size_t numDisplays,
+                        hwc_display_contents_1_t **displays)
+{
+    hwc_mock_device *mock = (hwc_mock_device *) dev;
+    hwc_display_contents_1_t *contents = displays[HWC_DISPLAY_PRIMARY];
+    size_t i;
+
+    if (!contents)
+        return 0;
+
+    for (i = 0; i < contents->numHwLayers; i++) {
+        hwc_layer_1_t *layer = &contents->hwLayers[i];
+
+        if (layer->acquireFenceFd >= 0) {
+            close(layer->acquireFenceFd);
+            layer->acquireFenceFd = -1;
+        }
+        layer->releaseFenceFd = -1;
+    }
+    contents->retireFenceFd = -1;
+    contents->flags = 0;
+
+    hwc_mock_record_call(mock, HWC_MOCK_CALL_SET, contents);
+    return 0;
+}
+
+static int hwc_mock_event_control(hwc_composer_device_1_t *dev, int disp,
+                                  int event, int enabled)
+{
+    hwc_mock_device *mock = (hwc_mock_device *) dev;
+
+    if (disp != HWC_DISPLAY_PRIMARY || event != HWC_EVENT_VSYNC)
+        return -EINVAL;
+
+    pthread_mutex_lock(&mock->lock);
+    mock->vsyncEnabled = enabled;
+    pthread_mutex_unlock(&mock->lock);
+    return 0;
+}
+
+static int hwc_mock_blank(hwc_composer_device_1_t *dev, int disp, int blank)
+{
+    hwc_mock_device *mock = (hwc_mock_device *) dev;
+
+    if (disp != HWC_DISPLAY_PRIMARY)
+        return -EINVAL;
+
+    mock->powered = !blank;
+    return 0;
+}
+
+static void hwc_mock_register_procs(hwc_composer_device_1_t *dev,
+                                    hwc_procs_t const *procs)
+{
+    hwc_mock_device *mock = (hwc_mock_device *) dev;
+
+    pthread_mutex_lock(&mock->lock);
+    mock->procs = procs;
+    pthread_mutex_unlock(&mock->lock);
+}
+
+static int hwc_mock_get_display_configs(hwc_composer_device_1_t *dev, int disp,
+                                        uint32_t *configs, size_t *numConfigs)
+{
+    hwc_mock_device *mock = (hwc_mock_device *) dev;
+    int i;
+
+    if (disp != HWC_DISPLAY_PRIMARY)
+        return -EINVAL;
+
+    for (i = 0; i < mock->numConfigs && i < *numConfigs; i++)
+        configs[i] = i;
+    *numConfigs = mock->numConfigs;
+    return 0;
+}
+
+static int hwc_mock_get_display_attributes(hwc_composer_device_1_t *dev, int disp,
+                                           uint32_t config, const uint32_t *attributes,
+                                           int32_t *values)
+{
+    hwc_mock_device *mock = (hwc_mock_device *) dev;
+    int i;
+
+    if (disp != HWC_DISPLAY_PRIMARY || config >= mock->numConfigs)
+        return -EINVAL;
+
+    for (i = 0; attributes[i] != HWC_DISPLAY_NO_ATTRIBUTE; i++) {
+        switch (attributes[i]) {
+        case HWC_DISPLAY_VSYNC_PERIOD:
+            values[i] = (int32_t) mock->vsyncPeriods[config];
+            break;
+        case HWC_DISPLAY_WIDTH:
+            values[i] = mock->width;
+            break;
+        case HWC_DISPLAY_HEIGHT:
+            values[i] = mock->height;
+            break;
+        case HWC_DISPLAY_DPI_X:
+        case HWC_DISPLAY_DPI_Y:
+            values[i] = mock->dpi * 1000;
+            break;
+        default:
+            values[i] = 0;
+            break;
+        }
+    }
+    return 0;
+}
+
+#ifdef HWC_DEVICE_API_VERSION_1_4
+static int hwc_mock_get_active_config(hwc_composer_device_1_t *dev, int disp)
+{
+    hwc_mock_device *mock = (hwc_mock_device *) dev;
+
+    if (disp != HWC_DISPLAY_PRIMARY)
+        return -EINVAL;
+
+    return mock->activeConfig;
+}
+
+/* Takes effect from the next vsync */
+static int hwc_mock_set_active_config(hwc_composer_device_1_t *dev, int disp, int index)
+{
+    hwc_mock_device *mock = (hwc_mock_device *) dev;
+
+    if (disp != HWC_DISPLAY_PRIMARY || index < 0 || index >= mock->numConfigs)
+        return -EINVAL;
+
+    pthread_mutex_lock(&mock->lock);
+    mock->activeConfig = index;
+    mock->vsyncPeriod = mock->vsyncPeriods[index];
+    pthread_mutex_unlock(&mock->lock);
+    return 0;
+}
+
+static int hwc_mock_set_power_mode(hwc_composer_device_1_t *dev, int disp, int mode)
+{
+    return hwc_mock_blank(dev, disp, mode == HWC_POWER_MODE_OFF);
+}
+#endif
+
+static void *hwc_mock_vsync_thread(void *data)
+{
+    hwc_mock_device *mock = (hwc_mock_device *) data;
+    struct timespec next;
+    int64_t t = hwc_mock_now();
+
+    for (;;) {
+        hwc_procs_t const *procs = NULL;
+
+        pthread_mutex_lock(&mock->lock);
+        t += mock->vsyncPeriod;
+        pthread_mutex_unlock(&mock->lock);
+        next.tv_sec = t / 1000000000LL;
+        next.tv_nsec = t % 1000000000LL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+            ;
+
+        pthread_mutex_lock(&mock->lock);
+        if (!mock->running) {
+            pthread_mutex_unlock(&mock->lock);
+            break;
+        }
+        mock->lastVsync = t;
+        if (mock->vsyncEnabled && mock->powered)
+            procs = mock->procs;
+        pthread_mutex_unlock(&mock->lock);
+
+        if (procs && procs->vsync)
+            procs->vsync(procs, HWC_DISPLAY_PRIMARY, t);
+    }
+
+    return NULL;
+}
+
+static int hwc_mock_close(hw_device_t *device)
+{
+    hwc_mock_device *mock = (hwc_mock_device *) device;
+
+    pthread_mutex_lock(&mock->lock);
+    mock->running = FALSE;
+    pthread_mutex_unlock(&mock->lock);
+    pthread_join(mock->vsyncThread, NULL);
+
+    pthread_mutex_destroy(&mock->lock);
+    free(mock);
+    return 0;
+}
+
+static int hwc_mock_set_light(struct light_device_t *dev,
+                              struct light_state_t const *state)
+{
+    hwc_mock_device *mock = (hwc_mock_device *)
+        ((char *) dev - offsetof(hwc_mock_device, lights));
+
+    mock->lightColor = state->color;
+    return 0;
+}
+
+/* "WxH[@Hz[/Hz...]]", each refresh rate a config of its own */
+static Bool hwc_mock_parse_refresh(hwc_mock_device *mock, const char *s)
+{
+    char *end;
+    long refresh;
+
+    do {
+        refresh = strtol(s, &end, 10);
+        if (end == s || refresh <= 0 || mock->numConfigs == HWC_MOCK_MAX_CONFIGS)
+            return FALSE;
+        mock->vsyncPeriods[mock->numConfigs++] = 1000000000LL / refresh;
+        s = end + 1;
+    } while (*end == '/');
+
+    return *end == '\0';
+}
+
+static void hwc_mock_parse_mode(ScrnInfoPtr pScrn, hwc_mock_device *mock,
+                                const char *s)
+{
+    int width, height, n = 0;
+    Bool valid = FALSE;
+
+    mock->numConfigs = 0;
+    if (s && sscanf(s, "%dx%d%n", &width, &height, &n) == 2 && width > 0 && height > 0) {
+        if (s[n] == '\0')
+            valid = TRUE;
+        else if (s[n] == '@')
+            valid = hwc_mock_parse_refresh(mock, s + n + 1);
+    }
+
+    if (valid) {
+        mock->width = width;
+        mock->height = height;
+    } else {
+        if (s)
+            xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                       "invalid MockHALMode \"%s\", expected WxH[@Hz[/Hz...]]\n", s);
+        mock->width = HWC_MOCK_DEFAULT_WIDTH;
+        mock->height = HWC_MOCK_DEFAULT_HEIGHT;
+        mock->numConfigs = 0;
+    }
+    if (!mock->numConfigs)
+        mock->vsyncPeriods[mock->numConfigs++] = 1000000000LL / HWC_MOCK_DEFAULT_REFRESH;
+
+    mock->activeConfig = 0;
+    mock->vsyncPeriod = mock->vsyncPeriods[0];
+}
+
+hwc_composer_device_1_t *hwc_mock_hal_open(ScrnInfoPtr pScrn, const char *mode)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_mock_device *mock = calloc(1, sizeof(hwc_mock_device));
+
+    if (!mock)
+        return NULL;
+
+    hwc_mock_parse_mode(pScrn, mock, mode);
+    mock->dpi = HWC_MOCK_DEFAULT_DPI;
+    mock->powered = TRUE;
+    mock->running = TRUE;
+    pthread_mutex_init(&mock->lock, NULL);
+
+    mock->module.tag = HARDWARE_MODULE_TAG;
+    mock->module.id = HWC_HARDWARE_MODULE_ID;
+    mock->module.name = "hwcomposer mock HAL";
+
+    mock->device.common.tag = HARDWARE_DEVICE_TAG;
+#if defined(HWC_DEVICE_API_VERSION_1_4)
+    mock->device.common.version = HWC_DEVICE_API_VERSION_1_4;
+    mock->device.setPowerMode = hwc_mock_set_power_mode;
+    mock->device.getActiveConfig = hwc_mock_get_active_config;
+    mock->device.setActiveConfig = hwc_mock_set_active_config;
+#elif defined(HWC_DEVICE_API_VERSION_1_3)
+    mock->device.common.version = HWC_DEVICE_API_VERSION_1_3;
+#else
+    mock->device.common.version = HWC_DEVICE_API_VERSION_1_0;
+#endif
+    mock->device.common.module = &mock->module;
+    mock->device.common.close = hwc_mock_close;
+    mock->device.prepare = hwc_mock_prepare;
+    mock->device.set = hwc_mock_set;
+    mock->device.eventControl = hwc_mock_event_control;
+    mock->device.blank = hwc_mock_blank;
+    mock->device.registerProcs = hwc_mock_register_procs;
+    mock->device.getDisplayConfigs = hwc_mock_get_display_configs;
+    mock->device.getDisplayAttributes = hwc_mock_get_display_attributes;
+
+    mock->lights.common.tag = HARDWARE_DEVICE_TAG;
+    mock->lights.set_light = hwc_mock_set_light;
+
+    if (pthread_create(&mock->vsyncThread, NULL, hwc_mock_vsync_thread, mock) != 0) {
+        xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "mock HAL: failed to start vsync thread\n");
+        pthread_mutex_destroy(&mock->lock);
+        free(mock);
+        return NULL;
+    }
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "mock HAL: %dx%d, %d config(s), vsync period %lld ns\n",
+               mock->width, mock->height, mock->numConfigs, (long long) mock->vsyncPeriod);
+
+    hwc->mock = mock;
+    return &mock->device;
+}
+
+struct light_device_t *hwc_mock_hal_lights(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+
+    return hwc->mock ? &hwc->mock->lights : NULL;
+}
+
+void hwc_mock_hal_close(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_mock_device *mock = hwc->mock;
+
+    if (!mock)
+        return;
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+               "mock HAL: %llu frames set, %llu HWC calls recorded\n",
+               (unsigned long long) mock->numFrames,
+               (unsigned long long) mock->numRecords);
+
+    hwc->mock = NULL;
+    mock->device.common.close(&mock->device.common);
+}
+
+int64_t hwc_mock_hal_last_vsync(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    int64_t t;
+
+    if (!hwc->mock)
+        return 0;
+
+    pthread_mutex_lock(&hwc->mock->lock);
+    t = hwc->mock->lastVsync;
+    pthread_mutex_unlock(&hwc->mock->lock);
+    return t;
+}
+
+/*
+ * Copy out the most recent recorded HWC calls, oldest first.
+ * Returns the number of records written.
+ */
+int hwc_mock_hal_get_records(ScrnInfoPtr pScrn, hwc_mock_record *out, int max)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_mock_device *mock = hwc->mock;
+    uint64_t first;
+    int n = 0;
+
+    if (!mock)
+        return 0;
+
+    pthread_mutex_lock(&mock->lock);
+    first = mock->numRecords > HWC_MOCK_RECORDS ? mock->numRecords - HWC_MOCK_RECORDS : 0;
+    if (mock->numRecords - first > (uint64_t) max)
+        first = mock->numRecords - max;
+    for (; first < mock->numRecords; first++)
+        out[n++] = mock->records[first % HWC_MOCK_RECORDS];
+    pthread_mutex_unlock(&mock->lock);
+
+    return n;
+}
+
+/*
+ * The "mock_hal" entry of the StatsFile output, which make bench-check
+ * compares against expected values: the frames set, the checksum of the
+ * last one (with MockHALReadback), whether each recorded set() followed
+ * a prepare(), and how long ago the vsync thread last ran.
+ */
+void hwc_mock_hal_write_json(FILE *f, ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_mock_record records[HWC_MOCK_RECORDS];
+    int64_t lastVsync = hwc_mock_hal_last_vsync(pScrn);
+    uint64_t frames, calls, checksum = 0;
+    Bool ordered = TRUE;
+    int i, n;
+
+    pthread_mutex_lock(&hwc->mock->lock);
+    frames = hwc->mock->numFrames;
+    calls = hwc->mock->numRecords;
+    pthread_mutex_unlock(&hwc->mock->lock);
+
+    n = hwc_mock_hal_get_records(pScrn, records, HWC_MOCK_RECORDS);
+    for (i = 0; i < n; i++) {
+        if (records[i].call != HWC_MOCK_CALL_SET)
+            continue;
+        /* the first prepare() may have dropped out of the ring */
+        if (i > 0 && records[i - 1].call != HWC_MOCK_CALL_PREPARE)
+            ordered = FALSE;
+        checksum = records[i].checksum;
+    }
+
+    fprintf(f, "{\"frames\":%llu,\"calls\":%llu,\"checksum\":\"%016llx\","
+               "\"prepare_before_set\":%s,\"vsync_age_ms\":%lld}",
+            (unsigned long long) frames, (unsigned long long) calls,
+            (unsigned long long) checksum, ordered ? "true" : "false",
+            lastVsync ? (long long) ((hwc_mock_now() - lastVsync) / 1000000) : -1LL);
+}
+
+/*
+ * Called once per composed frame in place of the HWComposer native window
+ * present callback. Runs the regular layer setup and prepare/set path and,
+ * if requested, stores a checksum of the composed frame in the record.
+ */
+void hwc_mock_hal_present(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_mock_device *mock = hwc->mock;
+    int releaseFenceFd;
+
+    if (!mock)
+        return;
+
+    if (hwc->mockReadback) {
+        size_t size = (size_t) mock->width * mock->height * 4;
+        uint32_t *pixels = malloc(size);
+
+        if (pixels) {
+            const uint8_t *p = (const uint8_t *) pixels;
+            uint64_t h = 0xcbf29ce484222325ULL;
+            size_t i;
+
+            glReadPixels(0, 0, mock->width, mock->height, GL_RGBA,
+                         GL_UNSIGNED_BYTE, pixels);
+            /* RGB only, as 0xBBGGRR: the panel shows no alpha, and the
+               pbuffer may or may not have any */
+            for (i = 0; i < size; i += 4) {
+                h ^= p[i] | p[i + 1] << 8 | (uint32_t) p[i + 2] << 16;
+                h *= 0x100000001b3ULL;
+            }
+            free(pixels);
+            hwc->mockChecksum = h;
+        }
+    }
+
+    releaseFenceFd = hwc_present_layers(pScrn, NULL, -1);
+    if (releaseFenceFd >= 0)
+        close(releaseFenceFd);
+
+    pthread_mutex_lock(&mock->lock);
+    if (mock->numRecords)
+        mock->records[(mock->numRecords - 1) % HWC_MOCK_RECORDS].checksum =
+            hwc->mockChecksum;
+    pthread_mutex_unlock(&mock->lock);
+
+    xf86DrvMsgVerb(pScrn->scrnIndex, X_INFO, 7,
+                   "mock HAL: frame %llu checksum %016llx\n",
+                   (unsigned long long) mock->numFrames,
+                   (unsigned long long) hwc->mockChecksum);
+}
+
+/* gralloc stand-ins, installed in place of the EGL_HYBRIS_native_buffer calls */
+
+static EGLBoolean hwc_mock_create_buffer(EGLint width, EGLint height, EGLint usage,
+                                         EGLint format, EGLint *stride,
+                                         EGLClientBuffer *buffer)
+{
+    hwc_mock_buffer *buf = calloc(1, sizeof(hwc_mock_buffer));
+    int bpp = (format == HYBRIS_PIXEL_FORMAT_RGB_565) ? 2 : 4;
+
+    if (!buf)
+        return EGL_FALSE;
+
+    buf->width = width;
+    buf->height = height;
+    buf->stride = width;
+    buf->format = format;
+    buf->size = (size_t) buf->stride * height * bpp;
+
+    buf->fd = syscall(SYS_memfd_create, "hwc-mock-gralloc", MFD_CLOEXEC);
+    if (buf->fd < 0 || ftruncate(buf->fd, buf->size) < 0)
+        goto fail;
+
+    buf->map = mmap(NULL, buf->size, PROT_READ | PROT_WRITE, MAP_SHARED, buf->fd, 0);
+    if (buf->map == MAP_FAILED)
+        goto fail;
+
+    *stride = buf->stride;
+    *buffer = (EGLClientBuffer) buf;
+    return EGL_TRUE;
+
+fail:
+    if (buf->fd >= 0)
+        close(buf->fd);
+    free(buf);
+    return EGL_FALSE;
+}
+
+static EGLBoolean hwc_mock_lock_buffer(EGLClientBuffer buffer, EGLint usage,
+                                       EGLint l, EGLint t, EGLint w, EGLint h,
+                                       void **vaddr)
+{
+    hwc_mock_buffer *buf = (hwc_mock_buffer *) buffer;
+
+    if (!buf)
+        return EGL_FALSE;
+
+    *vaddr = buf->map;
+    return EGL_TRUE;
+}
+
+static EGLBoolean hwc_mock_unlock_buffer(EGLClientBuffer buffer)
+{
+    return buffer ? EGL_TRUE : EGL_FALSE;
+}
+
+static EGLBoolean hwc_mock_release_buffer(EGLClientBuffer buffer)
+{
+    hwc_mock_buffer *buf = (hwc_mock_buffer *) buffer;
+
+    if (!buf)
+        return EGL_FALSE;
+
+    munmap(buf->map, buf->size);
+    close(buf->fd);
+    free(buf);
+    return EGL_TRUE;
+}
+
+void hwc_mock_hal_init_native_buffer(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+
+    renderer->eglHybrisCreateNativeBuffer = hwc_mock_create_buffer;
+    renderer->eglHybrisLockNativeBuffer = hwc_mock_lock_buffer;
+    renderer->eglHybrisUnlockNativeBuffer = hwc_mock_unlock_buffer;
+    renderer->eglHybrisReleaseNativeBuffer = hwc_mock_release_buffer;
+    renderer->eglCreateImageKHR = NULL;
+    renderer->eglDestroyImageKHR = NULL;
+    renderer->glEGLImageTargetTexture2DOES = NULL;
+    renderer->upload = TRUE;
+}
+
+EGLDisplay hwc_mock_hal_get_display(ScrnInfoPtr pScrn)
+{
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay;
+    const char *extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+
+    if (!extensions || !strstr(extensions, "EGL_MESA_platform_surfaceless")) {
+        xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+                   "mock HAL: EGL_MESA_platform_surfaceless is not available\n");
+        return EGL_NO_DISPLAY;
+    }
+
+    getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+        eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (!getPlatformDisplay)
+        return EGL_NO_DISPLAY;
+
+    return getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+}
@@ -0,0 +1,118 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "xf86.h"
+
+#include <malloc.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "driver.h"
+
+/*
+ * Low-power state, entered when DPMS turns the panel off or we lose the
+ * VT. Composition stops completely: the update timer is cancelled and
+ * hwc_update ignores damage and cursor wakeups until every reason for
+ * suspending is gone. With Option "ReleaseBuffersOnSuspend" the EGL
+ * surface and its swap chain are freed as well.
+ *
+ * On resume a frame is composed before the caller powers the panel back
+ * on, so it comes up showing the current screen contents.
+ */
+
+static long hwc_power_rss_kb(void)
+{
+    long size, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+
+    if (!f)
+        return 0;
+    if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+        resident = 0;
+    fclose(f);
+
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static const char *hwc_power_reason(unsigned int reason)
+{
+    return reason == HWC_SUSPEND_VT ? "VT switch" : "DPMS";
+}
+
+void hwc_power_init(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+
+    /* a previous generation may have been closed while suspended */
+    if (!hwc_egl_renderer_restore_surface(pScrn))
+        xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "failed to recreate EGL surface\n");
+    hwc->suspended = 0;
+}
+
+void hwc_power_suspend(ScrnInfoPtr pScrn, unsigned int reason)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    long before, after;
+    Bool released = FALSE;
+
+    if (hwc->suspended & reason)
+        return;
+
+    hwc->suspended |= reason;
+    if (hwc->suspended != reason)
+        return;
+
+    TimerCancel(hwc->timer);
+
+    before = hwc_power_rss_kb();
+
+    if (hwc->releaseOnSuspend) {
+        released = hwc_egl_renderer_release_surface(pScrn);
+        if (!released)
+            xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                       "EGL_KHR_surfaceless_context is missing, keeping the swap chain\n");
+    }
+
+    malloc_trim(0);
+    after = hwc_power_rss_kb();
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+               "suspended for %s: composition stopped%s, resident memory %ld kB -> %ld kB\n",
+               hwc_power_reason(reason), released ? ", swap chain released" : "",
+               before, after);
+}
+
+/*
+ * Returns TRUE if this brought the screen out of the low-power state, in
+ * which case a frame has been composed and hwc->resumeTime is set.
+ */
+Bool hwc_power_resume(ScrnInfoPtr pScrn, unsigned int reason)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    ScreenPtr pScreen = pScrn->pScreen;
+
+    if (!(hwc->suspended & reason))
+        return FALSE;
+
+    hwc->suspended &= ~reason;
+    if (hwc->suspended)
+        return FALSE;
+
+    hwc->resumeTime = hwc_stats_now_us();
+
+    if (!hwc_egl_renderer_restore_surface(pScrn))
+        xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "failed to recreate EGL surface\n");
+
+    /* the block handler left the damage of the suspended period pending */
+    hwc_damage_merge(pScrn);
+    __atomic_store_n(&hwc->dirty, TRUE, __ATOMIC_RELEASE);
+    hwc_update(pScreen);
+    hwc_update_timer_start(pScreen);
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "resumed from %s: frame ready after %.1f ms\n",
+               hwc_power_reason(reason),
+               (hwc_stats_now_us() - hwc->resumeTime) / 1000.0);
+    return TRUE;
+}
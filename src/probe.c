@@ -0,0 +1,304 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "driver.h"
+
+/*
+ * Capability probe, run by PreInit once EGL is up. It records:
+ *
+ *  - the EGL and GL extensions the renderer can make use of,
+ *  - whether a gralloc buffer can be imported as an EGLImage texture,
+ *  - how fast the CPU reads a gralloc buffer's mapping compared with
+ *    malloc memory (uncached or write-combined mappings read many times
+ *    slower), and the memcpy bandwidth.
+ *
+ * PreInit picks the root buffer path and the shadow framebuffer from
+ * that unless the options for them are set. The result is cached in the cache
+ * directory, keyed by the EGL and GL implementation, the HWComposer API
+ * and the panel size, so later starts skip the measurements.
+ */
+
+#define HWC_PROBE_CACHE_MAGIC "hwcprobe 1"
+#define HWC_PROBE_CACHE_FILE "probe"
+
+/* gralloc test buffer for the bandwidth measurements, 1 MiB */
+#define HWC_PROBE_WIDTH 512
+#define HWC_PROBE_HEIGHT 512
+#define HWC_PROBE_PASSES 4
+
+/* a mapping reading slower than this fraction of malloc memory is uncached */
+#define HWC_PROBE_UNCACHED_RATIO 4
+
+/* in MB/s, from bytes handled in us */
+static uint32_t hwc_probe_rate(uint64_t bytes, uint64_t us)
+{
+    return (uint32_t) (bytes / (us ? us : 1));
+}
+
+/* Keep the compiler from dropping the reads */
+static volatile uint64_t hwc_probe_sink;
+
+static uint32_t hwc_probe_read(const void *data, size_t size)
+{
+    const uint64_t *p = data;
+    uint64_t start, sum = 0;
+    size_t i;
+    int pass;
+
+    start = hwc_stats_now_us();
+    for (pass = 0; pass < HWC_PROBE_PASSES; pass++) {
+        for (i = 0; i < size / sizeof(uint64_t); i++)
+            sum += p[i];
+    }
+    hwc_probe_sink = sum;
+
+    return hwc_probe_rate((uint64_t) size * HWC_PROBE_PASSES, hwc_stats_now_us() - start);
+}
+
+static void hwc_probe_bandwidth(ScrnInfoPtr pScrn, hwc_caps *caps)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+    size_t size = HWC_PROBE_WIDTH * HWC_PROBE_HEIGHT * 4;
+    EGLClientBuffer buffer = NULL;
+    void *src = malloc(size), *dst = malloc(size), *pixels = NULL;
+    uint64_t start;
+    EGLint stride = 0;
+    int pass;
+
+    if (!src || !dst)
+        goto out;
+
+    memset(src, 0x5a, size);
+    memset(dst, 0, size);
+    caps->cachedRead = hwc_probe_read(src, size);
+
+    start = hwc_stats_now_us();
+    for (pass = 0; pass < HWC_PROBE_PASSES; pass++)
+        memcpy(dst, src, size);
+    caps->copy = hwc_probe_rate((uint64_t) size * HWC_PROBE_PASSES, hwc_stats_now_us() - start);
+
+    if (!renderer->nativeBuffers)
+        goto out;
+
+    if (renderer->eglHybrisCreateNativeBuffer(HWC_PROBE_WIDTH, HWC_PROBE_HEIGHT,
+                                              HYBRIS_USAGE_HW_TEXTURE |
+                                              HYBRIS_USAGE_SW_READ_OFTEN |
+                                              HYBRIS_USAGE_SW_WRITE_OFTEN,
+                                              HYBRIS_PIXEL_FORMAT_RGBA_8888,
+                                              &stride, &buffer) != 0 || !buffer)
+        goto out;
+
+    if (renderer->eglHybrisLockNativeBuffer(buffer,
+                                            HYBRIS_USAGE_SW_READ_OFTEN |
+                                            HYBRIS_USAGE_SW_WRITE_OFTEN,
+                                            0, 0, stride, HWC_PROBE_HEIGHT, &pixels) == 0 &&
+        pixels) {
+        size_t mapped = (size_t) stride * HWC_PROBE_HEIGHT * 4;
+
+        memset(pixels, 0x5a, mapped);
+        caps->mappedRead = hwc_probe_read(pixels, mapped);
+        renderer->eglHybrisUnlockNativeBuffer(buffer);
+    }
+
+    renderer->eglHybrisReleaseNativeBuffer(buffer);
+
+out:
+    free(src);
+    free(dst);
+}
+
+/* Import a small gralloc buffer the way the root is, see hwc_egl_renderer_bind_root */
+static Bool hwc_probe_egl_image(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+    EGLClientBuffer buffer = NULL;
+    EGLImageKHR image;
+    EGLint stride = 0;
+    GLuint texture;
+    Bool ok;
+
+    if (!renderer->nativeBuffers || renderer->upload)
+        return FALSE;
+
+    if (renderer->eglHybrisCreateNativeBuffer(64, 64, HYBRIS_USAGE_HW_TEXTURE |
+                                              HYBRIS_USAGE_SW_WRITE_OFTEN,
+                                              HYBRIS_PIXEL_FORMAT_RGBA_8888,
+                                              &stride, &buffer) != 0 || !buffer)
+        return FALSE;
+
+    while (glGetError() != GL_NO_ERROR)
+        ;
+
+    image = renderer->eglCreateImageKHR(renderer->display, EGL_NO_CONTEXT,
+                                        EGL_NATIVE_BUFFER_HYBRIS, buffer, NULL);
+    ok = image != EGL_NO_IMAGE_KHR;
+    if (ok) {
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        renderer->glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, image);
+        ok = glGetError() == GL_NO_ERROR;
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glDeleteTextures(1, &texture);
+        renderer->eglDestroyImageKHR(renderer->display, image);
+    }
+
+    renderer->eglHybrisReleaseNativeBuffer(buffer);
+    return ok;
+}
+
+static uint64_t hwc_probe_key(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    EGLDisplay display = hwc->renderer.display;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    char size[32];
+
+    snprintf(size, sizeof(size), "%dx%d", hwc->hwcWidth, hwc->hwcHeight);
+
+    h = hwc_hash_string(h, HWC_PROBE_CACHE_MAGIC);
+    h = hwc_hash_string(h, eglQueryString(display, EGL_VENDOR));
+    h = hwc_hash_string(h, eglQueryString(display, EGL_VERSION));
+    h = hwc_hash_string(h, (const char *) glGetString(GL_VENDOR));
+    h = hwc_hash_string(h, (const char *) glGetString(GL_RENDERER));
+    h = hwc_hash_string(h, (const char *) glGetString(GL_VERSION));
+    h = hwc_hash_string(h, hwc->backend->name);
+    h = hwc_hash_string(h, size);
+    /* Option "NativeBuffers" "false" leaves nothing to measure */
+    h = hwc_hash_string(h, hwc->renderer.nativeBuffers ? "native" : "system");
+    h = hwc_hash_string(h, hwc->mockHal ? "mock" : "");
+    return h;
+}
+
+static char *hwc_probe_cache_path(const char *dir)
+{
+    char *path;
+
+    if (Xasprintf(&path, "%s/%s", dir, HWC_PROBE_CACHE_FILE) < 0)
+        return NULL;
+    return path;
+}
+
+static Bool hwc_probe_cache_load(const char *dir, uint64_t key, hwc_caps *caps)
+{
+    char *path = hwc_probe_cache_path(dir);
+    char magic[16] = "";
+    unsigned long long fileKey;
+    int eglImage, bufferAge, timerQuery, programBinary, unpackSubimage;
+    FILE *f;
+    int n;
+
+    if (!path)
+        return FALSE;
+
+    f = fopen(path, "r");
+    free(path);
+    if (!f)
+        return FALSE;
+
+    n = fscanf(f, "%15[^\n]\nkey %llx\negl_image %d\nbuffer_age %d\ntimer_query %d\n"
+               "program_binary %d\nunpack_subimage %d\ncached_read %u\nmapped_read %u\n"
+               "copy %u\n",
+               magic, &fileKey, &eglImage, &bufferAge, &timerQuery, &programBinary,
+               &unpackSubimage, &caps->cachedRead, &caps->mappedRead, &caps->copy);
+    fclose(f);
+
+    if (n != 10 || strcmp(magic, HWC_PROBE_CACHE_MAGIC) || fileKey != key)
+        return FALSE;
+
+    caps->eglImage = eglImage;
+    caps->bufferAge = bufferAge;
+    caps->timerQuery = timerQuery;
+    caps->programBinary = programBinary;
+    caps->unpackSubimage = unpackSubimage;
+    return TRUE;
+}
+
+static void hwc_probe_cache_store(ScrnInfoPtr pScrn, const char *dir, uint64_t key,
+                                  const hwc_caps *caps)
+{
+    char *path = hwc_probe_cache_path(dir), *tmp = NULL;
+    FILE *f;
+
+    if (!path || Xasprintf(&tmp, "%s.tmp", path) < 0) {
+        free(path);
+        return;
+    }
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+        goto out;
+
+    /* write to a temporary file and rename, as the shader cache does */
+    f = fopen(tmp, "w");
+    if (!f)
+        goto out;
+
+    fprintf(f, "%s\nkey %016llx\negl_image %d\nbuffer_age %d\ntimer_query %d\n"
+            "program_binary %d\nunpack_subimage %d\ncached_read %u\nmapped_read %u\n"
+            "copy %u\n",
+            HWC_PROBE_CACHE_MAGIC, (unsigned long long) key, caps->eglImage, caps->bufferAge,
+            caps->timerQuery, caps->programBinary, caps->unpackSubimage, caps->cachedRead,
+            caps->mappedRead, caps->copy);
+    if (fclose(f) != 0 || rename(tmp, path) < 0)
+        unlink(tmp);
+
+out:
+    free(path);
+    free(tmp);
+}
+
+/*
+ * Fill HWCRec.caps, from the cache in dir if it has an entry for this
+ * device, or by measuring. dir is NULL to always measure.
+ */
+void hwc_probe(ScrnInfoPtr pScrn, const char *dir)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_caps *caps = &hwc->caps;
+    uint64_t key = hwc_probe_key(pScrn);
+    uint64_t start = hwc_stats_now_us();
+
+    memset(caps, 0, sizeof(*caps));
+
+    if (dir && hwc_probe_cache_load(dir, key, caps)) {
+        caps->cached = TRUE;
+    } else {
+        caps->eglImage = hwc_probe_egl_image(pScrn);
+        caps->bufferAge = epoxy_has_egl_extension(hwc->renderer.display, "EGL_EXT_buffer_age");
+        caps->timerQuery = epoxy_has_gl_extension("GL_EXT_disjoint_timer_query");
+        caps->programBinary = epoxy_has_gl_extension("GL_OES_get_program_binary");
+        caps->unpackSubimage = hwc->renderer.unpackSubimage;
+        hwc_probe_bandwidth(pScrn, caps);
+
+        if (dir)
+            hwc_probe_cache_store(pScrn, dir, key, caps);
+    }
+
+    xf86DrvMsg(pScrn->scrnIndex, X_PROBED,
+               "probe%s: EGLImage import %s, buffer age %s, timer queries %s, "
+               "program binaries %s, unpack subimage %s (%llu us)\n",
+               caps->cached ? " (cached)" : "",
+               caps->eglImage ? "yes" : "no", caps->bufferAge ? "yes" : "no",
+               caps->timerQuery ? "yes" : "no", caps->programBinary ? "yes" : "no",
+               caps->unpackSubimage ? "yes" : "no",
+               (unsigned long long) (hwc_stats_now_us() - start));
+    xf86DrvMsg(pScrn->scrnIndex, X_PROBED,
+               "probe: memory read %u MB/s, gralloc mapping read %u MB/s, memcpy %u MB/s\n",
+               caps->cachedRead, caps->mappedRead, caps->copy);
+}
+
+/* The CPU mapping of gralloc buffers reads much slower than malloc memory */
+Bool hwc_probe_mapping_uncached(const hwc_caps *caps)
+{
+    return caps->mappedRead && caps->cachedRead &&
+           (uint64_t) caps->mappedRead * HWC_PROBE_UNCACHED_RATIO < caps->cachedRead;
+}
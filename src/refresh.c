@@ -0,0 +1,189 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "xf86.h"
+#include "xf86Crtc.h"
+
+#include "driver.h"
+
+/*
+ * Refresh rates. Each of the panel's HWComposer configs with the active
+ * config's size becomes a RandR mode with the config's exact refresh
+ * rate, and picking a mode switches HWComposer to that config. Configs
+ * of another size are left out: they would need a new swap chain.
+ *
+ * The composition timer runs once per vsync period of the active config,
+ * picking up a new period the next time it fires.
+ *
+ * With Option "IdleRefreshTimeout", the panel drops to its lowest refresh
+ * rate after that many milliseconds without a composed frame, and goes
+ * back to the mode's config on the next frame.
+ */
+
+static int hwc_refresh_lowest(HWCPtr hwc)
+{
+    hwc_display_config *mode = &hwc->configs[hwc->modeConfig];
+    int i, lowest = hwc->modeConfig;
+
+    for (i = 0; i < hwc->numConfigs; i++) {
+        hwc_display_config *config = &hwc->configs[i];
+
+        if (config->width == mode->width && config->height == mode->height &&
+            config->vsyncPeriod > hwc->configs[lowest].vsyncPeriod)
+            lowest = i;
+    }
+
+    return lowest;
+}
+
+static void hwc_refresh_switch(ScrnInfoPtr pScrn, int index)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+
+    if (index == hwc->activeConfig)
+        return;
+
+    if (hwc_set_active_config(pScrn, index)) {
+        xf86DrvMsgVerb(pScrn->scrnIndex, X_INFO, 3, "switched to config %d, %.2f Hz\n",
+                       index, 1e9 / hwc->configs[index].vsyncPeriod);
+    } else {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING, "failed to switch to config %d\n", index);
+    }
+}
+
+void hwc_refresh_update_interval(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    int64_t period = hwc->configs[hwc->activeConfig].vsyncPeriod;
+
+    hwc->updateInterval = max((period + 500000) / 1000000, 1);
+}
+
+/*
+ * One mode per config of the active config's size, at the given mode
+ * size: the panel is driven at its native resolution whatever the mode,
+ * so only the refresh rate comes from the config.
+ */
+DisplayModePtr hwc_refresh_modes(ScrnInfoPtr pScrn, int width, int height)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_display_config *active = &hwc->configs[hwc->activeConfig];
+    DisplayModePtr modes = NULL;
+    int i;
+
+    for (i = 0; i < hwc->numConfigs; i++) {
+        hwc_display_config *config = &hwc->configs[i];
+        DisplayModePtr mode;
+        double refresh = 1e9 / config->vsyncPeriod;
+
+        if (config->width != active->width || config->height != active->height)
+            continue;
+
+        mode = xf86CVTMode(width, height, refresh, 0, 0);
+        /* CVT rounds the rate, set the pixel clock for the exact one */
+        mode->Clock = (int) ((double) mode->HTotal * mode->VTotal * 1000000 / config->vsyncPeriod);
+        mode->VRefresh = refresh;
+        mode->type = M_T_DRIVER;
+        if (i == hwc->activeConfig)
+            mode->type |= M_T_PREFERRED;
+        /* mode names only carry the size, tell equal ones apart */
+        free(mode->name);
+        XNFasprintf(&mode->name, "%dx%d_%.2f", width, height, refresh);
+
+        modes = xf86ModesAdd(modes, mode);
+    }
+
+    return modes;
+}
+
+/* The config whose refresh rate is closest to the mode's */
+void hwc_refresh_set_mode(ScrnInfoPtr pScrn, DisplayModePtr mode)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_display_config *active = &hwc->configs[hwc->activeConfig];
+    double refresh = xf86ModeVRefresh(mode), best = DBL_MAX;
+    int i, index = hwc->modeConfig;
+
+    for (i = 0; i < hwc->numConfigs; i++) {
+        hwc_display_config *config = &hwc->configs[i];
+        double diff = fabs(1e9 / config->vsyncPeriod - refresh);
+
+        if (config->width != active->width || config->height != active->height)
+            continue;
+        if (diff < best) {
+            best = diff;
+            index = i;
+        }
+    }
+
+    /* idle keeps the low rate until the next frame */
+    hwc->modeConfig = index;
+    if (!hwc->refreshIdle)
+        hwc_refresh_switch(pScrn, index);
+}
+
+/* A frame is about to be composed */
+void hwc_refresh_frame(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+
+    if (!hwc->idleTimeout)
+        return;
+
+    hwc->lastFrameTime = GetTimeInMillis();
+    if (hwc->refreshIdle) {
+        hwc->refreshIdle = FALSE;
+        hwc_refresh_switch(pScrn, hwc->modeConfig);
+    }
+}
+
+/* From the composition timer */
+void hwc_refresh_idle_check(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    int lowest;
+
+    if (!hwc->idleTimeout || hwc->refreshIdle ||
+        GetTimeInMillis() - hwc->lastFrameTime < (CARD32) hwc->idleTimeout)
+        return;
+
+    hwc->refreshIdle = TRUE;
+    lowest = hwc_refresh_lowest(hwc);
+    if (lowest != hwc->activeConfig) {
+        xf86DrvMsgVerb(pScrn->scrnIndex, X_INFO, 3, "idle for %d ms, lowering the refresh rate\n",
+                       hwc->idleTimeout);
+        hwc_refresh_switch(pScrn, lowest);
+    }
+}
+
+void hwc_refresh_init(ScrnInfoPtr pScrn, int idleTimeout)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+
+    hwc->idleTimeout = 0;
+    hwc->refreshIdle = FALSE;
+    hwc->lastFrameTime = GetTimeInMillis();
+
+    if (idleTimeout <= 0)
+        return;
+
+    if (hwc_refresh_lowest(hwc) == hwc->modeConfig) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                   "IdleRefreshTimeout: the panel has no lower refresh rate\n");
+        return;
+    }
+    if (!hwc_can_set_active_config(pScrn)) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                   "IdleRefreshTimeout: HWComposer can't switch configs, needs 1.4\n");
+        return;
+    }
+
+    hwc->idleTimeout = idleTimeout;
+    xf86DrvMsg(pScrn->scrnIndex, X_CONFIG, "lowering the refresh rate after %d ms idle\n",
+               idleTimeout);
+}
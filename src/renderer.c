@@ -13,56 +13,38 @@
 
 #include "driver.h"
 
-extern const char vertex_src[];
-extern const char vertex_mvp_src[];
-extern const char fragment_src[];
-extern const char fragment_src_bgra[];
-
-static const GLfloat squareVertices[] = {
-    -1.0f, -1.0f,
-    1.0f, -1.0f,
-    -1.0f,  1.0f,
-    1.0f,  1.0f,
-};
-
-static const GLfloat textureVertices[][8] = {
-    { // NORMAL - 0 degrees
-        0.0f,  1.0f,
-        1.0f, 1.0f,
-        0.0f,  0.0f,
-        1.0f, 0.0f,
-    },
-    { // CW - 90 degrees
-        1.0f, 1.0f,
-        1.0f, 0.0f,
-        0.0f,  1.0f,
-        0.0f,  0.0f,
-    },
-    { // UD - 180 degrees
-        1.0f, 0.0f,
-        0.0f,  0.0f,
-        1.0f, 1.0f,
-        0.0f,  1.0f,
-    },
-    { // CCW - 270 degrees
-        0.0f,  0.0f,
-        0.0f,  1.0f,
-        1.0f, 0.0f,
-        1.0f, 1.0f
-    }
-};
-
-GLfloat cursorVertices[8];
-
+/*
+ * Without EGL_HYBRIS_native_buffer (Option "NativeBuffers" "false", or an
+ * EGL that isn't libhybris) the root buffer lives in system memory, and
+ * without EGLImage import a gralloc root is uploaded instead of sampled.
+ * In both cases only the damaged parts are uploaded to rootTexture.
+ */
 Bool hwc_init_hybris_native_buffer(ScrnInfoPtr pScrn)
 {
     HWCPtr hwc = HWCPTR(pScrn);
     hwc_renderer_ptr renderer = &hwc->renderer;
 
+    if (!renderer->nativeBuffers) {
+        xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                   "native buffers disabled, root buffer in system memory\n");
+        renderer->upload = TRUE;
+        return TRUE;
+    }
+
+#ifdef ENABLE_MOCK_HAL
+    if (hwc->mockHal) {
+        hwc_mock_hal_init_native_buffer(pScrn);
+        return TRUE;
+    }
+#endif
+
     if (strstr(eglQueryString(renderer->display, EGL_EXTENSIONS), "EGL_HYBRIS_native_buffer") == NULL)
     {
-        xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "EGL_HYBRIS_native_buffer is missing. Make sure libhybris EGL implementation is used\n");
-        return FALSE;
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                   "EGL_HYBRIS_native_buffer is missing, root buffer in system memory\n");
+        renderer->nativeBuffers = FALSE;
+        renderer->upload = TRUE;
+        return TRUE;
     }
 
     renderer->eglHybrisCreateNativeBuffer = (PFNEGLHYBRISCREATENATIVEBUFFERPROC) eglGetProcAddress("eglHybrisCreateNativeBuffer");
@@ -78,13 +60,15 @@ Bool hwc_init_hybris_native_buffer(ScrnInfoPtr pScrn)
     assert(renderer->eglHybrisReleaseNativeBuffer != NULL);
 
     renderer->eglCreateImageKHR = (PFNEGLCREATEIMAGEKHRPROC) eglGetProcAddress("eglCreateImageKHR");
-    assert(renderer->eglCreateImageKHR != NULL);
-
     renderer->eglDestroyImageKHR = (PFNEGLDESTROYIMAGEKHRPROC) eglGetProcAddress("eglDestroyImageKHR");
-    assert(renderer->eglDestroyImageKHR  != NULL);
-
     renderer->glEGLImageTargetTexture2DOES = (PFNGLEGLIMAGETARGETTEXTURE2DOESPROC) eglGetProcAddress("glEGLImageTargetTexture2DOES");
-    assert(renderer->glEGLImageTargetTexture2DOES != NULL);
+
+    if (!renderer->eglCreateImageKHR || !renderer->eglDestroyImageKHR ||
+        !renderer->glEGLImageTargetTexture2DOES) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                   "EGLImage import is unavailable, uploading the root buffer\n");
+        renderer->upload = TRUE;
+    }
     return TRUE;
 }
 
@@ -102,6 +86,130 @@ MessageCallback( GLenum source,
             type, severity, message );
 }
 
+static EGLSurface hwc_egl_renderer_create_surface(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+    EGLSurface surface;
+
+#ifdef ENABLE_MOCK_HAL
+    if (hwc->mockHal) {
+        EGLint pbattr[] = {
+            EGL_WIDTH, hwc->hwcWidth,
+            EGL_HEIGHT, hwc->hwcHeight,
+            EGL_NONE
+        };
+        surface = eglCreatePbufferSurface(renderer->display, renderer->config, pbattr);
+    } else
+#endif
+    {
+        renderer->window = hwc_get_native_window(pScrn);
+        surface = eglCreateWindowSurface(renderer->display, renderer->config,
+                                         (EGLNativeWindowType) renderer->window, NULL);
+    }
+    assert(eglGetError() == EGL_SUCCESS);
+
+    renderer->surface = surface;
+    return surface;
+}
+
+static void hwc_egl_renderer_destroy_surface(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+
+    if (renderer->surface != EGL_NO_SURFACE) {
+        eglDestroySurface(renderer->display, renderer->surface);
+        renderer->surface = EGL_NO_SURFACE;
+    }
+    if (renderer->window) {
+        hwc_destroy_native_window(renderer->window);
+        renderer->window = NULL;
+    }
+}
+
+/*
+ * Free the swap chain while the screen is off. The context stays current
+ * without a surface, so cursor uploads and the like keep working; that
+ * needs EGL_KHR_surfaceless_context, without it nothing is released.
+ */
+Bool hwc_egl_renderer_release_surface(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+
+    if (renderer->surface == EGL_NO_SURFACE)
+        return TRUE;
+
+    if (!epoxy_has_egl_extension(renderer->display, "EGL_KHR_surfaceless_context"))
+        return FALSE;
+
+    if (eglMakeCurrent(renderer->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                       renderer->context) != EGL_TRUE)
+        return FALSE;
+
+    hwc_egl_renderer_destroy_surface(pScrn);
+    hwc_egl_renderer_destroy_external(pScrn);
+    return TRUE;
+}
+
+Bool hwc_egl_renderer_restore_surface(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+    EGLSurface surface;
+
+    if (renderer->surface != EGL_NO_SURFACE)
+        return TRUE;
+
+    surface = hwc_egl_renderer_create_surface(pScrn);
+    if (surface == EGL_NO_SURFACE)
+        return FALSE;
+
+    if (eglMakeCurrent(renderer->display, surface, surface, renderer->context) != EGL_TRUE)
+        return FALSE;
+
+    eglSwapInterval(renderer->display, 0);
+    return TRUE;
+}
+
+static void *hwc_egl_display_init_thread(void *data)
+{
+    ScrnInfoPtr pScrn = (ScrnInfoPtr) data;
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+    int phase = hwc_startup_phase_begin(hwc, "EGL display");
+    EGLDisplay display;
+
+#ifdef ENABLE_MOCK_HAL
+    if (hwc->mockHal)
+        display = hwc_mock_hal_get_display(pScrn);
+    else
+#endif
+        display = eglGetDisplay(NULL);
+
+    if (display != EGL_NO_DISPLAY && eglInitialize(display, 0, 0) != EGL_TRUE) {
+        ErrorF("hwcomposer: eglInitialize failed: 0x%x\n", eglGetError());
+        display = EGL_NO_DISPLAY;
+    }
+
+    renderer->display = display;
+    hwc_startup_phase_end(hwc, phase);
+    return NULL;
+}
+
+/*
+ * Start loading and initialising EGL, which is the slowest part of
+ * startup on most devices, while the HAL modules are being opened.
+ * hwc_egl_renderer_init waits for it.
+ */
+void hwc_egl_renderer_preinit(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+
+    hwc_startup_run(hwc, &hwc->eglDisplayTask, hwc_egl_display_init_thread, pScrn);
+}
+
 Bool hwc_egl_renderer_init(ScrnInfoPtr pScrn)
 {
     HWCPtr hwc = HWCPTR(pScrn);
@@ -131,25 +239,19 @@ Bool hwc_egl_renderer_init(ScrnInfoPtr pScrn)
     EGLBoolean rv;
     int err;
 
-    struct ANativeWindow *win = hwc_get_native_window(pScrn);
-
-    display = eglGetDisplay(NULL);
-    assert(eglGetError() == EGL_SUCCESS);
-    assert(display != EGL_NO_DISPLAY);
-    renderer->display = display;
+    hwc_startup_join(&hwc->eglDisplayTask);
+    display = renderer->display;
+    if (display == EGL_NO_DISPLAY)
+        return FALSE;
 
-    rv = eglInitialize(display, 0, 0);
+    rv = eglChooseConfig((EGLDisplay) display, attr, &ecfg, 1, &num_config);
     assert(eglGetError() == EGL_SUCCESS);
     assert(rv == EGL_TRUE);
 
-    eglChooseConfig((EGLDisplay) display, attr, &ecfg, 1, &num_config);
-    assert(eglGetError() == EGL_SUCCESS);
-    assert(rv == EGL_TRUE);
+    renderer->config = ecfg;
 
-    surface = eglCreateWindowSurface((EGLDisplay) display, ecfg, (EGLNativeWindowType)win, NULL);
-    assert(eglGetError() == EGL_SUCCESS);
+    surface = hwc_egl_renderer_create_surface(pScrn);
     assert(surface != EGL_NO_SURFACE);
-    renderer->surface = surface;
 
     context = eglCreateContext((EGLDisplay) display, ecfg, EGL_NO_CONTEXT, ctxattr);
     assert(eglGetError() == EGL_SUCCESS);
@@ -168,189 +270,737 @@ Bool hwc_egl_renderer_init(ScrnInfoPtr pScrn)
     printf("%s\n",version);
 
     glGenTextures(1, &renderer->rootTexture);
-    glGenTextures(1, &renderer->cursorTexture);
+    renderer->cursorTexture = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &renderer->maxTextureSize);
     renderer->image = EGL_NO_IMAGE_KHR;
-    renderer->rootShader.program = 0;
-    renderer->projShader.program = 0;
+    renderer->upload = FALSE;
+    renderer->unpackSubimage = epoxy_gl_version() >= 30 ||
+                               epoxy_has_gl_extension("GL_EXT_unpack_subimage");
+    memset(renderer->variants, 0, sizeof(renderer->variants));
+    renderer->variantsFailed = 0;
+    renderer->paletteTexture = 0;
+    renderer->gammaTexture = 0;
+    renderer->gammaActive = FALSE;
+    renderer->gammaDirty = FALSE;
+
+    hwc_program_cache_init(pScrn, hwc->shaderCacheDir);
 
     return TRUE;
 }
 
-void hwc_egl_renderer_screen_init(ScreenPtr pScreen)
+/*
+ * Texture storage for an uploaded root, split into tiles of at most
+ * GL_MAX_TEXTURE_SIZE. The first tile is rootTexture.
+ */
+static Bool hwc_egl_renderer_alloc_tiles(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+    const hwc_root_format *format = hwc->rootFormat;
+    int size = renderer->maxTextureSize;
+    int cols = (pScrn->virtualX + size - 1) / size;
+    int rows = (pScrn->virtualY + size - 1) / size;
+    int i;
+
+    renderer->tiles = calloc(cols * rows, sizeof(hwc_root_tile));
+    if (!renderer->tiles) {
+        xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "failed to allocate root texture tiles\n");
+        return FALSE;
+    }
+    renderer->numTiles = cols * rows;
+
+    for (i = 0; i < renderer->numTiles; i++) {
+        hwc_root_tile *tile = &renderer->tiles[i];
+
+        tile->box.x1 = (i % cols) * size;
+        tile->box.y1 = (i / cols) * size;
+        tile->box.x2 = min(tile->box.x1 + size, pScrn->virtualX);
+        tile->box.y2 = min(tile->box.y1 + size, pScrn->virtualY);
+        RegionNull(&tile->pending);
+
+        if (i == 0) {
+            tile->texture = renderer->rootTexture;
+        } else {
+            glGenTextures(1, &tile->texture);
+            glBindTexture(GL_TEXTURE_2D, tile->texture);
+            glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        }
+
+        glBindTexture(GL_TEXTURE_2D, tile->texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, format->glFormat,
+                     tile->box.x2 - tile->box.x1, tile->box.y2 - tile->box.y1,
+                     0, format->glFormat, format->glType, NULL);
+    }
+
+    if (renderer->numTiles > 1)
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                   "%dx%d root exceeds GL_MAX_TEXTURE_SIZE %d, split into %dx%d textures\n",
+                   pScrn->virtualX, pScrn->virtualY, size, cols, rows);
+    return TRUE;
+}
+
+static void hwc_egl_renderer_free_tiles(hwc_renderer_ptr renderer)
+{
+    int i;
+
+    for (i = 0; i < renderer->numTiles; i++) {
+        RegionUninit(&renderer->tiles[i].pending);
+        if (i > 0)
+            glDeleteTextures(1, &renderer->tiles[i].texture);
+    }
+    free(renderer->tiles);
+    renderer->tiles = NULL;
+    renderer->numTiles = 0;
+}
+
+/*
+ * Point the root texture at the current root buffer, or give it storage
+ * for uploads. Called again after the root buffer was reallocated for a
+ * new screen size. Linear filtering smooths the upscale when the view
+ * is smaller than the panel, as with Option "RenderScale".
+ */
+void hwc_egl_renderer_bind_root(ScrnInfoPtr pScrn)
 {
-    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
     HWCPtr hwc = HWCPTR(pScrn);
     hwc_renderer_ptr renderer = &hwc->renderer;
 
     glBindTexture(GL_TEXTURE_2D, renderer->rootTexture);
     glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-    if (!hwc->glamor && renderer->image == EGL_NO_IMAGE_KHR) {
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    if (!hwc->glamor && renderer->upload) {
+        if (!renderer->rootStorage)
+            renderer->rootStorage = hwc_egl_renderer_alloc_tiles(pScrn);
+        renderer->uploadAll = TRUE;
+    } else if (!hwc->glamor && renderer->image == EGL_NO_IMAGE_KHR) {
         renderer->image = renderer->eglCreateImageKHR(renderer->display, EGL_NO_CONTEXT, EGL_NATIVE_BUFFER_HYBRIS,
                                             (EGLClientBuffer)hwc->buffer, NULL);
         renderer->glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, renderer->image);
     }
+}
 
-    if (!renderer->rootShader.program) {
-        GLuint prog;
-        renderer->rootShader.program = prog =
-            hwc_link_program(vertex_src, hwc->glamor ? fragment_src : fragment_src_bgra);
+/* The variant key of the root format, without gamma LUT or cursor */
+static unsigned hwc_root_variant_key(HWCPtr hwc)
+{
+    const hwc_root_format *format = hwc->rootFormat;
+
+    if (hwc->glamor)
+        return 0;
+    if (format->indexed)
+        return HWC_SHADER_INDEXED;
+    if (format->swizzle)
+        return HWC_SHADER_SWIZZLE;
+    return 0;
+}
 
-        if (!prog) {
-            xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
-                       "hwc_egl_renderer_screen_init: failed to link root window shader\n");
-        }
+/* The cursor image is uploaded as ARGB words, BGRA bytes, except with glamor */
+static unsigned hwc_cursor_variant_key(HWCPtr hwc)
+{
+    return HWC_SHADER_CURSOR | (hwc->glamor ? 0 : HWC_SHADER_CURSOR_SWIZZLE);
+}
 
-        renderer->rootShader.position  = glGetAttribLocation(prog, "position");
-        renderer->rootShader.texcoords = glGetAttribLocation(prog, "texcoords");
-        renderer->rootShader.texture = glGetUniformLocation(prog, "texture");
+/*
+ * The composition shader variant for key, generated and linked the first
+ * time it is asked for (the program binary cache usually has it). Its
+ * samplers are bound to their texture units once here: the root on 0,
+ * palette 1, gamma LUT 2 and cursor 3. Returns NULL if it doesn't link.
+ */
+static hwc_renderer_shader *hwc_egl_renderer_variant(ScrnInfoPtr pScrn, unsigned key)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+    hwc_renderer_shader *shader = &renderer->variants[key];
+    char vertex[HWC_SHADER_SRC_SIZE], fragment[HWC_SHADER_SRC_SIZE], name[32];
+    GLuint prog;
+
+    if (shader->program)
+        return shader;
+    if (renderer->variantsFailed & (1u << key))
+        return NULL;
+
+    hwc_shader_variant_vertex_src(key, vertex, sizeof(vertex));
+    hwc_shader_variant_fragment_src(key, fragment, sizeof(fragment));
+    hwc_shader_variant_name(key, name, sizeof(name));
+
+    shader->program = prog = hwc_link_program(vertex, fragment);
+    if (!prog) {
+        xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+                   "failed to link %s composition shader\n", name);
+        renderer->variantsFailed |= 1u << key;
+        return NULL;
     }
+    xf86DrvMsgVerb(pScrn->scrnIndex, X_INFO, 3, "linked %s composition shader\n", name);
+
+    shader->position  = glGetAttribLocation(prog, "position");
+    shader->texcoords = glGetAttribLocation(prog, "texcoords");
+    shader->cursorcoords = glGetAttribLocation(prog, "cursorcoords");
+    shader->texture = glGetUniformLocation(prog, "texture");
+    shader->palette = glGetUniformLocation(prog, "palette");
+    shader->gamma = glGetUniformLocation(prog, "gamma");
+    shader->cursor = glGetUniformLocation(prog, "cursor");
+
+    glUseProgram(prog);
+    glUniform1i(shader->texture, 0);
+    glUniform1i(shader->palette, 1);
+    glUniform1i(shader->gamma, 2);
+    glUniform1i(shader->cursor, 3);
+
+    return shader;
+}
 
-    if (!renderer->projShader.program) {
-        GLuint prog;
-        renderer->projShader.program = prog =
-            hwc_link_program(vertex_mvp_src, hwc->glamor ? fragment_src : fragment_src_bgra);
+void hwc_egl_renderer_screen_init(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+    const hwc_root_format *format = hwc->rootFormat;
+    int phase;
+
+    hwc_egl_renderer_bind_root(pScrn);
+
+    if (format->indexed && !renderer->paletteTexture) {
+        glGenTextures(1, &renderer->paletteTexture);
+        glBindTexture(GL_TEXTURE_2D, renderer->paletteTexture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 256, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        renderer->paletteDirty = TRUE;
+    }
+
+    /* the variants the first frames need, the gamma ones follow a ramp */
+    phase = hwc_startup_phase_begin(hwc, "shaders");
+    hwc_egl_renderer_variant(pScrn, hwc_root_variant_key(hwc));
+    hwc_egl_renderer_variant(pScrn, hwc_root_variant_key(hwc) | hwc_cursor_variant_key(hwc));
+    hwc_startup_phase_end(hwc, phase);
+
+    eglSwapInterval(renderer->display, 0);
+}
 
-        if (!prog) {
-            xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
-                       "hwc_egl_renderer_screen_init: failed to link cursor shader\n");
+/*
+ * Upload the rectangles of region, all inside tile, to the tile's texture.
+ * With GL_UNPACK_ROW_LENGTH each rectangle is a single upload. Without
+ * it, rectangles are uploaded as whole rows when the tile spans the full
+ * stride, or one row at a time otherwise. Returns the bytes uploaded.
+ */
+static uint64_t hwc_egl_renderer_upload_tile(HWCPtr hwc, const uint8_t *pixels,
+                                             const hwc_root_tile *tile, RegionPtr region)
+{
+    const hwc_root_format *format = hwc->rootFormat;
+    size_t pitch = (size_t) hwc->stride * format->cpp;
+    int tileWidth = tile->box.x2 - tile->box.x1;
+    const BoxRec *box = RegionRects(region);
+    int i, n = RegionNumRects(region), y;
+    uint64_t bytes = 0;
+
+    glBindTexture(GL_TEXTURE_2D, tile->texture);
+
+    for (i = 0; i < n; i++) {
+        int x1 = box[i].x1, y1 = box[i].y1, x2 = box[i].x2, y2 = box[i].y2;
+
+        if (hwc->renderer.unpackSubimage) {
+            glTexSubImage2D(GL_TEXTURE_2D, 0, x1 - tile->box.x1, y1 - tile->box.y1,
+                            x2 - x1, y2 - y1, format->glFormat, format->glType,
+                            pixels + y1 * pitch + (size_t) x1 * format->cpp);
+        } else if (hwc->stride == tileWidth) {
+            x1 = tile->box.x1;
+            x2 = tile->box.x2;
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, y1 - tile->box.y1, tileWidth, y2 - y1,
+                            format->glFormat, format->glType, pixels + y1 * pitch);
+        } else {
+            for (y = y1; y < y2; y++)
+                glTexSubImage2D(GL_TEXTURE_2D, 0, x1 - tile->box.x1, y - tile->box.y1,
+                                x2 - x1, 1, format->glFormat, format->glType,
+                                pixels + y * pitch + (size_t) x1 * format->cpp);
         }
+        bytes += (uint64_t) (x2 - x1) * (y2 - y1) * format->cpp;
+    }
+
+    return bytes;
+}
+
+/*
+ * Copy what changed in the root buffer into the root textures, for
+ * buffers that can't be bound as an EGLImage. A root without a gralloc
+ * buffer is in system memory, in hwc->shadow.
+ *
+ * Only damage inside the viewport, or the external display's, is
+ * uploaded. The rest is kept with its tile and uploaded once panning
+ * brings it into view.
+ */
+static void hwc_egl_renderer_upload(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+    const uint8_t *pixels = hwc->buffer ? hwc->rootPixels : hwc->shadow;
+    BoxRec screen = { 0, 0, pScrn->virtualX, pScrn->virtualY };
+    BoxRec view = { hwc->viewX, hwc->viewY,
+                    hwc->viewX + hwc->viewWidth, hwc->viewY + hwc->viewHeight };
+    hwc_external_display *ext = &hwc->external;
+    BoxRec extView = { ext->viewX, ext->viewY,
+                       ext->viewX + ext->viewWidth, ext->viewY + ext->viewHeight };
+    RegionRec damage, region, visible;
+    uint64_t bytes = 0;
+    int i;
+
+    if (!pixels || !renderer->tiles)
+        return;
+
+    RegionInit(&visible, &view, 1);
+    if (hwc_external_extended(hwc)) {
+        RegionInit(&region, &extView, 1);
+        RegionUnion(&visible, &visible, &region);
+        RegionUninit(&region);
+    }
 
-        renderer->projShader.position  = glGetAttribLocation(prog, "position");
-        renderer->projShader.texcoords = glGetAttribLocation(prog, "texcoords");
-        renderer->projShader.transform = glGetUniformLocation(prog, "transform");
-        renderer->projShader.texture = glGetUniformLocation(prog, "texture");
+    if (renderer->uploadAll || !hwc->trackFrameDamage) {
+        RegionInit(&damage, &screen, 1);
+        renderer->uploadAll = FALSE;
+    } else {
+        /* damage not yet seen by the block handler is included too */
+        RegionNull(&damage);
+        RegionUnion(&damage, &hwc->frameDamage, DamageRegion(hwc->damage));
     }
 
-    if (hwc->rotation == HWC_ROTATE_CW || hwc->rotation == HWC_ROTATE_CCW)
-        hwc_ortho_2d(renderer->projection, 0.0f, pScrn->virtualY, 0.0f, pScrn->virtualX);
-    else
-        hwc_ortho_2d(renderer->projection, 0.0f, pScrn->virtualX, 0.0f, pScrn->virtualY);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, hwc->rootFormat->cpp);
+    if (renderer->unpackSubimage)
+        glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, hwc->stride);
 
-    eglSwapInterval(renderer->display, 0);
+    for (i = 0; i < renderer->numTiles; i++) {
+        hwc_root_tile *tile = &renderer->tiles[i];
+
+        RegionInit(&region, &tile->box, 1);
+        RegionIntersect(&region, &region, &damage);
+        RegionUnion(&tile->pending, &tile->pending, &region);
+        RegionUninit(&region);
+
+        RegionNull(&region);
+        RegionIntersect(&region, &visible, &tile->pending);
+        if (RegionNotEmpty(&region)) {
+            bytes += hwc_egl_renderer_upload_tile(hwc, pixels, tile, &region);
+            RegionSubtract(&tile->pending, &tile->pending, &region);
+        }
+        RegionUninit(&region);
+    }
+
+    if (renderer->unpackSubimage)
+        glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    RegionUninit(&damage);
+    RegionUninit(&visible);
+
+    hwc_stats_upload(hwc, bytes);
 }
 
-void hwc_translate_cursor(hwc_rotation rotation, int x, int y, int width, int height,
-                          int displayWidth, int displayHeight,
-                          float* vertices) {
-    int w = displayWidth, h = displayHeight;
-    int cw = width, ch = height;
-    int t;
-    int i = 0;
+/* Map a point of a viewport to clip space, for the given rotation */
+static void hwc_view_to_clip(const BoxRec *view, hwc_rotation rotation, int x, int y, GLfloat *out)
+{
+    GLfloat u = (GLfloat) x / (view->x2 - view->x1);
+    GLfloat v = (GLfloat) y / (view->y2 - view->y1);
 
-    #define P(x, y) vertices[i++] = x;  vertices[i++] = y; // Point vertex
     switch (rotation) {
     case HWC_ROTATE_NORMAL:
-        y = h - y - ch - 1;
-
-        P(x, y);
-        P(x + cw, y);
-        P(x, y + ch);
-        P(x + cw, y + ch);
+        out[0] = 2.0f * u - 1.0f;
+        out[1] = 1.0f - 2.0f * v;
         break;
     case HWC_ROTATE_CW:
-        t = x;
-        x = h - y - 1;
-        y = w - t - 1;
-
-        P(x - ch, y - cw);
-        P(x, y - cw);
-        P(x - ch, y);
-        P(x, y);
+        out[0] = 1.0f - 2.0f * v;
+        out[1] = 1.0f - 2.0f * u;
         break;
     case HWC_ROTATE_UD:
-        x = w - x - 1;
-
-        P(x - cw, y);
-        P(x, y);
-        P(x - cw, y + ch);
-        P(x, y + ch);
+        out[0] = 1.0f - 2.0f * u;
+        out[1] = 2.0f * v - 1.0f;
         break;
     case HWC_ROTATE_CCW:
-        t = x;
-        x = y;
-        y = t;
-
-        P(x, y);
-        P(x + ch, y);
-        P(x, y + cw);
-        P(x + ch, y + cw);
+        out[0] = 2.0f * v - 1.0f;
+        out[1] = 2.0f * u - 1.0f;
         break;
     }
-    #undef P
 }
 
-void hwc_egl_render_cursor(ScreenPtr pScreen) {
-    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+/*
+ * Draw rect, a part of the viewport, from a texture holding the root area
+ * box. cursor is the root area the cursor image covers when shader is a
+ * cursor variant, rect then lies within it.
+ */
+static void hwc_egl_renderer_draw_rect(const hwc_renderer_shader *shader, const BoxRec *view,
+                                       hwc_rotation rotation, const BoxRec *box,
+                                       const BoxRec *rect, const BoxRec *cursor)
+{
+    const int corners[4][2] = { { rect->x1, rect->y2 }, { rect->x2, rect->y2 },
+                                { rect->x1, rect->y1 }, { rect->x2, rect->y1 } };
+    GLfloat vertices[8], texcoords[8], cursorcoords[8];
+    int i;
+
+    if (rect->x1 >= rect->x2 || rect->y1 >= rect->y2)
+        return;
+
+    for (i = 0; i < 4; i++) {
+        hwc_view_to_clip(view, rotation, corners[i][0] - view->x1, corners[i][1] - view->y1,
+                         &vertices[i * 2]);
+        texcoords[i * 2] = (GLfloat) (corners[i][0] - box->x1) / (box->x2 - box->x1);
+        texcoords[i * 2 + 1] = (GLfloat) (corners[i][1] - box->y1) / (box->y2 - box->y1);
+        if (cursor) {
+            cursorcoords[i * 2] = (GLfloat) (corners[i][0] - cursor->x1) / (cursor->x2 - cursor->x1);
+            cursorcoords[i * 2 + 1] = (GLfloat) (corners[i][1] - cursor->y1) / (cursor->y2 - cursor->y1);
+        }
+    }
+
+    glUseProgram(shader->program);
+
+    glVertexAttribPointer(shader->position, 2, GL_FLOAT, 0, 0, vertices);
+    glEnableVertexAttribArray(shader->position);
+
+    glVertexAttribPointer(shader->texcoords, 2, GL_FLOAT, 0, 0, texcoords);
+    glEnableVertexAttribArray(shader->texcoords);
+
+    if (cursor) {
+        glVertexAttribPointer(shader->cursorcoords, 2, GL_FLOAT, 0, 0, cursorcoords);
+        glEnableVertexAttribArray(shader->cursorcoords);
+    }
+
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+    glDisableVertexAttribArray(shader->position);
+    glDisableVertexAttribArray(shader->texcoords);
+    if (cursor)
+        glDisableVertexAttribArray(shader->cursorcoords);
+}
+
+/*
+ * Draw the part of the viewport covered by a texture holding the root
+ * area box. Nothing outside the viewport is sampled. With an overlay
+ * variant, the part under the cursor is drawn with it and the rest
+ * around it with shader, so the cursor costs no extra pass and every
+ * pixel is still drawn once.
+ */
+static void hwc_egl_renderer_draw_root(const hwc_renderer_shader *shader,
+                                       const hwc_renderer_shader *overlay, const BoxRec *view,
+                                       hwc_rotation rotation, GLuint texture, const BoxRec *box,
+                                       const BoxRec *cursor)
+{
+    BoxRec area = { max(box->x1, view->x1), max(box->y1, view->y1),
+                    min(box->x2, view->x2), min(box->y2, view->y2) };
+    BoxRec under, band;
+
+    if (area.x1 >= area.x2 || area.y1 >= area.y2)
+        return;
+
+    glBindTexture(GL_TEXTURE_2D, texture);
+
+    if (overlay) {
+        under.x1 = max(area.x1, cursor->x1);
+        under.y1 = max(area.y1, cursor->y1);
+        under.x2 = min(area.x2, cursor->x2);
+        under.y2 = min(area.y2, cursor->y2);
+    }
+    if (!overlay || under.x1 >= under.x2 || under.y1 >= under.y2) {
+        hwc_egl_renderer_draw_rect(shader, view, rotation, box, &area, NULL);
+        return;
+    }
+
+    /* above, left of, right of and below the cursor */
+    band = area;
+    band.y2 = under.y1;
+    hwc_egl_renderer_draw_rect(shader, view, rotation, box, &band, NULL);
+    band.y1 = under.y1;
+    band.y2 = under.y2;
+    band.x2 = under.x1;
+    hwc_egl_renderer_draw_rect(shader, view, rotation, box, &band, NULL);
+    band.x1 = under.x2;
+    band.x2 = area.x2;
+    hwc_egl_renderer_draw_rect(shader, view, rotation, box, &band, NULL);
+    band = area;
+    band.y1 = under.y2;
+    hwc_egl_renderer_draw_rect(shader, view, rotation, box, &band, NULL);
+
+    hwc_egl_renderer_draw_rect(overlay, view, rotation, box, &under, cursor);
+}
+
+/* Refresh the palette texture after the colormap changed */
+static void hwc_egl_renderer_upload_palette(HWCPtr hwc)
+{
+    hwc_renderer_ptr renderer = &hwc->renderer;
+    GLubyte palette[256 * 4];
+    int i;
+
+    /* LoadPalette gets 8 significant bits per channel at depth 8 */
+    for (i = 0; i < 256; i++) {
+        palette[i * 4 + 0] = hwc->colors[i].red;
+        palette[i * 4 + 1] = hwc->colors[i].green;
+        palette[i * 4 + 2] = hwc->colors[i].blue;
+        palette[i * 4 + 3] = 0xff;
+    }
+
+    glBindTexture(GL_TEXTURE_2D, renderer->paletteTexture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 256, 1, GL_RGBA, GL_UNSIGNED_BYTE, palette);
+    renderer->paletteDirty = FALSE;
+}
+
+/*
+ * RandR gamma ramp of the panel's CRTC. An identity ramp turns the LUT
+ * off, so the plain shaders are used and it costs nothing.
+ */
+void hwc_egl_renderer_set_gamma(ScrnInfoPtr pScrn, const CARD16 *red, const CARD16 *green,
+                                const CARD16 *blue, int size)
+{
     HWCPtr hwc = HWCPTR(pScrn);
     hwc_renderer_ptr renderer = &hwc->renderer;
+    Bool identity = TRUE;
+    int i;
+
+    if (size < 2)
+        return;
+
+    for (i = 0; i < 256; i++) {
+        int j = i * (size - 1) / 255;
+        int expected = j * 255 / (size - 1);
+        GLubyte *texel = &renderer->gamma[i * 4];
+
+        texel[0] = red[j] >> 8;
+        texel[1] = green[j] >> 8;
+        texel[2] = blue[j] >> 8;
+        texel[3] = 0xff;
+        if (abs(texel[0] - expected) > 1 || abs(texel[1] - expected) > 1 ||
+            abs(texel[2] - expected) > 1)
+            identity = FALSE;
+    }
+
+    if (identity != !renderer->gammaActive)
+        xf86DrvMsgVerb(pScrn->scrnIndex, X_INFO, 3, "gamma LUT %s\n",
+                       identity ? "off" : "on");
+    renderer->gammaActive = !identity;
+    renderer->gammaDirty = TRUE;
+    __atomic_store_n(&hwc->dirty, TRUE, __ATOMIC_RELEASE);
+}
 
-    glUseProgram(renderer->projShader.program);
+/*
+ * Get the gamma LUT ready on texture unit 2, linking the root's gamma
+ * variant the first time a ramp is set. Returns FALSE to draw without it.
+ */
+static Bool hwc_egl_renderer_prepare_gamma(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+
+    if (!renderer->gammaActive)
+        return FALSE;
+
+    if (!hwc_egl_renderer_variant(pScrn, hwc_root_variant_key(hwc) | HWC_SHADER_GAMMA)) {
+        renderer->gammaActive = FALSE;
+        return FALSE;
+    }
 
-    glBindTexture(GL_TEXTURE_2D, renderer->cursorTexture);
-    glUniform1i(renderer->projShader.texture, 0);
+    glActiveTexture(GL_TEXTURE2);
+    if (!renderer->gammaTexture) {
+        glGenTextures(1, &renderer->gammaTexture);
+        glBindTexture(GL_TEXTURE_2D, renderer->gammaTexture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 256, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    }
+    glBindTexture(GL_TEXTURE_2D, renderer->gammaTexture);
+    if (renderer->gammaDirty) {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 256, 1, GL_RGBA, GL_UNSIGNED_BYTE,
+                        renderer->gamma);
+        renderer->gammaDirty = FALSE;
+    }
+    glActiveTexture(GL_TEXTURE0);
 
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    glEnable(GL_BLEND);
+    return TRUE;
+}
 
-    hwc_translate_cursor(hwc->rotation, hwc->cursorX, hwc->cursorY,
-                         hwc->cursorWidth, hwc->cursorHeight,
-                         pScrn->virtualX, pScrn->virtualY,
-                         cursorVertices);
+/*
+ * Draw the view part of the root, filling the current surface, with the
+ * cursor over it unless cursor is NULL. The cursor position is relative
+ * to the view.
+ */
+static void hwc_egl_renderer_draw_view(ScrnInfoPtr pScrn, const BoxRec *view,
+                                       hwc_rotation rotation, Bool gamma,
+                                       const hwc_cursor_state *cursor)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+    unsigned key = hwc_root_variant_key(hwc) | (gamma ? HWC_SHADER_GAMMA : 0);
+    hwc_renderer_shader *shader = hwc_egl_renderer_variant(pScrn, key);
+    hwc_renderer_shader *overlay = NULL;
+    BoxRec screen = { 0, 0, pScrn->virtualX, pScrn->virtualY };
+    BoxRec cursorBox;
+    int i;
+
+    if (!shader)
+        return;
+
+    if (cursor && renderer->cursorTexture)
+        overlay = hwc_egl_renderer_variant(pScrn, key | hwc_cursor_variant_key(hwc));
+    if (overlay) {
+        cursorBox.x1 = view->x1 + cursor->x;
+        cursorBox.y1 = view->y1 + cursor->y;
+        cursorBox.x2 = cursorBox.x1 + hwc->cursorWidth;
+        cursorBox.y2 = cursorBox.y1 + hwc->cursorHeight;
+        glActiveTexture(GL_TEXTURE3);
+        glBindTexture(GL_TEXTURE_2D, renderer->cursorTexture);
+    }
 
-    glVertexAttribPointer(renderer->projShader.position, 2, GL_FLOAT, 0, 0, cursorVertices);
-    glEnableVertexAttribArray(renderer->projShader.position);
+    if (hwc->rootFormat->indexed) {
+        glActiveTexture(GL_TEXTURE1);
+        if (renderer->paletteDirty)
+            hwc_egl_renderer_upload_palette(hwc);
+        glBindTexture(GL_TEXTURE_2D, renderer->paletteTexture);
+    }
 
-    glVertexAttribPointer(renderer->projShader.texcoords, 2, GL_FLOAT, 0, 0, textureVertices[hwc->rotation]);
-    glEnableVertexAttribArray(renderer->projShader.texcoords);
+    glActiveTexture(GL_TEXTURE0);
 
-    glUniformMatrix4fv(renderer->projShader.transform, 1, GL_FALSE, renderer->projection);
+    if (renderer->tiles) {
+        for (i = 0; i < renderer->numTiles; i++)
+            hwc_egl_renderer_draw_root(shader, overlay, view, rotation,
+                                       renderer->tiles[i].texture, &renderer->tiles[i].box,
+                                       &cursorBox);
+    } else {
+        hwc_egl_renderer_draw_root(shader, overlay, view, rotation, renderer->rootTexture,
+                                   &screen, &cursorBox);
+    }
+}
 
-    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+static Bool hwc_egl_renderer_create_external(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+    hwc_external_display *ext = &hwc->external;
+
+    ext->window = hwc_get_external_window(pScrn);
+    if (ext->window)
+        ext->surface = eglCreateWindowSurface(renderer->display, renderer->config,
+                                              (EGLNativeWindowType) ext->window, NULL);
+    if (ext->surface == EGL_NO_SURFACE) {
+        xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+                   "failed to create a %dx%d EGL surface for the external display\n",
+                   ext->width, ext->height);
+        hwc_egl_renderer_destroy_external(pScrn);
+        return FALSE;
+    }
 
-    glDisable(GL_BLEND);
-    glDisableVertexAttribArray(renderer->projShader.position);
-    glDisableVertexAttribArray(renderer->projShader.texcoords);
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "external display swap chain %dx%d\n",
+               ext->width, ext->height);
+    return TRUE;
 }
 
-void hwc_egl_renderer_update(ScreenPtr pScreen)
+/* Free the external display's swap chain, recreated when next composed */
+void hwc_egl_renderer_destroy_external(ScrnInfoPtr pScrn)
 {
-    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
     HWCPtr hwc = HWCPTR(pScrn);
     hwc_renderer_ptr renderer = &hwc->renderer;
+    hwc_external_display *ext = &hwc->external;
 
-    if (hwc->glamor) {
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
-        glViewport(0, 0, hwc->hwcWidth, hwc->hwcHeight);
+    if (ext->surface != EGL_NO_SURFACE) {
+        eglDestroySurface(renderer->display, ext->surface);
+        ext->surface = EGL_NO_SURFACE;
     }
+    if (ext->window) {
+        hwc_destroy_native_window(ext->window);
+        ext->window = NULL;
+    }
+}
 
-    glUseProgram(renderer->rootShader.program);
+/*
+ * Compose the external display's part of the root into its own swap
+ * chain, scaled to the display. The context is shared with the panel's
+ * surface, which is made current again afterwards.
+ */
+static void hwc_egl_renderer_update_external(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+    hwc_external_display *ext = &hwc->external;
+    BoxRec view = { ext->viewX, ext->viewY,
+                    ext->viewX + ext->viewWidth, ext->viewY + ext->viewHeight };
+    hwc_cursor_state cursor;
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, renderer->rootTexture);
-    glUniform1i(renderer->rootShader.texture, 0);
+    if (ext->surface == EGL_NO_SURFACE && !hwc_egl_renderer_create_external(pScrn))
+        return;
 
-    glVertexAttribPointer(renderer->rootShader.position, 2, GL_FLOAT, 0, 0, squareVertices);
-    glEnableVertexAttribArray(renderer->rootShader.position);
+    if (eglMakeCurrent(renderer->display, ext->surface, ext->surface,
+                       renderer->context) != EGL_TRUE)
+        return;
+    eglSwapInterval(renderer->display, 0);
 
-    glVertexAttribPointer(renderer->rootShader.texcoords, 2, GL_FLOAT, 0, 0, textureVertices[hwc->rotation]);
-    glEnableVertexAttribArray(renderer->rootShader.texcoords);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(0, 0, ext->width, ext->height);
 
-    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    hwc_cursor_snapshot(&ext->cursorState, &cursor);
+    hwc_egl_renderer_draw_view(pScrn, &view, HWC_ROTATE_NORMAL, FALSE,
+                               cursor.shown ? &cursor : NULL);
+    hwc_stats_bytes(hwc, (uint64_t) ext->viewWidth * ext->viewHeight * hwc->rootFormat->cpp,
+                    (uint64_t) ext->width * ext->height * 4);
+
+    eglSwapBuffers(renderer->display, ext->surface);
+
+    eglMakeCurrent(renderer->display, renderer->surface, renderer->surface, renderer->context);
+    glViewport(0, 0, hwc->hwcWidth, hwc->hwcHeight);
+}
+
+/*
+ * Compose a frame for the panel (primary) and/or the external display
+ * when it shows a part of the root of its own (external). Uploads are
+ * shared between them.
+ */
+void hwc_egl_renderer_update(ScreenPtr pScreen, Bool primary, Bool external)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+    BoxRec view = { hwc->viewX, hwc->viewY,
+                    hwc->viewX + hwc->viewWidth, hwc->viewY + hwc->viewHeight };
+    hwc_cursor_state cursor;
+    Bool gamma;
+
+    if (!hwc->glamor && renderer->upload)
+        hwc_egl_renderer_upload(pScreen);
+
+    if (external)
+        hwc_egl_renderer_update_external(pScrn);
 
-    glDisableVertexAttribArray(renderer->rootShader.position);
-    glDisableVertexAttribArray(renderer->rootShader.texcoords);
+    if (!primary)
+        return;
 
-    if (hwc->cursorShown)
-        hwc_egl_render_cursor(pScreen);
+    if (hwc->glamor) {
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, hwc->hwcWidth, hwc->hwcHeight);
+    }
 
+    gamma = hwc_egl_renderer_prepare_gamma(pScrn);
+    hwc_cursor_snapshot(&hwc->cursorState, &cursor);
+    hwc_egl_renderer_draw_view(pScrn, &view, hwc->rotation, gamma,
+                               cursor.shown ? &cursor : NULL);
+
+    hwc_stats_bytes(hwc, (uint64_t) hwc->viewWidth * hwc->viewHeight * hwc->rootFormat->cpp,
+                    (uint64_t) hwc->hwcWidth * hwc->hwcHeight * 4);
+    /* drawn in the same pass, only the cursor image is read in addition */
+    if (cursor.shown)
+        hwc_stats_bytes(hwc, (uint64_t) hwc->cursorWidth * hwc->cursorHeight * 4, 0);
+
+    /* before the swap, which on hybris runs HWComposer set() itself */
+    hwc_latency_mark_swap(hwc);
     eglSwapBuffers (renderer->display, renderer->surface );  // get the rendered buffer to the screen
+
+#ifdef ENABLE_MOCK_HAL
+    if (hwc->mockHal)
+        hwc_mock_hal_present(pScrn);
+#endif
 }
 
-void hwc_egl_renderer_screen_close(ScreenPtr pScreen)
+/* Drop everything referring to the root buffer before it is released */
+void hwc_egl_renderer_release_root(ScrnInfoPtr pScrn)
 {
-    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
     HWCPtr hwc = HWCPTR(pScrn);
     hwc_renderer_ptr renderer = &hwc->renderer;
 
@@ -358,8 +1008,56 @@ void hwc_egl_renderer_screen_close(ScreenPtr pScreen)
         renderer->eglDestroyImageKHR(renderer->display, renderer->image);
         renderer->image = EGL_NO_IMAGE_KHR;
     }
+    hwc_egl_renderer_free_tiles(renderer);
+    renderer->rootStorage = FALSE;
 }
 
+/*
+ * Counterpart of hwc_egl_renderer_init, called from FreeScreen. The
+ * renderer survives server regenerations, so this is the only place the
+ * GL objects and the EGL context are destroyed.
+ */
 void hwc_egl_renderer_close(ScrnInfoPtr pScrn)
 {
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_renderer_ptr renderer = &hwc->renderer;
+    int i;
+
+    hwc_startup_join(&hwc->eglDisplayTask);
+    if (renderer->display == EGL_NO_DISPLAY)
+        return;
+
+    if (renderer->context != EGL_NO_CONTEXT) {
+        hwc_egl_renderer_release_root(pScrn);
+        hwc_cursor_cache_close(pScrn);
+
+        for (i = 0; i < HWC_SHADER_VARIANTS; i++) {
+            if (renderer->variants[i].program)
+                glDeleteProgram(renderer->variants[i].program);
+            renderer->variants[i].program = 0;
+        }
+        renderer->variantsFailed = 0;
+
+        if (renderer->rootTexture && !hwc->glamor)
+            glDeleteTextures(1, &renderer->rootTexture);
+        renderer->rootTexture = 0;
+        if (renderer->paletteTexture)
+            glDeleteTextures(1, &renderer->paletteTexture);
+        renderer->paletteTexture = 0;
+        if (renderer->gammaTexture)
+            glDeleteTextures(1, &renderer->gammaTexture);
+        renderer->gammaTexture = 0;
+
+        eglMakeCurrent(renderer->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        eglDestroyContext(renderer->display, renderer->context);
+        renderer->context = EGL_NO_CONTEXT;
+    }
+
+    hwc_egl_renderer_destroy_surface(pScrn);
+    hwc_egl_renderer_destroy_external(pScrn);
+
+    eglTerminate(renderer->display);
+    renderer->display = EGL_NO_DISPLAY;
+
+    hwc_program_cache_close();
 }
@@ -1,3 +1,14 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include "xf86.h"
+
+#include "driver.h"
+
 const char vertex_src [] =
     "attribute vec4 position;\n"
     "attribute vec4 texcoords;\n"
@@ -9,18 +20,6 @@ const char vertex_src [] =
     "    textureCoordinate = texcoords.xy;\n"
     "}\n";
 
-const char vertex_mvp_src [] =
-    "attribute vec2 position;\n"
-    "attribute vec2 texcoords;\n"
-    "varying vec2 textureCoordinate;\n"
-    "uniform mat4 transform;\n"
-
-    "void main()\n"
-    "{\n"
-    "    gl_Position = transform * vec4(position, 0.0, 1.0);\n"
-    "    textureCoordinate = texcoords.xy;\n"
-    "}\n";
-
 const char fragment_src [] =
     "varying highp vec2 textureCoordinate;\n"
     "uniform sampler2D texture;\n"
@@ -30,11 +29,124 @@ const char fragment_src [] =
     "    gl_FragColor = texture2D(texture, textureCoordinate);\n"
     "}\n";
 
-const char fragment_src_bgra [] =
-    "varying highp vec2 textureCoordinate;\n"
-    "uniform sampler2D texture;\n"
+/*
+ * Composition shader variants. Every combination of root format, gamma
+ * LUT and cursor overlay gets a program of its own, generated from the
+ * HWC_SHADER_* bits of its key, so no variant tests or computes anything
+ * it doesn't need:
+ *
+ *  - the BGRA swizzle is folded into the texture fetch,
+ *  - an 8 bit indexed root looks its index up in the 256x1 palette
+ *    texture, with the texel center offset folded into one multiply-add,
+ *  - with the gamma LUT each channel is looked up in the 256x1 gamma
+ *    texture, likewise,
+ *  - the cursor variant blends the cursor image over the root in the
+ *    same pass, with its own texture coordinates. It is only drawn over
+ *    the cursor's rectangle, the rest of the view uses the variant
+ *    without it.
+ */
 
-    "void main()\n"
-    "{\n"
-    "    gl_FragColor = texture2D(texture, textureCoordinate).bgra;\n"
-    "}\n";
+/* 256 entry lookup of a [0, 1] value: value * (255 / 256) + 0.5 / 256 */
+#define LUT_SCALE "0.99609375"
+#define LUT_BIAS "0.001953125"
+
+static void hwc_shader_append(char *buf, size_t size, const char *fmt, ...)
+{
+    size_t len = strlen(buf);
+    va_list args;
+
+    if (len >= size)
+        return;
+    va_start(args, fmt);
+    vsnprintf(buf + len, size - len, fmt, args);
+    va_end(args);
+}
+
+void hwc_shader_variant_vertex_src(unsigned key, char *buf, size_t size)
+{
+    Bool cursor = (key & HWC_SHADER_CURSOR) != 0;
+
+    buf[0] = '\0';
+    hwc_shader_append(buf, size,
+        "attribute vec2 position;\n"
+        "attribute vec2 texcoords;\n"
+        "varying vec2 textureCoordinate;\n");
+    if (cursor)
+        hwc_shader_append(buf, size,
+            "attribute vec2 cursorcoords;\n"
+            "varying vec2 cursorCoordinate;\n");
+
+    hwc_shader_append(buf, size,
+        "void main()\n"
+        "{\n"
+        "    gl_Position = vec4(position, 0.0, 1.0);\n"
+        "    textureCoordinate = texcoords;\n"
+        "%s"
+        "}\n",
+        cursor ? "    cursorCoordinate = cursorcoords;\n" : "");
+}
+
+void hwc_shader_variant_fragment_src(unsigned key, char *buf, size_t size)
+{
+    const char *swizzle = (key & HWC_SHADER_SWIZZLE) ? ".bgra" : "";
+    const char *cursorSwizzle = (key & HWC_SHADER_CURSOR_SWIZZLE) ? ".bgra" : "";
+
+    buf[0] = '\0';
+    hwc_shader_append(buf, size,
+        "varying highp vec2 textureCoordinate;\n"
+        "uniform sampler2D texture;\n");
+    if (key & HWC_SHADER_INDEXED)
+        hwc_shader_append(buf, size, "uniform sampler2D palette;\n");
+    if (key & HWC_SHADER_CURSOR)
+        hwc_shader_append(buf, size,
+            "varying highp vec2 cursorCoordinate;\n"
+            "uniform sampler2D cursor;\n");
+    if (key & HWC_SHADER_GAMMA)
+        hwc_shader_append(buf, size,
+            "uniform sampler2D gamma;\n"
+            "lowp vec3 lut(lowp vec3 color)\n"
+            "{\n"
+            "    highp vec3 coord = color * " LUT_SCALE " + " LUT_BIAS ";\n"
+            "    return vec3(texture2D(gamma, vec2(coord.r, 0.5)).r,\n"
+            "                texture2D(gamma, vec2(coord.g, 0.5)).g,\n"
+            "                texture2D(gamma, vec2(coord.b, 0.5)).b);\n"
+            "}\n");
+
+    hwc_shader_append(buf, size,
+        "void main()\n"
+        "{\n");
+    if (key & HWC_SHADER_INDEXED)
+        hwc_shader_append(buf, size,
+            "    highp float index = texture2D(texture, textureCoordinate).r;\n"
+            "    lowp vec4 color = texture2D(palette, vec2(index * " LUT_SCALE " + " LUT_BIAS
+            ", 0.5));\n");
+    else
+        hwc_shader_append(buf, size,
+            "    lowp vec4 color = texture2D(texture, textureCoordinate)%s;\n", swizzle);
+    if (key & HWC_SHADER_GAMMA)
+        hwc_shader_append(buf, size, "    color.rgb = lut(color.rgb);\n");
+    if (key & HWC_SHADER_CURSOR) {
+        hwc_shader_append(buf, size,
+            "    lowp vec4 pointer = texture2D(cursor, cursorCoordinate)%s;\n", cursorSwizzle);
+        if (key & HWC_SHADER_GAMMA)
+            hwc_shader_append(buf, size, "    pointer.rgb = lut(pointer.rgb);\n");
+        /* what blending with GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA gives */
+        hwc_shader_append(buf, size, "    color = mix(color, pointer, pointer.a);\n");
+    }
+    hwc_shader_append(buf, size,
+        "    gl_FragColor = color;\n"
+        "}\n");
+}
+
+/* Short name of a variant for the log, like "bgra+gamma+cursor" */
+void hwc_shader_variant_name(unsigned key, char *buf, size_t size)
+{
+    buf[0] = '\0';
+    hwc_shader_append(buf, size, "%s",
+                      (key & HWC_SHADER_INDEXED) ? "indexed" :
+                      (key & HWC_SHADER_SWIZZLE) ? "bgra" : "rgba");
+    if (key & HWC_SHADER_GAMMA)
+        hwc_shader_append(buf, size, "+gamma");
+    if (key & HWC_SHADER_CURSOR)
+        hwc_shader_append(buf, size, "+cursor");
+}
@@ -0,0 +1,159 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "xf86.h"
+
+#include <sys/mman.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "driver.h"
+
+/*
+ * Shadow framebuffer, enabled with Option "ShadowFB". gralloc mappings are
+ * often uncached or write-combined, which makes every read fb does from
+ * the root pixmap (blending, scrolling, CopyArea) very slow. In shadow
+ * mode fb draws into cached anonymous memory with the same layout as the
+ * root buffer, and hwc_update copies the damaged rectangles across
+ * before composing, using only sequential streaming writes on the
+ * gralloc side.
+ */
+
+#define HWC_HUGE_PAGE_SIZE (2 << 20)
+
+static void hwc_shadow_copy_row(uint8_t *dst, const uint8_t *src, size_t len)
+{
+#if defined(__SSE2__)
+    /* non-temporal stores don't pull write-combined lines into the cache */
+    while (len && ((uintptr_t) dst & 15)) {
+        *dst++ = *src++;
+        len--;
+    }
+    for (; len >= 64; len -= 64, src += 64, dst += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *) src);
+        __m128i b = _mm_loadu_si128((const __m128i *) (src + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *) (src + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *) (src + 48));
+        _mm_stream_si128((__m128i *) dst, a);
+        _mm_stream_si128((__m128i *) (dst + 16), b);
+        _mm_stream_si128((__m128i *) (dst + 32), c);
+        _mm_stream_si128((__m128i *) (dst + 48), d);
+    }
+    for (; len >= 16; len -= 16, src += 16, dst += 16)
+        _mm_stream_si128((__m128i *) dst, _mm_loadu_si128((const __m128i *) src));
+#elif defined(__ARM_NEON)
+    /* full 64 byte bursts keep the write-combining buffers happy */
+    for (; len >= 64; len -= 64, src += 64, dst += 64) {
+        uint8x16_t a = vld1q_u8(src);
+        uint8x16_t b = vld1q_u8(src + 16);
+        uint8x16_t c = vld1q_u8(src + 32);
+        uint8x16_t d = vld1q_u8(src + 48);
+        vst1q_u8(dst, a);
+        vst1q_u8(dst + 16, b);
+        vst1q_u8(dst + 32, c);
+        vst1q_u8(dst + 48, d);
+    }
+    for (; len >= 16; len -= 16, src += 16, dst += 16)
+        vst1q_u8(dst, vld1q_u8(src));
+#endif
+    memcpy(dst, src, len);
+}
+
+static void hwc_shadow_copy_box(HWCPtr hwc, int cpp, const BoxRec *box)
+{
+    size_t pitch = (size_t) hwc->stride * cpp;
+    size_t offset = (size_t) box->y1 * pitch + (size_t) box->x1 * cpp;
+    size_t len = (size_t) (box->x2 - box->x1) * cpp;
+    const uint8_t *src = (const uint8_t *) hwc->shadow + offset;
+    uint8_t *dst = (uint8_t *) hwc->rootPixels + offset;
+    int y;
+
+    for (y = box->y1; y < box->y2; y++, src += pitch, dst += pitch)
+        hwc_shadow_copy_row(dst, src, len);
+}
+
+Bool hwc_shadow_alloc(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    size_t size = (size_t) hwc->stride * pScrn->virtualY * (pScrn->bitsPerPixel / 8);
+    size_t huge = (size + HWC_HUGE_PAGE_SIZE - 1) & ~((size_t) HWC_HUGE_PAGE_SIZE - 1);
+    const char *kind = "huge pages";
+    void *mem;
+
+    if (hwc->shadow)
+        return TRUE;
+
+    mem = mmap(NULL, huge, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mem != MAP_FAILED) {
+        size = huge;
+    } else {
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+                       "failed to allocate %zu byte shadow framebuffer\n", size);
+            return FALSE;
+        }
+        kind = "transparent huge pages";
+        if (madvise(mem, size, MADV_HUGEPAGE) < 0)
+            kind = "regular pages";
+    }
+
+    hwc->shadow = mem;
+    hwc->shadowSize = size;
+
+    /* start from what the root buffer holds, a reused one is not blank */
+    if (hwc->rootPixels)
+        memcpy(hwc->shadow, hwc->rootPixels,
+               (size_t) hwc->stride * pScrn->virtualY * (pScrn->bitsPerPixel / 8));
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "shadow framebuffer: %zu kB in %s\n",
+               size / 1024, kind);
+    return TRUE;
+}
+
+void hwc_shadow_free(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+
+    if (hwc->shadow) {
+        munmap(hwc->shadow, hwc->shadowSize);
+        hwc->shadow = NULL;
+        hwc->shadowSize = 0;
+    }
+}
+
+/* Copy the damage accumulated since the last frame to the root buffer */
+void hwc_shadow_update(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    HWCPtr hwc = HWCPTR(pScrn);
+    int cpp = pScrn->bitsPerPixel / 8;
+    const BoxRec *box;
+    uint64_t start, bytes = 0;
+    int i, n;
+
+    if (!hwc->shadow || !hwc->rootPixels || !RegionNotEmpty(&hwc->frameDamage))
+        return;
+
+    start = hwc_stats_now_us();
+
+    box = RegionRects(&hwc->frameDamage);
+    n = RegionNumRects(&hwc->frameDamage);
+    for (i = 0; i < n; i++) {
+        hwc_shadow_copy_box(hwc, cpp, &box[i]);
+        bytes += (uint64_t) (box[i].x2 - box[i].x1) * (box[i].y2 - box[i].y1) * cpp;
+    }
+
+#if defined(__SSE2__)
+    _mm_sfence();
+#endif
+
+    hwc_stats_shadow(hwc, bytes, hwc_stats_now_us() - start);
+}
@@ -0,0 +1,115 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "xf86.h"
+
+#include "driver.h"
+
+/*
+ * Startup profile and helpers for running independent HAL initialisation
+ * steps concurrently.
+ *
+ * Phases may be opened and closed from worker threads, so they only take
+ * timestamps; everything is logged from the main thread at the PreInit,
+ * ScreenInit and first frame milestones. Overlapping phases in the log
+ * ran in parallel.
+ */
+
+void hwc_startup_begin(HWCPtr hwc)
+{
+    hwc_startup_profile *profile = &hwc->startup;
+
+    memset(profile, 0, sizeof(*profile));
+    profile->origin = hwc_stats_now_us();
+}
+
+int hwc_startup_phase_begin(HWCPtr hwc, const char *name)
+{
+    hwc_startup_profile *profile = &hwc->startup;
+    int idx;
+
+    if (profile->done)
+        return -1;
+
+    idx = __atomic_fetch_add(&profile->numPhases, 1, __ATOMIC_RELAXED);
+    if (idx >= HWC_STARTUP_PHASES)
+        return -1;
+
+    profile->phases[idx].name = name;
+    profile->phases[idx].start = hwc_stats_now_us();
+    return idx;
+}
+
+void hwc_startup_phase_end(HWCPtr hwc, int phase)
+{
+    if (phase >= 0)
+        __atomic_store_n(&hwc->startup.phases[phase].end, hwc_stats_now_us(),
+                         __ATOMIC_RELEASE);
+}
+
+/*
+ * Log the phases recorded since the last milestone, followed by the
+ * milestone itself. After the first frame the profile is complete and
+ * nothing more is recorded.
+ */
+void hwc_startup_log(ScrnInfoPtr pScrn, const char *milestone, Bool last)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_startup_profile *profile = &hwc->startup;
+    int num = __atomic_load_n(&profile->numPhases, __ATOMIC_RELAXED);
+    int i;
+
+    if (profile->done)
+        return;
+
+    if (num > HWC_STARTUP_PHASES)
+        num = HWC_STARTUP_PHASES;
+
+    for (i = profile->numLogged; i < num; i++) {
+        hwc_startup_phase *phase = &profile->phases[i];
+        uint64_t end = __atomic_load_n(&phase->end, __ATOMIC_ACQUIRE);
+
+        if (!end)
+            break;
+
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                   "startup: %-16s %8.1f ms .. %8.1f ms (%.1f ms)\n", phase->name,
+                   (phase->start - profile->origin) / 1000.0,
+                   (end - profile->origin) / 1000.0,
+                   (end - phase->start) / 1000.0);
+    }
+    profile->numLogged = i;
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "startup: %s at %.1f ms\n", milestone,
+               (hwc_stats_now_us() - profile->origin) / 1000.0);
+
+    profile->done = last;
+}
+
+/*
+ * Run fn on a worker thread when Option "ParallelInit" allows it, or
+ * inline otherwise (and if the thread can't be created).
+ */
+void hwc_startup_run(HWCPtr hwc, hwc_startup_task *task,
+                     void *(*fn)(void *), void *arg)
+{
+    task->running = FALSE;
+
+    if (hwc->parallelInit &&
+        pthread_create(&task->thread, NULL, fn, arg) == 0) {
+        task->running = TRUE;
+        return;
+    }
+
+    fn(arg);
+}
+
+void hwc_startup_join(hwc_startup_task *task)
+{
+    if (task->running) {
+        pthread_join(task->thread, NULL);
+        task->running = FALSE;
+    }
+}
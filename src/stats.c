@@ -0,0 +1,255 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "xf86.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "driver.h"
+
+/*
+ * Composition pipeline statistics, written as one JSON object per server
+ * generation to the file named by Option "StatsFile". Collection is off
+ * unless that option is set.
+ */
+
+uint64_t hwc_stats_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t hwc_stats_cpu_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Log-linear buckets: one per microsecond below 8us, then four per power
+ * of two, which keeps percentiles within 25% over the whole range.
+ */
+static int hwc_histogram_bucket(uint64_t us)
+{
+    int msb, idx;
+
+    if (us < 8)
+        return (int) us;
+
+    msb = 63 - __builtin_clzll(us);
+    idx = 8 + (msb - 3) * 4 + (int) ((us >> (msb - 2)) & 3);
+    return idx < HWC_HISTOGRAM_BUCKETS ? idx : HWC_HISTOGRAM_BUCKETS - 1;
+}
+
+static uint64_t hwc_histogram_bucket_start(int idx)
+{
+    int msb;
+
+    if (idx < 8)
+        return idx;
+
+    msb = (idx - 8) / 4 + 3;
+    return (uint64_t) (4 + (idx - 8) % 4) << (msb - 2);
+}
+
+void hwc_histogram_add(hwc_histogram *hist, uint64_t us)
+{
+    hist->buckets[hwc_histogram_bucket(us)]++;
+    hist->count++;
+    hist->sum += us;
+    if (us > hist->max)
+        hist->max = us;
+}
+
+uint64_t hwc_histogram_percentile(const hwc_histogram *hist, double p)
+{
+    uint64_t target, seen = 0;
+    int i;
+
+    if (!hist->count)
+        return 0;
+
+    target = (uint64_t) (p * hist->count);
+    if (target >= hist->count)
+        target = hist->count - 1;
+
+    for (i = 0; i < HWC_HISTOGRAM_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen > target) {
+            uint64_t lo = hwc_histogram_bucket_start(i);
+            uint64_t hi = i + 1 < HWC_HISTOGRAM_BUCKETS ?
+                          hwc_histogram_bucket_start(i + 1) : hist->max + 1;
+
+            /* middle of the bucket, but never past the largest sample */
+            lo = lo + (hi - lo) / 2;
+            return lo < hist->max ? lo : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+void hwc_histogram_write_json(FILE *f, const hwc_histogram *hist)
+{
+    fprintf(f, "{\"count\":%llu,\"mean\":%.1f,\"p50\":%llu,\"p90\":%llu,"
+               "\"p99\":%llu,\"max\":%llu}",
+            (unsigned long long) hist->count,
+            hist->count ? (double) hist->sum / hist->count : 0.0,
+            (unsigned long long) hwc_histogram_percentile(hist, 0.50),
+            (unsigned long long) hwc_histogram_percentile(hist, 0.90),
+            (unsigned long long) hwc_histogram_percentile(hist, 0.99),
+            (unsigned long long) hist->max);
+}
+
+void hwc_stats_init(ScrnInfoPtr pScrn, const char *file, Bool latency)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_stats *stats = &hwc->stats;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->file = file;
+    /* latency measurement relies on the damage timestamps */
+    stats->enabled = file != NULL || latency;
+    stats->start = hwc_stats_now_us();
+}
+
+/* May be called from the input thread */
+void hwc_stats_damage(HWCPtr hwc)
+{
+    uint64_t expected = 0;
+
+    if (!hwc->stats.enabled)
+        return;
+
+    /* only the oldest pending damage counts towards latency */
+    __atomic_compare_exchange_n(&hwc->stats.damageTime, &expected,
+                                hwc_stats_now_us(), FALSE,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+void hwc_stats_wakeup(HWCPtr hwc)
+{
+    if (hwc->stats.enabled)
+        hwc->stats.wakeups++;
+}
+
+void hwc_stats_frame_begin(HWCPtr hwc)
+{
+    hwc_stats *stats = &hwc->stats;
+
+    if (!stats->enabled)
+        return;
+
+    stats->frameCpuStart = hwc_stats_cpu_us();
+    /* damage arriving from here on belongs to the next frame */
+    stats->frameDamageTime = __atomic_exchange_n(&stats->damageTime, 0, __ATOMIC_RELAXED);
+    hwc_latency_begin(hwc, stats->frameDamageTime);
+}
+
+void hwc_stats_frame_end(HWCPtr hwc)
+{
+    hwc_stats *stats = &hwc->stats;
+
+    if (!stats->enabled)
+        return;
+
+    stats->frames++;
+    stats->cpuTime += hwc_stats_cpu_us() - stats->frameCpuStart;
+
+    if (stats->frameDamageTime)
+        hwc_histogram_add(&stats->latency, hwc_stats_now_us() - stats->frameDamageTime);
+}
+
+void hwc_stats_bytes(HWCPtr hwc, uint64_t sampled, uint64_t written)
+{
+    if (!hwc->stats.enabled)
+        return;
+
+    hwc->stats.bytesSampled += sampled;
+    hwc->stats.bytesWritten += written;
+}
+
+void hwc_stats_upload(HWCPtr hwc, uint64_t bytes)
+{
+    if (hwc->stats.enabled)
+        hwc->stats.bytesUploaded += bytes;
+}
+
+void hwc_stats_shadow(HWCPtr hwc, uint64_t bytes, uint64_t us)
+{
+    if (!hwc->stats.enabled)
+        return;
+
+    hwc->stats.shadowBytes += bytes;
+    hwc->stats.shadowTime += us;
+}
+
+void hwc_stats_write(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_stats *stats = &hwc->stats;
+    double duration;
+    FILE *f;
+
+    if (!stats->enabled || !stats->file)
+        return;
+
+    f = fopen(stats->file, "a");
+    if (!f) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING, "failed to open stats file %s: %s\n",
+                   stats->file, strerror(errno));
+        return;
+    }
+
+    duration = (hwc_stats_now_us() - stats->start) / 1e6;
+
+    fprintf(f, "{\"generation\":%lu,\"duration_s\":%.3f,\"frames\":%llu,"
+               "\"cpu_ms_per_frame\":%.3f,",
+            serverGeneration, duration,
+            (unsigned long long) stats->frames,
+            stats->frames ? stats->cpuTime / 1000.0 / stats->frames : 0.0);
+    fprintf(f, "\"bytes_sampled\":%llu,\"bytes_written\":%llu,\"bytes_uploaded\":%llu,"
+               "\"wakeups_per_s\":%.2f,\"damage_to_present_us\":",
+            (unsigned long long) stats->bytesSampled,
+            (unsigned long long) stats->bytesWritten,
+            (unsigned long long) stats->bytesUploaded,
+            duration > 0 ? stats->wakeups / duration : 0.0);
+    hwc_histogram_write_json(f, &stats->latency);
+    if (hwc->shadow) {
+        fprintf(f, ",\"shadow_bytes\":%llu,\"shadow_copy_us\":%llu",
+                (unsigned long long) stats->shadowBytes,
+                (unsigned long long) stats->shadowTime);
+    }
+    if (hwc->tileHash.enabled) {
+        fprintf(f, ",\"tile_hash\":");
+        hwc_tilehash_write_json(f, hwc);
+    }
+    if (hwc->fbThreads.numThreads > 1) {
+        fprintf(f, ",\"fb_threads\":");
+        hwc_fb_threads_write_json(f, hwc);
+    }
+    if (hwc->glAccel.enabled) {
+        fprintf(f, ",\"gl_accel\":");
+        hwc_glaccel_write_json(f, hwc);
+    }
+    if (hwc->latency.enabled) {
+        fprintf(f, ",\"latency\":");
+        hwc_latency_write_json(f, hwc);
+    }
+#ifdef ENABLE_MOCK_HAL
+    if (hwc->mock) {
+        fprintf(f, ",\"mock_hal\":");
+        hwc_mock_hal_write_json(f, pScrn);
+    }
+#endif
+    fprintf(f, "}\n");
+
+    fclose(f);
+}
@@ -0,0 +1,351 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "xf86.h"
+
+#include <stdlib.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "driver.h"
+
+/*
+ * Change detection for damage, enabled with Option "TileHash".
+ *
+ * Plenty of clients repaint identical content (a clock redrawing the same
+ * second, toolkits repainting unchanged widgets), which still damages the
+ * root pixmap and costs a full composition. The root is split into
+ * HWC_TILE_SIZE square tiles with a 64 bit hash each. When damage comes in,
+ * hwcBlockHandler hashes the tiles it touches; damage rectangles whose tiles
+ * all hash the same as before are dropped, and if nothing is left the
+ * screen isn't marked dirty at all.
+ *
+ * Hashing reads the pixels fb draws into, which is slow on uncached
+ * gralloc mappings; it works best together with Option "ShadowFB".
+ */
+
+#define HWC_TILE_SIZE 64
+
+#define HWC_TILE_KNOWN   (1 << 0)
+#define HWC_TILE_HASHED  (1 << 1)
+#define HWC_TILE_CHANGED (1 << 2)
+
+#define HWC_HASH_PRIME1 0x9e3779b185ebca87ULL
+#define HWC_HASH_PRIME2 0xc2b2ae3d27d4eb4fULL
+
+static uint64_t hwc_tilehash_avalanche(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= HWC_HASH_PRIME2;
+    h ^= h >> 29;
+    h *= HWC_HASH_PRIME1;
+    h ^= h >> 32;
+    return h;
+}
+
+/*
+ * Accumulate len bytes into the two 64 bit lanes of acc, 16 bytes at a
+ * time, in the style of XXH3: each stripe is mixed with a key that depends
+ * on its position, so moved content changes the hash too.
+ */
+#if defined(__SSE2__)
+static void hwc_tilehash_row(uint64_t *acc, const uint8_t *p, size_t len)
+{
+    __m128i a = _mm_loadu_si128((const __m128i *) acc);
+    __m128i key = _mm_set_epi64x(HWC_HASH_PRIME2, HWC_HASH_PRIME1);
+    const __m128i step = _mm_set1_epi32(0x27d4eb2f);
+
+    for (; len >= 16; len -= 16, p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        __m128i dk = _mm_xor_si128(v, key);
+        __m128i prod = _mm_mul_epu32(dk, _mm_srli_epi64(dk, 32));
+
+        a = _mm_add_epi64(a, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+        a = _mm_add_epi64(a, prod);
+        key = _mm_add_epi32(key, step);
+    }
+    _mm_storeu_si128((__m128i *) acc, a);
+
+    for (; len; len--, p++)
+        acc[len & 1] = (acc[len & 1] ^ *p) * HWC_HASH_PRIME1;
+}
+#elif defined(__ARM_NEON)
+static void hwc_tilehash_row(uint64_t *acc, const uint8_t *p, size_t len)
+{
+    uint64x2_t a = vld1q_u64(acc);
+    uint64x2_t key = vcombine_u64(vcreate_u64(HWC_HASH_PRIME1), vcreate_u64(HWC_HASH_PRIME2));
+    const uint32x4_t step = vdupq_n_u32(0x27d4eb2f);
+
+    for (; len >= 16; len -= 16, p += 16) {
+        uint64x2_t v = vreinterpretq_u64_u8(vld1q_u8(p));
+        uint64x2_t dk = veorq_u64(v, key);
+        uint64x2_t prod = vmull_u32(vmovn_u64(dk), vshrn_n_u64(dk, 32));
+
+        a = vaddq_u64(a, vextq_u64(v, v, 1));
+        a = vaddq_u64(a, prod);
+        key = vreinterpretq_u64_u32(vaddq_u32(vreinterpretq_u32_u64(key), step));
+    }
+    vst1q_u64(acc, a);
+
+    for (; len; len--, p++)
+        acc[len & 1] = (acc[len & 1] ^ *p) * HWC_HASH_PRIME1;
+}
+#else
+static void hwc_tilehash_row(uint64_t *acc, const uint8_t *p, size_t len)
+{
+    uint64_t key[2] = { HWC_HASH_PRIME1, HWC_HASH_PRIME2 };
+
+    for (; len >= 16; len -= 16, p += 16) {
+        uint64_t v[2];
+        int i;
+
+        memcpy(v, p, sizeof(v));
+        for (i = 0; i < 2; i++) {
+            uint64_t dk = v[i] ^ key[i];
+
+            acc[i] += v[i ^ 1] + (dk & 0xffffffff) * (dk >> 32);
+            key[i] += 0x27d4eb2f27d4eb2fULL;
+        }
+    }
+
+    for (; len; len--, p++)
+        acc[len & 1] = (acc[len & 1] ^ *p) * HWC_HASH_PRIME1;
+}
+#endif
+
+static uint64_t hwc_tilehash_tile(HWCPtr hwc, const uint8_t *pixels, int cpp,
+                                  int tx, int ty, int width, int height)
+{
+    size_t pitch = (size_t) hwc->stride * cpp;
+    int x1 = tx * HWC_TILE_SIZE, y1 = ty * HWC_TILE_SIZE;
+    int x2 = min(x1 + HWC_TILE_SIZE, width), y2 = min(y1 + HWC_TILE_SIZE, height);
+    const uint8_t *row = pixels + (size_t) y1 * pitch + (size_t) x1 * cpp;
+    uint64_t acc[2] = { HWC_HASH_PRIME1, HWC_HASH_PRIME2 };
+    int y;
+
+    for (y = y1; y < y2; y++, row += pitch) {
+        hwc_tilehash_row(acc, row, (size_t) (x2 - x1) * cpp);
+        acc[0] = acc[0] * HWC_HASH_PRIME1 + y;
+    }
+
+    hwc->tileHash.bytes += (uint64_t) (x2 - x1) * (y2 - y1) * cpp;
+    return hwc_tilehash_avalanche(acc[0] ^ ((acc[1] << 29) | (acc[1] >> 35)));
+}
+
+/* Tiles covered by box, as [tiles->x1, tiles->x2) x [tiles->y1, tiles->y2) */
+static void hwc_tilehash_tiles(const hwc_tilehash *th, const BoxRec *box, BoxPtr tiles)
+{
+    tiles->x1 = max(box->x1, 0) / HWC_TILE_SIZE;
+    tiles->y1 = max(box->y1, 0) / HWC_TILE_SIZE;
+    tiles->x2 = min((box->x2 + HWC_TILE_SIZE - 1) / HWC_TILE_SIZE, th->cols);
+    tiles->y2 = min((box->y2 + HWC_TILE_SIZE - 1) / HWC_TILE_SIZE, th->rows);
+}
+
+/* Hash the tiles under box that haven't been hashed yet in this pass */
+static void hwc_tilehash_box(ScrnInfoPtr pScrn, const uint8_t *pixels, const BoxRec *box)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_tilehash *th = &hwc->tileHash;
+    int cpp = pScrn->bitsPerPixel / 8;
+    BoxRec tiles;
+    int tx, ty;
+
+    hwc_tilehash_tiles(th, box, &tiles);
+    for (ty = tiles.y1; ty < tiles.y2; ty++) {
+        for (tx = tiles.x1; tx < tiles.x2; tx++) {
+            size_t idx = (size_t) ty * th->cols + tx;
+            uint64_t hash;
+
+            if (th->flags[idx] & HWC_TILE_HASHED)
+                continue;
+
+            hash = hwc_tilehash_tile(hwc, pixels, cpp, tx, ty,
+                                     pScrn->virtualX, pScrn->virtualY);
+            th->tiles++;
+
+            if (!(th->flags[idx] & HWC_TILE_KNOWN) || th->hashes[idx] != hash)
+                th->flags[idx] |= HWC_TILE_CHANGED;
+            th->flags[idx] |= HWC_TILE_KNOWN | HWC_TILE_HASHED;
+            th->hashes[idx] = hash;
+        }
+    }
+}
+
+static Bool hwc_tilehash_box_changed(const hwc_tilehash *th, const BoxRec *box)
+{
+    BoxRec tiles;
+    int tx, ty;
+
+    hwc_tilehash_tiles(th, box, &tiles);
+    for (ty = tiles.y1; ty < tiles.y2; ty++)
+        for (tx = tiles.x1; tx < tiles.x2; tx++)
+            if (th->flags[(size_t) ty * th->cols + tx] & HWC_TILE_CHANGED)
+                return TRUE;
+    return FALSE;
+}
+
+static void hwc_tilehash_box_reset(hwc_tilehash *th, const BoxRec *box)
+{
+    BoxRec tiles;
+    int tx, ty;
+
+    hwc_tilehash_tiles(th, box, &tiles);
+    for (ty = tiles.y1; ty < tiles.y2; ty++)
+        for (tx = tiles.x1; tx < tiles.x2; tx++)
+            th->flags[(size_t) ty * th->cols + tx] &= HWC_TILE_KNOWN;
+}
+
+void hwc_tilehash_init(ScrnInfoPtr pScrn, Bool enabled)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_tilehash *th = &hwc->tileHash;
+
+    memset(th, 0, sizeof(*th));
+    if (!enabled)
+        return;
+
+    if (hwc->glamor) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                   "TileHash has no effect with glamor, root pixels are on the GPU\n");
+        return;
+    }
+
+    th->cols = (pScrn->virtualX + HWC_TILE_SIZE - 1) / HWC_TILE_SIZE;
+    th->rows = (pScrn->virtualY + HWC_TILE_SIZE - 1) / HWC_TILE_SIZE;
+    th->hashes = calloc((size_t) th->cols * th->rows, sizeof(uint64_t));
+    th->flags = calloc((size_t) th->cols * th->rows, sizeof(uint8_t));
+    if (!th->hashes || !th->flags) {
+        free(th->hashes);
+        free(th->flags);
+        th->hashes = NULL;
+        th->flags = NULL;
+        return;
+    }
+
+    th->enabled = TRUE;
+    xf86DrvMsg(pScrn->scrnIndex, X_CONFIG, "dropping unchanged damage, %dx%d tiles of %d pixels\n",
+               th->cols, th->rows, HWC_TILE_SIZE);
+}
+
+void hwc_tilehash_close(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_tilehash *th = &hwc->tileHash;
+
+    if (!th->enabled)
+        return;
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+               "tile hash: %llu of %llu damage reports dropped, %llu tiles hashed in %llu us\n",
+               (unsigned long long) th->skipped, (unsigned long long) th->reports,
+               (unsigned long long) th->tiles, (unsigned long long) th->time);
+
+    free(th->hashes);
+    free(th->flags);
+    th->hashes = NULL;
+    th->flags = NULL;
+    th->enabled = FALSE;
+}
+
+/* The root changed size, start over with every tile unknown */
+void hwc_tilehash_resize(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_tilehash *th = &hwc->tileHash;
+    int cols = (pScrn->virtualX + HWC_TILE_SIZE - 1) / HWC_TILE_SIZE;
+    int rows = (pScrn->virtualY + HWC_TILE_SIZE - 1) / HWC_TILE_SIZE;
+    uint64_t *hashes;
+    uint8_t *flags;
+
+    if (!th->enabled)
+        return;
+
+    hashes = calloc((size_t) cols * rows, sizeof(uint64_t));
+    flags = calloc((size_t) cols * rows, sizeof(uint8_t));
+    if (!hashes || !flags) {
+        free(hashes);
+        free(flags);
+        hwc_tilehash_close(pScrn);
+        return;
+    }
+
+    free(th->hashes);
+    free(th->flags);
+    th->hashes = hashes;
+    th->flags = flags;
+    th->cols = cols;
+    th->rows = rows;
+}
+
+/*
+ * Remove the rectangles of damage that didn't change any pixels. Returns
+ * FALSE if nothing is left. A tile touched by several rectangles is only
+ * hashed once per call.
+ */
+Bool hwc_tilehash_filter(ScrnInfoPtr pScrn, RegionPtr damage)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    hwc_tilehash *th = &hwc->tileHash;
+    const uint8_t *pixels = hwc->shadow ? hwc->shadow : hwc->rootPixels;
+    const BoxRec *box;
+    RegionRec changed;
+    uint64_t start;
+    int i, n, kept = 0;
+
+    if (!th->enabled || !pixels)
+        return TRUE;
+
+    th->reports++;
+    start = hwc_stats_now_us();
+
+    box = RegionRects(damage);
+    n = RegionNumRects(damage);
+    for (i = 0; i < n; i++)
+        hwc_tilehash_box(pScrn, pixels, &box[i]);
+
+    RegionNull(&changed);
+    for (i = 0; i < n; i++) {
+        if (hwc_tilehash_box_changed(th, &box[i])) {
+            RegionRec r;
+
+            RegionInit(&r, (BoxPtr) &box[i], 1);
+            RegionUnion(&changed, &changed, &r);
+            RegionUninit(&r);
+            kept++;
+        }
+    }
+
+    for (i = 0; i < n; i++)
+        hwc_tilehash_box_reset(th, &box[i]);
+
+    if (kept && kept < n)
+        RegionCopy(damage, &changed);
+    RegionUninit(&changed);
+
+    th->time += hwc_stats_now_us() - start;
+
+    if (!kept) {
+        th->skipped++;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void hwc_tilehash_write_json(FILE *f, HWCPtr hwc)
+{
+    hwc_tilehash *th = &hwc->tileHash;
+
+    fprintf(f, "{\"damage_reports\":%llu,\"skipped\":%llu,\"skip_ratio\":%.3f,"
+               "\"tiles_hashed\":%llu,\"bytes_hashed\":%llu,\"hash_us\":%llu}",
+            (unsigned long long) th->reports,
+            (unsigned long long) th->skipped,
+            th->reports ? (double) th->skipped / th->reports : 0.0,
+            (unsigned long long) th->tiles,
+            (unsigned long long) th->bytes,
+            (unsigned long long) th->time);
+}
@@ -0,0 +1,520 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "xf86.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "driver.h"
+
+/*
+ * Frame traces: Option "TraceFile" records, for every composed frame, the
+ * damaged rectangles, the cursor state, the rotation and optionally the
+ * damaged pixels of the root buffer. Option "TraceReplay" feeds such a
+ * recording back through hwc_update() at full speed, in slices of the
+ * update timer, so a session can be profiled offline (e.g. on the mock
+ * HAL) with the real renderer code.
+ *
+ * File layout, host byte order:
+ *
+ *   header:  "HWCTRACE" u32 version u32 width u32 height u32 flags
+ *   frame:   u32 'FRAM' u32 size, then size bytes of
+ *            u64 time_us i32 cursor_x i32 cursor_y u32 cursor_shown
+ *            u32 rotation u32 num_rects, num_rects * (i16 x1 y1 x2 y2),
+ *            and with HWC_TRACE_PIXELS, for every rect row by row the
+ *            RLE-coded 32-bit pixels: u32 n | 0x80000000 followed by one
+ *            pixel repeated n times, or u32 n followed by n literal pixels.
+ */
+
+#define HWC_TRACE_MAGIC "HWCTRACE"
+#define HWC_TRACE_VERSION 1
+#define HWC_TRACE_FRAME_TAG 0x4d415246 /* 'FRAM' */
+#define HWC_TRACE_PIXELS 1
+#define HWC_TRACE_RUN 0x80000000U
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t flags;
+} hwc_trace_header;
+
+typedef struct {
+    uint64_t time;
+    int32_t cursorX;
+    int32_t cursorY;
+    uint32_t cursorShown;
+    uint32_t rotation;
+    uint32_t numRects;
+} hwc_trace_frame;
+
+struct hwc_trace {
+    FILE *file;
+    hwc_trace_header header;
+    uint8_t *buf;
+    size_t size;
+    size_t used;
+    /* the buffer couldn't grow, the frame is incomplete */
+    Bool failed;
+    /* end of the last complete frame in the file */
+    off_t offset;
+    uint64_t frames;
+};
+
+static Bool hwc_trace_reserve(struct hwc_trace *trace, size_t bytes)
+{
+    size_t size = trace->size ? trace->size : 4096;
+    uint8_t *buf;
+
+    if (trace->used + bytes <= trace->size)
+        return TRUE;
+
+    while (size < trace->used + bytes)
+        size *= 2;
+
+    buf = realloc(trace->buf, size);
+    if (!buf)
+        return FALSE;
+
+    trace->buf = buf;
+    trace->size = size;
+    return TRUE;
+}
+
+static void hwc_trace_put(struct hwc_trace *trace, const void *data, size_t bytes)
+{
+    if (trace->failed)
+        return;
+    if (!hwc_trace_reserve(trace, bytes)) {
+        trace->failed = TRUE;
+        return;
+    }
+
+    memcpy(trace->buf + trace->used, data, bytes);
+    trace->used += bytes;
+}
+
+static void hwc_trace_put_u32(struct hwc_trace *trace, uint32_t v)
+{
+    hwc_trace_put(trace, &v, sizeof(v));
+}
+
+static void hwc_trace_put_pixels(struct hwc_trace *trace, const uint32_t *p, int n)
+{
+    int i = 0;
+
+    while (i < n) {
+        int run = 1;
+
+        while (i + run < n && p[i + run] == p[i])
+            run++;
+
+        if (run >= 3) {
+            hwc_trace_put_u32(trace, HWC_TRACE_RUN | run);
+            hwc_trace_put_u32(trace, p[i]);
+            i += run;
+        } else {
+            int j = i;
+
+            while (j < n && !(j + 2 < n && p[j] == p[j + 1] && p[j] == p[j + 2]))
+                j++;
+            hwc_trace_put_u32(trace, j - i);
+            hwc_trace_put(trace, p + i, (j - i) * sizeof(uint32_t));
+            i = j;
+        }
+    }
+}
+
+/* Unbuffered, so a failed frame can be cut off the file completely */
+static Bool hwc_trace_write(struct hwc_trace *trace)
+{
+    const uint8_t *p = trace->buf;
+    size_t left = trace->used;
+
+    while (left) {
+        ssize_t n = write(fileno(trace->file), p, left);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return FALSE;
+        p += n;
+        left -= n;
+    }
+    return TRUE;
+}
+
+Bool hwc_trace_open(ScrnInfoPtr pScrn, const char *path, Bool pixels)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    struct hwc_trace *trace;
+
+    if (pScrn->bitsPerPixel != 32) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                   "frame traces need a 32 bpp root, not tracing\n");
+        return FALSE;
+    }
+
+    trace = calloc(1, sizeof(struct hwc_trace));
+    if (!trace)
+        return FALSE;
+
+    trace->file = fopen(path, "wb");
+    if (!trace->file) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING, "failed to open trace file %s: %s\n",
+                   path, strerror(errno));
+        free(trace);
+        return FALSE;
+    }
+
+    memcpy(trace->header.magic, HWC_TRACE_MAGIC, sizeof(trace->header.magic));
+    trace->header.version = HWC_TRACE_VERSION;
+    trace->header.width = pScrn->virtualX;
+    trace->header.height = pScrn->virtualY;
+    trace->header.flags = pixels ? HWC_TRACE_PIXELS : 0;
+    /* frames are written to the fd directly, see hwc_trace_write */
+    fwrite(&trace->header, sizeof(trace->header), 1, trace->file);
+    fflush(trace->file);
+    trace->offset = sizeof(trace->header);
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "recording frame trace to %s%s\n",
+               path, pixels ? " with pixel contents" : "");
+
+    hwc->trace = trace;
+    hwc->trackFrameDamage = TRUE;
+    return TRUE;
+}
+
+void hwc_trace_close(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    struct hwc_trace *trace = hwc->trace;
+
+    if (!trace)
+        return;
+
+    xf86DrvMsg(pScrn->scrnIndex, X_INFO, "frame trace: %llu frames recorded\n",
+               (unsigned long long) trace->frames);
+
+    fclose(trace->file);
+    free(trace->buf);
+    free(trace);
+    hwc->trace = NULL;
+}
+
+/*
+ * Record the frame about to be composed. Must be called while the root
+ * buffer is still locked for CPU access.
+ */
+void hwc_trace_capture(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    HWCPtr hwc = HWCPTR(pScrn);
+    struct hwc_trace *trace = hwc->trace;
+    RegionPtr damage = &hwc->frameDamage;
+    int nbox = RegionNumRects(damage);
+    BoxPtr box = RegionRects(damage);
+    /* a root without gralloc buffer is in system memory */
+    const void *pixels = hwc->buffer ? hwc->rootPixels : hwc->shadow;
+    hwc_cursor_state cursor;
+    hwc_trace_frame frame;
+    uint32_t size;
+    int i, y;
+
+    if (!trace)
+        return;
+
+    hwc_cursor_snapshot(&hwc->cursorState, &cursor);
+
+    frame.time = hwc_stats_now_us();
+    frame.cursorX = cursor.x;
+    frame.cursorY = cursor.y;
+    frame.cursorShown = cursor.shown;
+    frame.rotation = hwc->rotation;
+    frame.numRects = RegionNotEmpty(damage) ? nbox : 0;
+
+    trace->used = 0;
+    trace->failed = FALSE;
+    hwc_trace_put_u32(trace, HWC_TRACE_FRAME_TAG);
+    hwc_trace_put_u32(trace, 0);
+    hwc_trace_put(trace, &frame, sizeof(frame));
+
+    for (i = 0; i < frame.numRects; i++) {
+        int16_t r[4] = { box[i].x1, box[i].y1, box[i].x2, box[i].y2 };
+        hwc_trace_put(trace, r, sizeof(r));
+    }
+
+    if ((trace->header.flags & HWC_TRACE_PIXELS) && pixels) {
+        for (i = 0; i < frame.numRects; i++) {
+            for (y = box[i].y1; y < box[i].y2; y++) {
+                const uint32_t *row = (const uint32_t *) pixels +
+                                      (size_t) y * hwc->stride + box[i].x1;
+                hwc_trace_put_pixels(trace, row, box[i].x2 - box[i].x1);
+            }
+        }
+    }
+
+    /* a partial frame would make the rest of the file unreadable */
+    if (trace->failed) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                   "frame trace stopped, out of memory for frame %llu\n",
+                   (unsigned long long) trace->frames);
+        hwc_trace_close(pScrn);
+        return;
+    }
+
+    size = trace->used - 8;
+    memcpy(trace->buf + 4, &size, sizeof(size));
+    if (!hwc_trace_write(trace)) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                   "frame trace stopped, failed to write frame %llu: %s\n",
+                   (unsigned long long) trace->frames, strerror(errno));
+        /* drop what made it to the file */
+        if (ftruncate(fileno(trace->file), trace->offset) < 0)
+            xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                       "frame trace: failed to drop the partial frame: %s\n",
+                       strerror(errno));
+        hwc_trace_close(pScrn);
+        return;
+    }
+    trace->offset += trace->used;
+    trace->frames++;
+}
+
+static Bool hwc_trace_get(const uint8_t **p, const uint8_t *end, void *out, size_t bytes)
+{
+    if ((size_t) (end - *p) < bytes)
+        return FALSE;
+
+    memcpy(out, *p, bytes);
+    *p += bytes;
+    return TRUE;
+}
+
+static Bool hwc_trace_get_pixels(const uint8_t **p, const uint8_t *end,
+                                 uint32_t *row, int n)
+{
+    int i = 0;
+
+    while (i < n) {
+        uint32_t hdr, count, pixel;
+
+        if (!hwc_trace_get(p, end, &hdr, sizeof(hdr)))
+            return FALSE;
+
+        count = hdr & ~HWC_TRACE_RUN;
+        if (count > (uint32_t) (n - i))
+            return FALSE;
+
+        if (hdr & HWC_TRACE_RUN) {
+            if (!hwc_trace_get(p, end, &pixel, sizeof(pixel)))
+                return FALSE;
+            while (count--)
+                row[i++] = pixel;
+        } else {
+            if (!hwc_trace_get(p, end, row + i, count * sizeof(uint32_t)))
+                return FALSE;
+            i += count;
+        }
+    }
+    return TRUE;
+}
+
+/* Apply one recorded frame to the root buffer and cursor state */
+static Bool hwc_trace_apply(ScrnInfoPtr pScrn, const hwc_trace_header *header,
+                            const uint8_t *p, const uint8_t *end)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    void *pixels = hwc->buffer ? hwc->rootPixels : hwc->shadow;
+    hwc_trace_frame frame;
+    const uint8_t *rects;
+    uint32_t i;
+    int y;
+
+    if (!hwc_trace_get(&p, end, &frame, sizeof(frame)))
+        return FALSE;
+
+    if ((size_t) (end - p) / 8 < frame.numRects)
+        return FALSE;
+    rects = p;
+    p += (size_t) frame.numRects * 8;
+
+    if ((header->flags & HWC_TRACE_PIXELS) && pixels) {
+        for (i = 0; i < frame.numRects; i++) {
+            int16_t r[4];
+
+            memcpy(r, rects + i * 8, sizeof(r));
+            if (r[0] < 0 || r[1] < 0 || r[0] > r[2] || r[1] > r[3] ||
+                r[2] > pScrn->virtualX || r[3] > pScrn->virtualY)
+                return FALSE;
+
+            for (y = r[1]; y < r[3]; y++) {
+                uint32_t *row = (uint32_t *) pixels +
+                                (size_t) y * hwc->stride + r[0];
+                if (!hwc_trace_get_pixels(&p, end, row, r[2] - r[0]))
+                    return FALSE;
+            }
+        }
+        /* written behind fb's back, there is no damage for it */
+        hwc->renderer.uploadAll = TRUE;
+    }
+
+    if (frame.rotation <= HWC_ROTATE_CCW)
+        hwc->rotation = frame.rotation;
+    hwc_cursor_publish(hwc, &hwc->cursorState, frame.cursorX, frame.cursorY, frame.cursorShown);
+    __atomic_store_n(&hwc->dirty, TRUE, __ATOMIC_RELEASE);
+
+    return TRUE;
+}
+
+struct hwc_trace_replay {
+    FILE *file;
+    const char *path;
+    hwc_trace_header header;
+    hwc_rotation rotation;
+    uint8_t *buf;
+    size_t bufSize;
+    uint64_t frames;
+    uint64_t busy;
+    uint64_t start;
+};
+
+/*
+ * Open a recorded trace for hwc_trace_replay_step(), which plays it back
+ * from the update timer once the screen is up.
+ */
+Bool hwc_trace_replay_open(ScrnInfoPtr pScrn, const char *path)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    struct hwc_trace_replay *replay;
+    hwc_trace_header header;
+    FILE *f;
+
+    f = fopen(path, "rb");
+    if (!f) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING, "failed to open trace %s: %s\n",
+                   path, strerror(errno));
+        return FALSE;
+    }
+
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        memcmp(header.magic, HWC_TRACE_MAGIC, sizeof(header.magic)) ||
+        header.version != HWC_TRACE_VERSION) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING, "%s is not a frame trace\n", path);
+        fclose(f);
+        return FALSE;
+    }
+
+    if (header.width != pScrn->virtualX || header.height != pScrn->virtualY ||
+        pScrn->bitsPerPixel != 32) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                   "trace %s was recorded at %ux%u, screen is %dx%d at %d bpp\n",
+                   path, header.width, header.height,
+                   pScrn->virtualX, pScrn->virtualY, pScrn->bitsPerPixel);
+        fclose(f);
+        return FALSE;
+    }
+
+    replay = calloc(1, sizeof(*replay));
+    if (!replay) {
+        fclose(f);
+        return FALSE;
+    }
+
+    replay->file = f;
+    replay->path = path;
+    replay->header = header;
+    replay->rotation = hwc->rotation;
+    hwc->replay = replay;
+    return TRUE;
+}
+
+/*
+ * Replay recorded frames through the renderer as fast as possible for
+ * up to half an update interval, then return to the server so clients
+ * and input are still served; the next timer tick goes on from there.
+ * At the end of the trace the result is logged and the trace closed,
+ * leaving the screen showing the last replayed frame.
+ */
+void hwc_trace_replay_step(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    HWCPtr hwc = HWCPTR(pScrn);
+    struct hwc_trace_replay *replay = hwc->replay;
+    uint64_t budget = (uint64_t) hwc->updateInterval * 1000 / 2;
+    uint64_t start, now;
+
+    start = now = hwc_stats_now_us();
+    if (!replay->start)
+        replay->start = start;
+
+    do {
+        uint32_t tag[2];
+
+        if (fread(tag, sizeof(tag), 1, replay->file) != 1)
+            goto done;
+        if (tag[0] != HWC_TRACE_FRAME_TAG) {
+            xf86DrvMsg(pScrn->scrnIndex, X_WARNING, "trace %s: bad frame tag\n",
+                       replay->path);
+            goto done;
+        }
+
+        if (tag[1] > replay->bufSize) {
+            uint8_t *tmp = realloc(replay->buf, tag[1]);
+            if (!tmp)
+                goto done;
+            replay->buf = tmp;
+            replay->bufSize = tag[1];
+        }
+
+        if (fread(replay->buf, 1, tag[1], replay->file) != tag[1] ||
+            !hwc_trace_apply(pScrn, &replay->header, replay->buf, replay->buf + tag[1])) {
+            xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                       "trace %s: frame %llu is truncated or corrupt\n",
+                       replay->path, (unsigned long long) replay->frames);
+            goto done;
+        }
+
+        hwc_update(pScreen);
+        replay->frames++;
+        now = hwc_stats_now_us();
+    } while (now - start < budget);
+
+    replay->busy += now - start;
+    return;
+
+done:
+    replay->busy += hwc_stats_now_us() - start;
+    hwc_trace_replay_close(pScrn);
+}
+
+/* Log the frames replayed so far and close the trace */
+void hwc_trace_replay_close(ScrnInfoPtr pScrn)
+{
+    HWCPtr hwc = HWCPTR(pScrn);
+    struct hwc_trace_replay *replay = hwc->replay;
+
+    if (!replay)
+        return;
+
+    /* the time per frame counts only the replay, not the server in between */
+    if (replay->frames)
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                   "trace replay: %llu frames in %.1f ms (%.2f ms/frame), "
+                   "%.1f ms elapsed\n",
+                   (unsigned long long) replay->frames, replay->busy / 1000.0,
+                   replay->busy / 1000.0 / replay->frames,
+                   (hwc_stats_now_us() - replay->start) / 1000.0);
+
+    hwc->rotation = replay->rotation;
+
+    fclose(replay->file);
+    free(replay->buf);
+    free(replay);
+    hwc->replay = NULL;
+}